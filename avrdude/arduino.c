@@ -28,7 +28,11 @@
 #include "ac_cfg.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/time.h>
 #include <unistd.h>
 
 #include "avrdude.h"
@@ -38,6 +42,11 @@
 #include "serial.h"
 #include "arduino.h"
 
+#define ARDUINO_RESET_PULSE   250   /* ms the reset line is held inactive */
+#define ARDUINO_SYNC_DEADLINE 1500  /* ms after reset to keep polling */
+#define ARDUINO_POLL_TIMEOUT  30    /* ms to wait for the answer to a poll */
+#define ARDUINO_DELAY_FILE    ".avrdude_arduino"
+
 /* read signature bytes - arduino version */
 static int arduino_read_sig_bytes(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m)
 {
@@ -83,27 +92,173 @@ static int arduino_read_sig_bytes(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m)
   return 3;
 }
 
-static int arduino_open(PROGRAMMER * pgm, char * port)
+/* Microseconds on a clock that does not jump */
+static long long arduino_now(void)
 {
-  strcpy(pgm->port, port);
-  if (serial_open(port, pgm->baudrate? pgm->baudrate: 115200, &pgm->fd)==-1) {
-    return -1;
+#if defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+#endif
+  struct timeval tv;
+
+#if defined(CLOCK_MONOTONIC)
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+#endif
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+
+/*
+ * The time from releasing reset to the bootloader answering is
+ * remembered per programmer in ~/.avrdude_arduino, one "id usec" line
+ * each.
+ */
+static char * arduino_delay_file(char * buf, size_t size)
+{
+  const char *home = getenv("HOME");
+
+  if (home == NULL || *home == 0 ||
+      strlen(home) + strlen(ARDUINO_DELAY_FILE) + 2 > size)
+    return NULL;
+  sprintf(buf, "%s%s%s", home,
+          home[strlen(home) - 1] == '/'? "": "/", ARDUINO_DELAY_FILE);
+  return buf;
+}
+
+
+static long arduino_delay_lookup(PROGRAMMER * pgm)
+{
+  char fname[PATH_MAX], line[256], id[256];
+  long usec;
+  FILE *f;
+
+  if (arduino_delay_file(fname, sizeof(fname)) == NULL ||
+      (f = fopen(fname, "r")) == NULL)
+    return 0;
+
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (sscanf(line, "%255s %ld", id, &usec) == 2 &&
+        strcmp(id, ldata(lfirst(pgm->id))) == 0) {
+      fclose(f);
+      return usec;
+    }
+  }
+  fclose(f);
+
+  return 0;
+}
+
+
+static void arduino_delay_store(PROGRAMMER * pgm, long usec)
+{
+  char fname[PATH_MAX], tmpname[PATH_MAX + 4], line[256], id[256];
+  long d;
+  FILE *in, *out;
+
+  if (arduino_delay_file(fname, sizeof(fname)) == NULL)
+    return;
+  sprintf(tmpname, "%s.new", fname);
+  if ((out = fopen(tmpname, "w")) == NULL)
+    return;
+
+  if ((in = fopen(fname, "r")) != NULL) {
+    while (fgets(line, sizeof(line), in) != NULL) {
+      if (sscanf(line, "%255s %ld", id, &d) != 2 ||
+          strcmp(id, ldata(lfirst(pgm->id))) == 0)
+        continue;
+      fputs(line, out);
+    }
+    fclose(in);
   }
+  fprintf(out, "%s %ld\n", (char *)ldata(lfirst(pgm->id)), usec);
+
+  if (fclose(out) != 0 || rename(tmpname, fname) != 0)
+    remove(tmpname);
+}
+
+
+/*
+ * Reset the board and poll the bootloader with GET_SYNC until it
+ * answers.  Polling starts shortly before the bootloader answered last
+ * time; drains only take what has already arrived.  Returns -1 if
+ * there was no answer before the deadline.
+ */
+static int arduino_sync(PROGRAMMER * pgm)
+{
+  unsigned char buf[2], resp[2];
+  long saved_recv_timeout = serial_recv_timeout;
+  long saved_drain_timeout = serial_drain_timeout;
+  long long start, elapsed;
+  long learned;
+  int rc = -1;
+
+  learned = arduino_delay_lookup(pgm);
 
   /* Clear DTR and RTS to unload the RESET capacitor 
    * (for example in Arduino) */
   serial_set_dtr_rts(&pgm->fd, 0);
-  usleep(250*1000);
+  usleep(ARDUINO_RESET_PULSE * 1000);
   /* Set DTR and RTS back to high */
   serial_set_dtr_rts(&pgm->fd, 1);
-  usleep(50*1000);
+  start = arduino_now();
+
+  if (learned > 0 && learned < ARDUINO_SYNC_DEADLINE * 1000L)
+    usleep(learned * 3 / 4);
+
+  serial_recv_timeout = ARDUINO_POLL_TIMEOUT;
+  serial_drain_timeout = 0;
+  serial_drain(&pgm->fd, 0);
+
+  buf[0] = Cmnd_STK_GET_SYNC;
+  buf[1] = Sync_CRC_EOP;
+  do {
+    serial_send(&pgm->fd, buf, 2);
+    if (serial_recv(&pgm->fd, resp, 2) == 0 &&
+        resp[0] == Resp_STK_INSYNC && resp[1] == Resp_STK_OK) {
+      rc = 0;
+      break;
+    }
+    serial_drain(&pgm->fd, 0);
+    elapsed = arduino_now() - start;
+  } while (elapsed < ARDUINO_SYNC_DEADLINE * 1000LL);
+  elapsed = arduino_now() - start;
+
+  /* Answers to earlier polls may still be on their way. */
+  serial_drain_timeout = ARDUINO_POLL_TIMEOUT;
+  serial_drain(&pgm->fd, 0);
+
+  serial_recv_timeout = saved_recv_timeout;
+  serial_drain_timeout = saved_drain_timeout;
+
+  if (rc == 0) {
+    if (verbose)
+      fprintf(stderr, "%s: arduino_sync(): bootloader answered after %ld ms\n",
+              progname, (long)(elapsed / 1000));
+    arduino_delay_store(pgm, (long)elapsed);
+  }
+
+  return rc;
+}
+
+static int arduino_open(PROGRAMMER * pgm, char * port)
+{
+  strcpy(pgm->port, port);
+  if (serial_open(port, pgm->baudrate? pgm->baudrate: 115200, &pgm->fd)==-1) {
+    return -1;
+  }
 
   /*
-   * drain any extraneous input
+   * Reset the board and catch the bootloader; fall back to the slow
+   * STK500 sync if it doesn't answer in time.
    */
-  stk500_drain(pgm, 0);
+  if (arduino_sync(pgm) < 0) {
+    stk500_drain(pgm, 0);
+    if (stk500_getsync(pgm) < 0)
+      return -1;
+  }
 
-  if (stk500_getsync(pgm) < 0)
+  if (stk500_negotiate_baud(pgm) < 0)
     return -1;
 
   return 0;
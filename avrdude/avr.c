@@ -42,6 +42,20 @@ FP_UpdateProgress update_progress;
 
 #define DEBUG 0
 
+/* Xmega NVM controller registers, relative to the part's nvm_base */
+#define XMEGA_NVM_ADDR0         0x00
+#define XMEGA_NVM_DATA0         0x04
+#define XMEGA_NVM_CMD           0x0A
+#define XMEGA_NVM_CTRLA         0x0B
+# define XMEGA_NVM_CMDEX          0x01
+#define XMEGA_NVM_STATUS        0x0F
+# define XMEGA_NVM_BUSY           0x80
+
+/* Xmega NVM commands, for XMEGA_NVM_CMD */
+#define XMEGA_NVM_APP_CRC       0x38
+#define XMEGA_NVM_BOOT_CRC      0x39
+#define XMEGA_NVM_FLASH_RANGE_CRC 0x3A
+
 /* TPI: returns 1 if NVM controller busy, 0 if free */
 int avr_tpi_poll_nvmbsy(PROGRAMMER *pgm)
 {
@@ -153,8 +167,8 @@ int avr_tpi_program_enable(PROGRAMMER * pgm, AVRPART * p, unsigned char guard_ti
 }
 
 /* TPI: setup NVMCMD register and pointer register (PR) for read/write/erase */
-static int avr_tpi_setup_rw(PROGRAMMER * pgm, AVRMEM * mem,
-			    unsigned long addr, unsigned char nvmcmd)
+int avr_tpi_setup_rw(PROGRAMMER * pgm, AVRMEM * mem,
+                     unsigned long addr, unsigned char nvmcmd)
 {
   unsigned char cmd[4];
   int rc;
@@ -305,11 +319,28 @@ int avr_mem_hiaddr(AVRMEM * mem)
 }
 
 
+static FP_ReadSink read_sink;
+static void * read_sink_ctx;
+
+/*
+ * Have avr_read() call sink whenever another part of the memory has
+ * been read completely, so it can already be processed while the rest
+ * is still being read.  Pass NULL to stop.
+ */
+void avr_set_read_sink(FP_ReadSink sink, void * ctx)
+{
+  read_sink = sink;
+  read_sink_ctx = ctx;
+}
+
+
 /*
  * Read the entirety of the specified memory type into the
  * corresponding buffer of the avrpart pointed to by 'p'.
  * If v is non-NULL, verify against v's memory area, only
  * those cells that are tagged TAG_ALLOCATED are verified.
+ * (Only these cells, or the pages holding them, are read, which
+ * also serves to read an address range.)
  *
  * Return the number of bytes read, or < 0 if an error occurs.  
  */
@@ -330,11 +361,41 @@ int avr_read(PROGRAMMER * pgm, AVRPART * p, char * memtype,
     return -1;
   }
 
+  /* the buffer might still be shared with v */
+  if (avr_mem_unshare(mem) < 0)
+    return -1;
+
   /*
    * start with all 0xff
    */
   memset(mem->buf, 0xff, mem->size);
 
+  /*
+   * TPI programmers with a block interface get each run of
+   * interesting bytes in a single call
+   */
+  if ((p->flags & AVRPART_HAS_TPI) && mem->page_size != 0 &&
+      pgm->tpi_block_read != NULL) {
+    unsigned long start;
+
+    for (i = 0; i < mem->size; ) {
+      if (vmem != NULL && (vmem->tags[i] & TAG_ALLOCATED) == 0) {
+        i++;
+        continue;
+      }
+      for (start = i; i < mem->size; i++)
+        if (vmem != NULL && (vmem->tags[i] & TAG_ALLOCATED) == 0)
+          break;
+      rc = pgm->tpi_block_read(pgm, p, mem, start, i - start);
+      if (rc < 0) {
+        fprintf(stderr, "avr_read(): error reading address 0x%04lx\n", start);
+        return -1;
+      }
+      report_progress(i, mem->size, NULL);
+    }
+    return avr_mem_hiaddr(mem);
+  }
+
   /* supports "paged load" thru post-increment */
   if ((p->flags & AVRPART_HAS_TPI) && mem->page_size != 0 &&
       pgm->cmd_tpi != NULL) {
@@ -384,7 +445,7 @@ int avr_read(PROGRAMMER * pgm, AVRPART * p, char * memtype,
            i < pageaddr + mem->page_size;
            i++)
         if (vmem == NULL /* no verify, read everything */ ||
-            (mem->tags[i] & TAG_ALLOCATED) != 0 /* verify, do only
+            (vmem->tags[i] & TAG_ALLOCATED) != 0 /* verify, do only
                                                     read pages that
                                                     are needed in
                                                     input file */) {
@@ -421,7 +482,16 @@ int avr_read(PROGRAMMER * pgm, AVRPART * p, char * memtype,
       }
       nread++;
       report_progress(nread, npages, NULL);
+      if (!failure && vmem == NULL && read_sink != NULL &&
+          read_sink(read_sink_ctx, pageaddr + mem->page_size) < 0) {
+        if (pgm->paged_flush != NULL)
+          pgm->paged_flush(pgm, p, mem);
+        return -1;
+      }
     }
+    /* don't leave reads ahead outstanding for a buffer about to go away */
+    if (pgm->paged_flush != NULL)
+      pgm->paged_flush(pgm, p, mem);
     if (!failure) {
       if (strcasecmp(mem->desc, "flash") == 0 ||
           strcasecmp(mem->desc, "application") == 0 ||
@@ -807,6 +877,10 @@ int avr_write_byte(PROGRAMMER * pgm, AVRPART * p, AVRMEM * mem,
   unsigned char safemode_efuse;
   unsigned char safemode_fuse;
 
+  /* some programmers route single bytes through the page buffer */
+  if (avr_mem_alloc(mem) < 0)
+    return -1;
+
   /* If we write the fuses, then we need to tell safemode that they *should* change */
   safemode_memfuses(0, &safemode_lfuse, &safemode_hfuse, &safemode_efuse, &safemode_fuse);
 
@@ -829,6 +903,23 @@ int avr_write_byte(PROGRAMMER * pgm, AVRPART * p, AVRMEM * mem,
 }
 
 
+/*
+ * Check whether the page at addr holds anything to write.  With
+ * skip_erased, bytes that are 0xff need not be written.
+ */
+static int avr_page_dirty(AVRMEM * m, unsigned int addr, int skip_erased)
+{
+  unsigned int i;
+
+  for (i = addr; i < addr + m->page_size; i++)
+    if ((m->tags[i] & TAG_ALLOCATED) != 0 &&
+        (!skip_erased || m->buf[i] != 0xff))
+      return 1;
+
+  return 0;
+}
+
+
 /*
  * Write the whole memory region of the specified memory from the
  * corresponding buffer of the avrpart pointed to by 'p'.  Write up to
@@ -836,10 +927,14 @@ int avr_write_byte(PROGRAMMER * pgm, AVRPART * p, AVRMEM * mem,
  * value is different from the existing data value.  Data beyond
  * 'size' bytes is not affected.
  *
+ * flags is a combination of AVR_WRITE_AUTO_ERASE, to erase each page
+ * before writing it, and AVR_WRITE_ERASED, telling that the chip has
+ * been erased so flash bytes of 0xff need not be written.
+ *
  * Return the number of bytes written, or -1 if an error occurs.
  */
 int avr_write(PROGRAMMER * pgm, AVRPART * p, char * memtype, int size, 
-              int auto_erase)
+              int flags)
 {
   int              rc;
   int              newpage, page_tainted, flush_page, do_write;
@@ -847,6 +942,7 @@ int avr_write(PROGRAMMER * pgm, AVRPART * p, char * memtype, int size,
   unsigned int     i, lastaddr;
   unsigned char    data;
   int              werror;
+  int              skip_erased;
   unsigned char    cmd[4];
   AVRMEM         * m;
 
@@ -857,6 +953,16 @@ int avr_write(PROGRAMMER * pgm, AVRPART * p, char * memtype, int size,
     return -1;
   }
 
+  /* a chip erase leaves flash, but not necessarily EEPROM, at 0xff */
+  skip_erased = (flags & AVR_WRITE_ERASED) != 0 &&
+    (strcmp(m->desc, "flash") == 0 ||
+     strcmp(m->desc, "application") == 0 ||
+     strcmp(m->desc, "apptable") == 0 ||
+     strcmp(m->desc, "boot") == 0);
+
+  if (avr_mem_alloc(m) < 0)
+    return -1;
+
   pgm->err_led(pgm, OFF);
 
   werror  = 0;
@@ -875,6 +981,36 @@ int avr_write(PROGRAMMER * pgm, AVRPART * p, char * memtype, int size,
   }
 
 
+  if ((p->flags & AVRPART_HAS_TPI) && m->page_size != 0 &&
+      pgm->tpi_block_write != NULL) {
+    unsigned int start;
+
+    /* make sure it's aligned to a word boundary */
+    if (wsize & 0x1) {
+      wsize++;
+    }
+
+    /* write each run of words holding data as one block */
+    for (i = 0; i < wsize; ) {
+      if ((m->tags[i] & TAG_ALLOCATED) == 0 &&
+          (m->tags[i + 1] & TAG_ALLOCATED) == 0) {
+        i += 2;
+        continue;
+      }
+      for (start = i; i < wsize; i += 2)
+        if ((m->tags[i] & TAG_ALLOCATED) == 0 &&
+            (m->tags[i + 1] & TAG_ALLOCATED) == 0)
+          break;
+      rc = pgm->tpi_block_write(pgm, p, m, start, i - start);
+      if (rc < 0) {
+        fprintf(stderr, "avr_write(): error writing address 0x%04x\n", start);
+        return -1;
+      }
+      report_progress(i, wsize, NULL);
+    }
+    return i;
+  }
+
   if ((p->flags & AVRPART_HAS_TPI) && m->page_size != 0 &&
       pgm->cmd_tpi != NULL) {
 
@@ -928,32 +1064,28 @@ int avr_write(PROGRAMMER * pgm, AVRPART * p, char * memtype, int size,
          pageaddr < wsize;
          pageaddr += m->page_size) {
       /* check whether this page must be written to */
-      for (i = pageaddr;
-           i < pageaddr + m->page_size;
-           i++)
-        if ((m->tags[i] & TAG_ALLOCATED) != 0) {
-          npages++;
-          break;
-        }
+      if (avr_page_dirty(m, pageaddr, skip_erased))
+        npages++;
     }
 
     for (pageaddr = 0, failure = 0, nwritten = 0;
          !failure && pageaddr < wsize;
          pageaddr += m->page_size) {
       /* check whether this page must be written to */
-      for (i = pageaddr, need_write = 0;
-           i < pageaddr + m->page_size;
-           i++)
-        if ((m->tags[i] & TAG_ALLOCATED) != 0) {
-          need_write = 1;
-          break;
-        }
+      need_write = avr_page_dirty(m, pageaddr, skip_erased);
       if (need_write) {
         rc = 0;
-        if (auto_erase)
-          rc = pgm->page_erase(pgm, p, m, pageaddr);
-        if (rc >= 0)
-          rc = pgm->paged_write(pgm, p, m, m->page_size, pageaddr, m->page_size);
+        if ((flags & AVR_WRITE_AUTO_ERASE) && pgm->paged_erase_write != NULL)
+          /* erase and write the page in one go */
+          rc = pgm->paged_erase_write(pgm, p, m, m->page_size, pageaddr,
+                                      m->page_size);
+        else {
+          if (flags & AVR_WRITE_AUTO_ERASE)
+            rc = pgm->page_erase(pgm, p, m, pageaddr);
+          if (rc >= 0)
+            rc = pgm->paged_write(pgm, p, m, m->page_size, pageaddr,
+                                  m->page_size);
+        }
         if (rc < 0)
           /* paged write failed, fall back to byte-at-a-time write below */
           failure = 1;
@@ -965,6 +1097,10 @@ int avr_write(PROGRAMMER * pgm, AVRPART * p, char * memtype, int size,
       nwritten++;
       report_progress(nwritten, npages, NULL);
     }
+    /* the answers to the last pages may still be outstanding */
+    if (!failure && pgm->paged_flush != NULL &&
+        pgm->paged_flush(pgm, p, m) < 0)
+      failure = 1;
     if (!failure)
       return wsize;
     /* else: fall back to byte-at-a-time write, for historical reasons */
@@ -995,7 +1131,8 @@ int avr_write(PROGRAMMER * pgm, AVRPART * p, char * memtype, int size,
      * tainted page, the write operation must also be invoked in order
      * to actually write the page buffer to memory.
      */
-    do_write = (m->tags[i] & TAG_ALLOCATED) != 0;
+    do_write = (m->tags[i] & TAG_ALLOCATED) != 0 &&
+      (!skip_erased || data != 0xff);
     if (m->paged) {
       if (newpage) {
         page_tainted = do_write;
@@ -1109,6 +1246,9 @@ int avr_verify(AVRPART * p, AVRPART * v, char * memtype, int size)
     return -1;
   }
 
+  if (avr_mem_alloc(a) < 0 || avr_mem_alloc(b) < 0)
+    return -1;
+
   buf1  = a->buf;
   buf2  = b->buf;
   vsize = a->size;
@@ -1140,6 +1280,136 @@ int avr_verify(AVRPART * p, AVRPART * v, char * memtype, int size)
 }
 
 
+/*
+ * The checksum the XMEGA NVM controller computes for its CRC
+ * commands: a 24-bit CRC (polynomial 0x80001B) fed with the memory
+ * contents as little-endian 16-bit words.  Only the XMEGA A and D
+ * parts (AVRPART_NVM_CRC24) compute this one; the others use their
+ * CRC module.
+ */
+unsigned long avr_xmega_crc(const unsigned char * buf, int len)
+{
+  unsigned long crc = 0;
+  int i;
+
+  for (i = 0; i + 1 < len; i += 2) {
+    crc <<= 1;
+    if (crc & 0x1000000)
+      crc ^= 0x180001bUL;
+    crc ^= buf[i] | (buf[i + 1] << 8);
+  }
+
+  return crc & 0xffffff;
+}
+
+
+/*
+ * Have the Xmega NVM controller checksum a flash section, for
+ * programmers that can access the "data" memory over PDI but have no
+ * CRC command of their own.
+ *
+ * The sequence is the one of the NVM chapter of the XMEGA A and D
+ * manuals.  Writing CMDEX in CTRLA needs the CCP unlock only when the
+ * CPU does it; the PDI writes it directly.
+ */
+int avr_xmega_nvm_crc(PROGRAMMER * pgm, AVRPART * p, AVRMEM * mem,
+                      unsigned long * crc)
+{
+  AVRMEM * data;
+  unsigned long end = 0, base;
+  unsigned char v;
+  int cmd, i, tries;
+
+  if (strcmp(mem->desc, "application") == 0) {
+    cmd = XMEGA_NVM_APP_CRC;
+  } else if (strcmp(mem->desc, "boot") == 0) {
+    cmd = XMEGA_NVM_BOOT_CRC;
+  } else if (strcmp(mem->desc, "flash") == 0) {
+    cmd = XMEGA_NVM_FLASH_RANGE_CRC;
+    end = mem->size - 1;
+  } else {
+    return -1;
+  }
+
+  data = avr_locate_mem(p, "data");
+  if (data == NULL || pgm->read_byte == NULL || pgm->write_byte == NULL)
+    return -1;
+  base = p->nvm_base;
+
+  /* the range CRC runs from ADDR to DATA, both inclusive */
+  if (cmd == XMEGA_NVM_FLASH_RANGE_CRC) {
+    for (i = 0; i < 3; i++) {
+      if (pgm->write_byte(pgm, p, data, base + XMEGA_NVM_ADDR0 + i, 0) < 0 ||
+          pgm->write_byte(pgm, p, data, base + XMEGA_NVM_DATA0 + i,
+                          (end >> (8 * i)) & 0xff) < 0)
+        return -1;
+    }
+  }
+
+  if (pgm->write_byte(pgm, p, data, base + XMEGA_NVM_CMD, cmd) < 0 ||
+      pgm->write_byte(pgm, p, data, base + XMEGA_NVM_CTRLA,
+                      XMEGA_NVM_CMDEX) < 0)
+    return -1;
+
+  for (tries = 0; ; tries++) {
+    if (pgm->read_byte(pgm, p, data, base + XMEGA_NVM_STATUS, &v) < 0)
+      return -1;
+    if (!(v & XMEGA_NVM_BUSY))
+      break;
+    if (tries == 1000) {
+      fprintf(stderr, "%s: avr_xmega_nvm_crc(): NVM controller busy\n",
+              progname);
+      return -1;
+    }
+    usleep(1000);
+  }
+
+  *crc = 0;
+  for (i = 0; i < 3; i++) {
+    if (pgm->read_byte(pgm, p, data, base + XMEGA_NVM_DATA0 + i, &v) < 0)
+      return -1;
+    *crc |= (unsigned long)v << (8 * i);
+  }
+
+  /* leave the NVM controller idle for the programmer's own accesses */
+  return pgm->write_byte(pgm, p, data, base + XMEGA_NVM_CMD, 0) < 0? -1: 0;
+}
+
+
+/*
+ * Verify a memory by having the device checksum it, rather than
+ * reading it back.  The whole memory region is checksummed, so bytes
+ * not contained in the input file must be erased.
+ *
+ * Returns 0 if the checksums match, 1 if they differ, and -1 if the
+ * programmer cannot checksum this memory.
+ */
+int avr_verify_crc(PROGRAMMER * pgm, AVRPART * p, char * memtype)
+{
+  AVRMEM * mem;
+  unsigned long dev, host;
+
+  if (pgm->mem_crc == NULL || (p->flags & AVRPART_HAS_PDI) == 0 ||
+      (p->flags & AVRPART_NVM_CRC24) == 0)
+    return -1;
+
+  mem = avr_locate_mem(p, memtype);
+  if (mem == NULL || avr_mem_alloc(mem) < 0)
+    return -1;
+
+  if (pgm->mem_crc(pgm, p, mem, &dev) < 0)
+    return -1;
+
+  host = avr_xmega_crc(mem->buf, mem->size);
+  if (verbose >= 2) {
+    fprintf(stderr, "%s: %s CRC: device 0x%06lx, file 0x%06lx\n",
+            progname, mem->desc, dev, host);
+  }
+
+  return dev == host? 0: 1;
+}
+
+
 int avr_get_cycle_count(PROGRAMMER * pgm, AVRPART * p, int * cycles)
 {
   AVRMEM * a;
@@ -28,6 +28,12 @@
 
 typedef void (*FP_UpdateProgress)(int percent, double etime, char *hdr);
 
+typedef int (*FP_ReadSink)(void * ctx, unsigned long done);
+
+/* flags for avr_write() */
+#define AVR_WRITE_AUTO_ERASE  1   /* erase each page before writing it */
+#define AVR_WRITE_ERASED      2   /* chip is erased, skip all-0xff pages */
+
 extern struct avrpart parts[];
 
 extern FP_UpdateProgress update_progress;
@@ -39,11 +45,15 @@ extern "C" {
 int avr_tpi_poll_nvmbsy(PROGRAMMER *pgm);
 int avr_tpi_chip_erase(PROGRAMMER * pgm, AVRPART * p);
 int avr_tpi_program_enable(PROGRAMMER * pgm, AVRPART * p, unsigned char guard_time);
+int avr_tpi_setup_rw(PROGRAMMER * pgm, AVRMEM * mem,
+                     unsigned long addr, unsigned char nvmcmd);
 int avr_read_byte_default(PROGRAMMER * pgm, AVRPART * p, AVRMEM * mem,
 			  unsigned long addr, unsigned char * value);
 
 int avr_read(PROGRAMMER * pgm, AVRPART * p, char * memtype, AVRPART * v);
 
+void avr_set_read_sink(FP_ReadSink sink, void * ctx);
+
 int avr_write_page(PROGRAMMER * pgm, AVRPART * p, AVRMEM * mem,
                    unsigned long addr);
 
@@ -54,12 +64,19 @@ int avr_write_byte_default(PROGRAMMER * pgm, AVRPART * p, AVRMEM * mem,
 			   unsigned long addr, unsigned char data);
 
 int avr_write(PROGRAMMER * pgm, AVRPART * p, char * memtype, int size,
-              int auto_erase);
+              int flags);
 
 int avr_signature(PROGRAMMER * pgm, AVRPART * p);
 
 int avr_verify(AVRPART * p, AVRPART * v, char * memtype, int size);
 
+unsigned long avr_xmega_crc(const unsigned char * buf, int len);
+
+int avr_xmega_nvm_crc(PROGRAMMER * pgm, AVRPART * p, AVRMEM * mem,
+                      unsigned long * crc);
+
+int avr_verify_crc(PROGRAMMER * pgm, AVRPART * p, char * memtype);
+
 int avr_get_cycle_count(PROGRAMMER * pgm, AVRPART * p, int * cycles);
 
 int avr_put_cycle_count(PROGRAMMER * pgm, AVRPART * p, int cycles);
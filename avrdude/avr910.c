@@ -41,6 +41,7 @@
 #include "pgm.h"
 #include "avr910.h"
 #include "serial.h"
+#include "baudrate.h"
 
 /*
  * Private data for this programmer.
@@ -52,6 +53,7 @@ struct pdata
   unsigned int buffersize;
   unsigned char test_blockmode;
   unsigned char use_blockmode;
+  struct baud_ladder baudrates;   /* -x baudrates=... */
 };
 
 #define PDATA(pgm) ((struct pdata *)(pgm->cookie))
@@ -352,6 +354,16 @@ static int avr910_parseextparms(PROGRAMMER * pgm, LISTID extparms)
 
       continue;
     }
+    if (strncmp(extended_param, "baudrates=", strlen("baudrates=")) == 0) {
+      if (baud_ladder_parse(&PDATA(pgm)->baudrates,
+                            extended_param + strlen("baudrates=")) < 0) {
+        fprintf(stderr,
+                "%s: avr910_parseextparms(): invalid baud rate list '%s'\n",
+                progname, extended_param);
+        rv = -1;
+      }
+      continue;
+    }
     if (strncmp(extended_param, "no_blockmode", strlen("no_blockmode")) == 0) {
       if (verbose >= 2) {
         fprintf(stderr,
@@ -373,6 +385,17 @@ static int avr910_parseextparms(PROGRAMMER * pgm, LISTID extparms)
 }
 
 
+/*
+ * Ask for the programmer identifier; the answer doubles as a check of
+ * the line at a new speed.
+ */
+static int avr910_baud_probe(PROGRAMMER * pgm, unsigned char * resp, size_t len)
+{
+  serial_send(&pgm->fd, (unsigned char *)"S", 1);
+  return serial_recv(&pgm->fd, resp, len);
+}
+
+
 static int avr910_open(PROGRAMMER * pgm, char * port)
 {
   /*
@@ -391,6 +414,10 @@ static int avr910_open(PROGRAMMER * pgm, char * port)
    * drain any extraneous input
    */
   avr910_drain (pgm, 0);
+
+  if (baud_negotiate(pgm, &PDATA(pgm)->baudrates, pgm->baudrate,
+		     avr910_baud_probe, 7) < 0)
+    return -1;
 	
   return 0;
 }
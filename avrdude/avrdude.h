@@ -27,6 +27,7 @@ extern char progbuf[];		/* spaces same length as progname */
 extern int ovsigck;		/* override signature check (-F) */
 extern int verbose;		/* verbosity level (-v, -vv, ...) */
 extern int quell_progress;	/* quiteness level (-q, -qq) */
+extern int skipff;		/* omit erased records in hex output (-z) */
 
 #if defined(WIN32NATIVE)
 
@@ -19,6 +19,10 @@
 
 static void avrftdi_tpi_disable(PROGRAMMER *);
 static int avrftdi_tpi_program_enable(PROGRAMMER * pgm, AVRPART * p);
+static int avrftdi_tpi_block_read(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
+		unsigned int addr, unsigned int n_bytes);
+static int avrftdi_tpi_block_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
+		unsigned int addr, unsigned int n_bytes);
 
 #ifdef notyet
 static void
@@ -81,6 +85,8 @@ avrftdi_tpi_initialize(PROGRAMMER * pgm, AVRPART * p)
 
 	pgm->paged_load = NULL;
 	pgm->paged_write = NULL;
+	pgm->tpi_block_read = avrftdi_tpi_block_read;
+	pgm->tpi_block_write = avrftdi_tpi_block_write;
 
 	log_info("Setting /Reset pin low\n");
 	pgm->setpin(pgm, PIN_AVR_RESET, OFF);
@@ -169,6 +175,9 @@ avrftdi_tpi_write_byte(PROGRAMMER * pgm, unsigned char byte)
 #define TPI_FRAME_SIZE 12
 #define TPI_IDLE_BITS   2
 
+/* number of TPI frames queued into one MPSSE transfer by the block functions */
+#define TPI_BLOCK_FRAMES 32
+
 static int
 avrftdi_tpi_read_byte(PROGRAMMER * pgm, unsigned char * byte)
 {
@@ -243,6 +252,154 @@ avrftdi_cmd_tpi(PROGRAMMER * pgm, const unsigned char *cmd, int cmd_len,
 	return 0;
 }
 
+/* append the MPSSE command clocking out one TPI frame to buf */
+static unsigned char *
+avrftdi_tpi_put_frame(unsigned char * buf, uint8_t byte)
+{
+	uint16_t frame = tpi_byte2frame(byte);
+
+	*buf++ = MPSSE_DO_WRITE | MPSSE_WRITE_NEG | MPSSE_LSB;
+	*buf++ = 1;
+	*buf++ = 0;
+	*buf++ = frame & 0xff;
+	*buf++ = frame >> 8;
+
+	return buf;
+}
+
+/* append the MPSSE command clocking in one TPI frame (3 bytes) to buf */
+static unsigned char *
+avrftdi_tpi_put_read(unsigned char * buf)
+{
+	*buf++ = MPSSE_DO_READ | MPSSE_LSB;
+	*buf++ = 2;
+	*buf++ = 0;
+
+	return buf;
+}
+
+/*
+ * send a prepared MPSSE command buffer and collect the n_frames TPI
+ * frames it clocks in, decoding them into res
+ */
+static int
+avrftdi_tpi_xfer(PROGRAMMER * pgm, unsigned char * cmd, int cmd_len,
+		unsigned char * res, int n_frames)
+{
+	struct ftdi_context* ftdic = to_pdata(pgm)->ftdic;
+	unsigned char rbuf[3 * TPI_BLOCK_FRAMES];
+	uint16_t frame;
+	int i, n;
+
+	E(ftdi_write_data(ftdic, cmd, cmd_len) != cmd_len, ftdic);
+
+	for(i = 0; i < 3 * n_frames; i += n) {
+		n = ftdi_read_data(ftdic, &rbuf[i], 3 * n_frames - i);
+		E(n < 0, ftdic);
+	}
+
+	for(i = 0; i < n_frames; i++) {
+		frame = rbuf[3 * i] | (rbuf[3 * i + 1] << 8);
+		if(tpi_frame2byte(frame, &res[i])) {
+			log_err("Parity error in frame 0x%04x\n", frame);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* poll NVMCSR until the NVM controller is no longer busy */
+static int
+avrftdi_tpi_nvm_waitbusy(PROGRAMMER * pgm)
+{
+	unsigned char buf[5 + 3 + 1], *p;
+	unsigned char csr;
+
+	p = avrftdi_tpi_put_frame(buf, TPI_OP_SIN(NVMCSR));
+	p = avrftdi_tpi_put_read(p);
+	*p++ = SEND_IMMEDIATE;
+
+	do {
+		if(avrftdi_tpi_xfer(pgm, buf, p - buf, &csr, 1) < 0)
+			return -1;
+	} while(csr & NVMCSR_BSY);
+
+	return 0;
+}
+
+/*
+ * Read a block of TPI memory.  The pointer register is set up once,
+ * then up to TPI_BLOCK_FRAMES SLD_PI commands and their replies are
+ * queued into a single MPSSE transfer.
+ */
+static int
+avrftdi_tpi_block_read(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
+		unsigned int addr, unsigned int n_bytes)
+{
+	unsigned char buf[TPI_BLOCK_FRAMES * (5 + 3) + 1], *bp;
+	unsigned int done, n, i;
+
+	if(avrftdi_tpi_nvm_waitbusy(pgm) < 0 ||
+	   avr_tpi_setup_rw(pgm, m, addr, NVMCMD_NOP) < 0)
+		return -1;
+
+	for(done = 0; done < n_bytes; done += n) {
+		n = n_bytes - done;
+		if(n > TPI_BLOCK_FRAMES)
+			n = TPI_BLOCK_FRAMES;
+
+		bp = buf;
+		for(i = 0; i < n; i++) {
+			bp = avrftdi_tpi_put_frame(bp, TPI_OP_SLD_INC);
+			bp = avrftdi_tpi_put_read(bp);
+		}
+		*bp++ = SEND_IMMEDIATE;
+
+		if(avrftdi_tpi_xfer(pgm, buf, bp - buf, &m->buf[addr + done], n) < 0)
+			return -1;
+	}
+
+	return n_bytes;
+}
+
+/*
+ * Write a block of TPI memory.  NVMCMD and the pointer register are
+ * set up once; each word is sent together with its NVMCSR poll as one
+ * MPSSE transfer.
+ */
+static int
+avrftdi_tpi_block_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
+		unsigned int addr, unsigned int n_bytes)
+{
+	unsigned char buf[4 * 5 + 5 + 3 + 1], *bp;
+	unsigned char csr;
+	unsigned int i;
+
+	if(avrftdi_tpi_nvm_waitbusy(pgm) < 0 ||
+	   avr_tpi_setup_rw(pgm, m, addr, NVMCMD_WORD_WRITE) < 0)
+		return -1;
+
+	/* write words, low byte first */
+	for(i = 0; i < n_bytes; i += 2) {
+		bp = avrftdi_tpi_put_frame(buf, TPI_OP_SST_INC);
+		bp = avrftdi_tpi_put_frame(bp, m->buf[addr + i]);
+		bp = avrftdi_tpi_put_frame(bp, TPI_OP_SST_INC);
+		bp = avrftdi_tpi_put_frame(bp, m->buf[addr + i + 1]);
+		bp = avrftdi_tpi_put_frame(bp, TPI_OP_SIN(NVMCSR));
+		bp = avrftdi_tpi_put_read(bp);
+		*bp++ = SEND_IMMEDIATE;
+
+		if(avrftdi_tpi_xfer(pgm, buf, bp - buf, &csr, 1) < 0)
+			return -1;
+
+		if((csr & NVMCSR_BSY) && avrftdi_tpi_nvm_waitbusy(pgm) < 0)
+			return -1;
+	}
+
+	return n_bytes;
+}
+
 static void
 avrftdi_tpi_disable(PROGRAMMER * pgm)
 {
@@ -261,8 +261,13 @@ AVRMEM * avr_new_memtype(void)
 
 
 /*
- * Allocate and initialize memory buffers for each of the device's
- * defined memory regions.
+ * Prepare the memory regions of the device for use.  The buffers
+ * themselves are allocated by avr_mem_alloc() on first access to a
+ * memory, so memories that are never touched cost nothing.
+ *
+ * The buffers of a memory are reference counted: avr_dup_mem() only
+ * shares them with the duplicate.  Whoever is about to change buf or
+ * tags must call avr_mem_unshare() first to get a private copy.
  */
 int avr_initmem(AVRPART * p)
 {
@@ -271,24 +276,114 @@ int avr_initmem(AVRPART * p)
 
   for (ln=lfirst(p->mem); ln; ln=lnext(ln)) {
     m = ldata(ln);
-    m->buf = (unsigned char *) malloc(m->size);
-    if (m->buf == NULL) {
-      fprintf(stderr, "%s: can't alloc buffer for %s size of %d bytes\n",
-              progname, m->desc, m->size);
-      return -1;
-    }
-    m->tags = (unsigned char *) malloc(m->size);
-    if (m->tags == NULL) {
-      fprintf(stderr, "%s: can't alloc buffer for %s size of %d bytes\n",
-              progname, m->desc, m->size);
-      return -1;
+    if (m->refs != NULL && --(*m->refs) == 0) {
+      free(m->buf);
+      free(m->tags);
+      free(m->refs);
     }
+    m->buf = NULL;
+    m->tags = NULL;
+    m->refs = NULL;
+  }
+
+  return 0;
+}
+
+
+/*
+ * Allocate the buffers of m unless this has already happened.  A new
+ * memory reads as erased (0xff) with no bytes tagged.
+ */
+int avr_mem_alloc(AVRMEM * m)
+{
+  if (m->buf != NULL)
+    return 0;
+
+  m->buf = (unsigned char *) malloc(m->size);
+  m->tags = (unsigned char *) malloc(m->size);
+  m->refs = (int *) malloc(sizeof(int));
+  if (m->buf == NULL || m->tags == NULL || m->refs == NULL) {
+    fprintf(stderr, "%s: can't alloc buffer for %s size of %d bytes\n",
+            progname, m->desc, m->size);
+    free(m->buf);
+    free(m->tags);
+    free(m->refs);
+    m->buf = NULL;
+    m->tags = NULL;
+    m->refs = NULL;
+    return -1;
   }
+  memset(m->buf, 0xff, m->size);
+  memset(m->tags, 0, m->size);
+  *m->refs = 1;
 
   return 0;
 }
 
 
+/*
+ * Make sure the buffers of m are allocated and not shared with any
+ * duplicate, so they can be modified.
+ */
+int avr_mem_unshare(AVRMEM * m)
+{
+  unsigned char * buf, * tags;
+  int * refs;
+
+  if (m->buf == NULL)
+    return avr_mem_alloc(m);
+
+  if (m->refs == NULL || *m->refs == 1)
+    return 0;
+
+  buf = (unsigned char *)malloc(m->size);
+  tags = (unsigned char *)malloc(m->size);
+  refs = (int *)malloc(sizeof(int));
+  if (buf == NULL || tags == NULL || refs == NULL) {
+    fprintf(stderr,
+            "avr_mem_unshare(): out of memory (memsize=%d)\n",
+            m->size);
+    free(buf);
+    free(tags);
+    free(refs);
+    return -1;
+  }
+  memcpy(buf, m->buf, m->size);
+  memcpy(tags, m->tags, m->size);
+  *refs = 1;
+
+  (*m->refs)--;
+  m->buf = buf;
+  m->tags = tags;
+  m->refs = refs;
+
+  return 0;
+}
+
+
+/*
+ * Drop the buffers of m and share those of src instead, until either
+ * side calls avr_mem_unshare().
+ */
+void avr_mem_share(AVRMEM * m, AVRMEM * src)
+{
+  if (m->buf == src->buf)
+    return;
+
+  if (m->refs != NULL && --(*m->refs) == 0) {
+    free(m->buf);
+    free(m->tags);
+    free(m->refs);
+  }
+
+  m->buf = src->buf;
+  m->tags = src->tags;
+  m->refs = src->refs;
+  if (m->refs != NULL)
+    (*m->refs)++;
+}
+
+
 AVRMEM * avr_dup_mem(AVRMEM * m)
 {
   AVRMEM * n;
@@ -298,27 +393,9 @@ AVRMEM * avr_dup_mem(AVRMEM * m)
 
   *n = *m;
 
-  if (m->buf != NULL) {
-    n->buf = (unsigned char *)malloc(n->size);
-    if (n->buf == NULL) {
-      fprintf(stderr,
-              "avr_dup_mem(): out of memory (memsize=%d)\n",
-              n->size);
-      exit(1);
-    }
-    memcpy(n->buf, m->buf, n->size);
-  }
-
-  if (m->tags != NULL) {
-    n->tags = (unsigned char *)malloc(n->size);
-    if (n->tags == NULL) {
-      fprintf(stderr,
-              "avr_dup_mem(): out of memory (memsize=%d)\n",
-              n->size);
-      exit(1);
-    }
-    memcpy(n->tags, m->tags, n->size);
-  }
+  /* buf and tags are shared until either side calls avr_mem_unshare() */
+  if (n->refs != NULL)
+    (*n->refs)++;
 
   for (i = 0; i < AVR_OP_MAX; i++) {
     n->op[i] = avr_dup_opcode(n->op[i]);
@@ -330,14 +407,14 @@ AVRMEM * avr_dup_mem(AVRMEM * m)
 void avr_free_mem(AVRMEM * m)
 {
     int i;
-    if (m->buf != NULL) {
+    if (m->refs == NULL || --(*m->refs) == 0) {
       free(m->buf);
-      m->buf = NULL;
-    }
-    if (m->tags != NULL) {
       free(m->tags);
-      m->tags = NULL;
+      free(m->refs);
     }
+    m->buf = NULL;
+    m->tags = NULL;
+    m->refs = NULL;
     for(i=0;i<sizeof(m->op)/sizeof(m->op[0]);i++)
     {
       if (m->op[i] != NULL)
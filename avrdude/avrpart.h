@@ -93,6 +93,7 @@ typedef struct opcode {
 #define AVRPART_WRITE          0x0400  /* at least one write operation specified */
 #define AVRPART_HAS_TPI        0x0800  /* part has TPI i/f rather than ISP (ATtiny4/5/9/10) */
 #define AVRPART_IS_AT90S1200   0x1000  /* part is an AT90S1200 (needs special treatment) */
+#define AVRPART_NVM_CRC24      0x2000  /* NVM checksums flash with the 24-bit CRC (ATxmega A/D) */
 
 #define AVR_DESCLEN 64
 #define AVR_IDLEN   32
@@ -190,6 +191,7 @@ typedef struct avrmem {
 
   unsigned char * buf;        /* pointer to memory buffer */
   unsigned char * tags;       /* allocation tags */
+  int * refs;                 /* number of AVRMEMs sharing buf and tags */
   OPCODE * op[AVR_OP_MAX];    /* opcodes */
 } AVRMEM;
 
@@ -210,6 +212,9 @@ int avr_get_output_index(OPCODE * op);
 AVRMEM * avr_new_memtype(void);
 int avr_initmem(AVRPART * p);
 AVRMEM * avr_dup_mem(AVRMEM * m);
+int      avr_mem_alloc(AVRMEM * m);
+int      avr_mem_unshare(AVRMEM * m);
+void     avr_mem_share(AVRMEM * m, AVRMEM * src);
 void     avr_free_mem(AVRMEM * m);
 AVRMEM * avr_locate_mem(AVRPART * p, char * desc);
 void avr_mem_display(const char * prefix, FILE * f, AVRMEM * m, int type,
@@ -0,0 +1,264 @@
+/*
+ * avrdude - A Downloader/Uploader for AVR device programmers
+ * avrdude is Copyright (C) 2000-2004  Brian S. Dean <bsd@bsdhome.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* $Id$ */
+
+/*
+ * Negotiation of a faster line speed for serial programmers and
+ * bootloaders that follow the host's baud rate (autobauding
+ * firmware).  The programmer driver supplies a probe that asks
+ * something with a fixed answer; a rate is good if the answer comes
+ * back unchanged.
+ */
+
+#include "ac_cfg.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "avrdude.h"
+#include "pgm.h"
+#include "serial.h"
+#include "baudrate.h"
+
+#define BAUD_CACHE_FILE     ".avrdude_baudrates"
+#define BAUD_LADDER_KEY     (BAUD_LADDER_MAX * 21)
+#define BAUD_CACHE_LINE     (PGM_PORTLEN + BAUD_LADDER_KEY + 128)
+#define BAUD_PROBE_TIMEOUT  200     /* ms */
+
+
+int baud_ladder_parse(struct baud_ladder * ladder, const char * spec)
+{
+  const char *p = spec;
+  char *e;
+  long rate;
+  int i, j;
+
+  ladder->n = 0;
+  while (*p) {
+    rate = strtol(p, &e, 10);
+    if (e == p || rate <= 0 || (*e != ',' && *e != 0))
+      return -1;
+    if (ladder->n == BAUD_LADDER_MAX)
+      return -1;
+
+    /* keep the ladder sorted fastest first */
+    for (i = 0; i < ladder->n && ladder->rate[i] > rate; i++)
+      ;
+    if (i == ladder->n || ladder->rate[i] != rate) {
+      for (j = ladder->n; j > i; j--)
+        ladder->rate[j] = ladder->rate[j - 1];
+      ladder->rate[i] = rate;
+      ladder->n++;
+    }
+
+    p = *e? e + 1: e;
+  }
+
+  return ladder->n > 0? 0: -1;
+}
+
+
+/*
+ * Name of the file remembering negotiated rates, or NULL if there is
+ * no home directory to keep it in.
+ */
+static char * baud_cache_name(char * buf, size_t size)
+{
+  const char *home = getenv("HOME");
+
+  if (home == NULL || *home == 0 ||
+      strlen(home) + strlen(BAUD_CACHE_FILE) + 2 > size)
+    return NULL;
+  sprintf(buf, "%s%s%s", home,
+          home[strlen(home) - 1] == '/'? "": "/", BAUD_CACHE_FILE);
+  return buf;
+}
+
+
+/*
+ * The rates of ladder as a comma-separated list; a cache entry only
+ * applies to the ladder it was found with.
+ */
+static char * baud_ladder_key(struct baud_ladder * ladder, char * buf)
+{
+  int i, n;
+
+  for (i = 0, n = 0; i < ladder->n; i++)
+    n += sprintf(buf + n, "%s%ld", i? ",": "", ladder->rate[i]);
+  return buf;
+}
+
+
+static long baud_cache_lookup(PROGRAMMER * pgm, struct baud_ladder * ladder,
+                              long base)
+{
+  char fname[PATH_MAX], line[BAUD_CACHE_LINE];
+  char id[BAUD_CACHE_LINE], port[BAUD_CACHE_LINE];
+  char key[BAUD_CACHE_LINE], lkey[BAUD_LADDER_KEY];
+  long b, rate = 0;
+  FILE *f;
+
+  if (baud_cache_name(fname, sizeof(fname)) == NULL ||
+      (f = fopen(fname, "r")) == NULL)
+    return 0;
+
+  baud_ladder_key(ladder, lkey);
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (sscanf(line, "%s %s %ld %s %ld", id, port, &b, key, &rate) == 5 &&
+        strcmp(id, ldata(lfirst(pgm->id))) == 0 &&
+        strcmp(port, pgm->port) == 0 && b == base &&
+        strcmp(key, lkey) == 0)
+      break;
+    rate = 0;
+  }
+  fclose(f);
+
+  return rate;
+}
+
+
+static void baud_cache_store(PROGRAMMER * pgm, struct baud_ladder * ladder,
+                             long base, long rate)
+{
+  char fname[PATH_MAX], tmpname[PATH_MAX + 4], line[BAUD_CACHE_LINE];
+  char id[BAUD_CACHE_LINE], port[BAUD_CACHE_LINE];
+  char key[BAUD_CACHE_LINE], lkey[BAUD_LADDER_KEY];
+  long b, r;
+  FILE *in, *out;
+
+  if (baud_cache_name(fname, sizeof(fname)) == NULL)
+    return;
+  sprintf(tmpname, "%s.new", fname);
+  if ((out = fopen(tmpname, "w")) == NULL)
+    return;
+
+  /* copy the entries for other programmers, ports and ladders */
+  baud_ladder_key(ladder, lkey);
+  if ((in = fopen(fname, "r")) != NULL) {
+    while (fgets(line, sizeof(line), in) != NULL) {
+      if (sscanf(line, "%s %s %ld %s %ld", id, port, &b, key, &r) != 5)
+        continue;
+      if (strcmp(id, ldata(lfirst(pgm->id))) == 0 &&
+          strcmp(port, pgm->port) == 0 && b == base &&
+          strcmp(key, lkey) == 0)
+        continue;
+      fputs(line, out);
+    }
+    fclose(in);
+  }
+  fprintf(out, "%s %s %ld %s %ld\n", (char *)ldata(lfirst(pgm->id)),
+          pgm->port, base, lkey, rate);
+
+  if (fclose(out) != 0 || rename(tmpname, fname) != 0) {
+    fprintf(stderr, "%s: cannot update %s\n", progname, fname);
+    remove(tmpname);
+  }
+}
+
+
+/*
+ * Try the line at rate; the answers to two probes must match ref.
+ */
+static int baud_try(PROGRAMMER * pgm, long rate, baud_probe_t probe,
+                    const unsigned char * ref, size_t len)
+{
+  unsigned char resp[BAUD_PROBE_MAX];
+  int i;
+
+  if (verbose)
+    fprintf(stderr, "%s: trying %ld baud\n", progname, rate);
+  if (serial_setspeed(&pgm->fd, rate) != 0)
+    return 0;
+  serial_drain(&pgm->fd, 0);
+
+  for (i = 0; i < 2; i++) {
+    if (probe(pgm, resp, len) < 0 || memcmp(resp, ref, len) != 0) {
+      serial_drain(&pgm->fd, 0);
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+
+long baud_negotiate(PROGRAMMER * pgm, struct baud_ladder * ladder, long base,
+                    baud_probe_t probe, size_t len)
+{
+  unsigned char ref[BAUD_PROBE_MAX];
+  long saved_timeout;
+  long cached, rate;
+  int i;
+
+  if (ladder->n == 0)
+    return base;
+  if (!(serdev->flags & SERDEV_FL_CANSETSPEED)) {
+    if (verbose)
+      fprintf(stderr,
+              "%s: baud_negotiate(): cannot change the speed of %s\n",
+              progname, pgm->port);
+    return base;
+  }
+  if (len > BAUD_PROBE_MAX || probe(pgm, ref, len) < 0) {
+    fprintf(stderr,
+            "%s: baud_negotiate(): no answer to probe at %ld baud\n",
+            progname, base);
+    return base;
+  }
+
+  /*
+   * A cached rate is tried first; if it is base itself, nothing
+   * faster on this ladder worked last time, so don't disturb the
+   * firmware again.
+   */
+  cached = baud_cache_lookup(pgm, ladder, base);
+  if (cached == base)
+    return base;
+
+  saved_timeout = serial_recv_timeout;
+  serial_recv_timeout = BAUD_PROBE_TIMEOUT;
+
+  rate = base;
+  if (cached > base && baud_try(pgm, cached, probe, ref, len))
+    rate = cached;
+  for (i = 0; rate == base && i < ladder->n; i++) {
+    if (ladder->rate[i] <= base || ladder->rate[i] == cached)
+      continue;
+    if (baud_try(pgm, ladder->rate[i], probe, ref, len))
+      rate = ladder->rate[i];
+  }
+
+  if (rate == base && !baud_try(pgm, base, probe, ref, len)) {
+    serial_recv_timeout = saved_timeout;
+    fprintf(stderr,
+            "%s: baud_negotiate(): programmer lost while probing faster rates\n",
+            progname);
+    return -1;
+  }
+  serial_recv_timeout = saved_timeout;
+
+  if (verbose || rate != base)
+    fprintf(stderr, "%s: using %ld baud\n", progname, rate);
+  if (rate != cached)
+    baud_cache_store(pgm, ladder, base, rate);
+
+  return rate;
+}
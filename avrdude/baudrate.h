@@ -0,0 +1,63 @@
+/*
+ * avrdude - A Downloader/Uploader for AVR device programmers
+ * avrdude is Copyright (C) 2000-2004  Brian S. Dean <bsd@bsdhome.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* $Id$ */
+
+#ifndef baudrate_h
+#define baudrate_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BAUD_LADDER_MAX 8       /* most rates to try */
+#define BAUD_PROBE_MAX  16      /* longest probe response */
+
+/*
+ * Faster rates a serial programmer or bootloader may be switched to
+ * after the initial sync, fastest first.  Empty unless the user asked
+ * for it with -x baudrates=...
+ */
+struct baud_ladder {
+  int n;
+  long rate[BAUD_LADDER_MAX];
+};
+
+/*
+ * Send a query whose answer does not change, and read the len bytes
+ * of it into resp.  Returns < 0 if no complete answer arrived.
+ */
+typedef int (*baud_probe_t)(PROGRAMMER * pgm, unsigned char * resp, size_t len);
+
+/* Parse a comma-separated list of rates into ladder; < 0 if bad */
+int baud_ladder_parse(struct baud_ladder * ladder, const char * spec);
+
+/*
+ * Switch the line to the fastest rate of ladder that answers probe
+ * the same way as the current rate base does, remembering the outcome
+ * per programmer and port for the next run.  Returns the rate the
+ * line is left at, or -1 if the programmer no longer answers at all.
+ */
+long baud_negotiate(PROGRAMMER * pgm, struct baud_ladder * ladder, long base,
+                    baud_probe_t probe, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
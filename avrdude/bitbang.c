@@ -225,80 +225,234 @@ static int bitbang_tpi_clk(PROGRAMMER * pgm)
   return r;
 }
 
-void bitbang_tpi_tx(PROGRAMMER * pgm, unsigned char byte) 
-{
-  int i;
-  unsigned char b, parity;
+/*
+ * A TPI frame is 12 bits wide: start bit (0), 8 data bits (LSB
+ * first), even parity and 2 stop bits (1).  Frames are kept in an
+ * unsigned short with the first bit on the wire in bit 0.
+ */
+#define TPI_FRAME_BITS   12
+#define TPI_FRAME_STOP   0x0c00
+#define TPI_FRAME_PARITY 0x0200
 
-  /* start bit */
-  pgm->setpin(pgm, pgm->pinno[PIN_AVR_MOSI], 0);
-  bitbang_tpi_clk(pgm);
+/* number of frames encoded at once by bitbang_tpi_tx_seq() */
+#define TPI_MAX_FRAMES   32
 
-  parity = 0;
-  for (i = 0; i <= 7; i++) {
-    b = (byte >> i) & 0x01;
-    parity ^= b;
+#define P2(n) n, n ^ 1, n ^ 1, n
+#define P4(n) P2(n), P2(n ^ 1), P2(n ^ 1), P2(n)
+#define P6(n) P4(n), P4(n ^ 1), P4(n ^ 1), P4(n)
 
-    /* set the data input line as desired */
-    pgm->setpin(pgm, pgm->pinno[PIN_AVR_MOSI], b);
-    bitbang_tpi_clk(pgm);
+/* even parity of each byte value */
+static const unsigned char tpi_parity[256] = {
+  P6(0), P6(1), P6(1), P6(0)
+};
+
+#undef P2
+#undef P4
+#undef P6
+
+#define TPI_FRAME(b) \
+  (TPI_FRAME_STOP | (tpi_parity[(b)] << 9) | ((unsigned short)(b) << 1))
+
+/*
+ * clock out a list of precomputed frames; MOSI is only touched when
+ * the next bit differs from the current line state
+ */
+static void bitbang_tpi_tx_frames(PROGRAMMER * pgm,
+                                  const unsigned short * frames, int n)
+{
+  int i, j, b, mosi;
+
+  mosi = -1;
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < TPI_FRAME_BITS; j++) {
+      b = (frames[i] >> j) & 0x01;
+      if (b != mosi) {
+        pgm->setpin(pgm, pgm->pinno[PIN_AVR_MOSI], b);
+        mosi = b;
+      }
+      bitbang_tpi_clk(pgm);
+    }
   }
-  
-  /* parity bit */
-  pgm->setpin(pgm, pgm->pinno[PIN_AVR_MOSI], parity);
-  bitbang_tpi_clk(pgm);
+}
 
-  /* 2 stop bits */
-  pgm->setpin(pgm, pgm->pinno[PIN_AVR_MOSI], 1);
-  bitbang_tpi_clk(pgm);
-  bitbang_tpi_clk(pgm);
+/* transmit a whole TPI command sequence */
+static void bitbang_tpi_tx_seq(PROGRAMMER * pgm, const unsigned char * buf, int len)
+{
+  unsigned short frames[TPI_MAX_FRAMES];
+  int i, n;
+
+  while (len > 0) {
+    n = len > TPI_MAX_FRAMES? TPI_MAX_FRAMES: len;
+    for (i = 0; i < n; i++)
+      frames[i] = TPI_FRAME(buf[i]);
+    bitbang_tpi_tx_frames(pgm, frames, n);
+    buf += n;
+    len -= n;
+  }
 }
 
-int bitbang_tpi_rx(PROGRAMMER * pgm) 
+void bitbang_tpi_tx(PROGRAMMER * pgm, unsigned char byte) 
+{
+  bitbang_tpi_tx_seq(pgm, &byte, 1);
+}
+
+/*
+ * receive one raw frame, return -1 if no start bit shows up within
+ * 10 clocks
+ */
+static int bitbang_tpi_rx_frame(PROGRAMMER * pgm)
 {
   int i;
-  unsigned char b, rbyte, parity;
+  unsigned short frame;
 
   /* make sure pin is on for "pullup" */
   pgm->setpin(pgm, pgm->pinno[PIN_AVR_MOSI], 1);
 
   /* wait for start bit (up to 10 bits) */
-  b = 1;
-  for (i = 0; i < 10; i++) {
-    b = bitbang_tpi_clk(pgm);
-    if (b == 0)
+  for (i = 0; i < 10; i++)
+    if (bitbang_tpi_clk(pgm) == 0)
       break;
-  }
-  if (b != 0) {
+  if (i == 10) {
     fprintf(stderr, "bitbang_tpi_rx: start bit not received correctly\n");
     return -1;
   }
 
-  rbyte = 0;
-  parity = 0;
-  for (i=0; i<=7; i++) {
-    b = bitbang_tpi_clk(pgm);
-    parity ^= b;
+  frame = 0;
+  for (i = 1; i < TPI_FRAME_BITS; i++)
+    frame |= (bitbang_tpi_clk(pgm) & 0x01) << i;
 
-    rbyte |= b << i;
-  }
+  return frame;
+}
+
+/* check parity and stop bits of a received frame, return its data byte */
+static int bitbang_tpi_frame2byte(unsigned short frame)
+{
+  unsigned char b = (frame >> 1) & 0xff;
 
-  /* parity bit */
-  if (bitbang_tpi_clk(pgm) != parity) {
+  if (((frame & TPI_FRAME_PARITY) != 0) != tpi_parity[b]) {
     fprintf(stderr, "bitbang_tpi_rx: parity bit is wrong\n");
     return -1;
   }
-
-  /* 2 stop bits */
-  b = 1;
-  b &= bitbang_tpi_clk(pgm);
-  b &= bitbang_tpi_clk(pgm);
-  if (b != 1) {
+  if ((frame & TPI_FRAME_STOP) != TPI_FRAME_STOP) {
     fprintf(stderr, "bitbang_tpi_rx: stop bits not received correctly\n");
     return -1;
   }
-  
-  return rbyte;
+
+  return b;
+}
+
+int bitbang_tpi_rx(PROGRAMMER * pgm) 
+{
+  int frame;
+
+  frame = bitbang_tpi_rx_frame(pgm);
+  if (frame == -1)
+    return -1;
+
+  return bitbang_tpi_frame2byte(frame);
+}
+
+/* TPI: wait for the NVM controller, talking to the pins directly */
+static int bitbang_tpi_nvm_waitbusy(PROGRAMMER * pgm)
+{
+  unsigned short sin_nvmcsr =
+    TPI_FRAME(TPI_CMD_SIN | TPI_SIO_ADDR(TPI_IOREG_NVMCSR));
+  int r;
+
+  do {
+    bitbang_tpi_tx_frames(pgm, &sin_nvmcsr, 1);
+    r = bitbang_tpi_rx(pgm);
+    if (r == -1)
+      return -1;
+  } while (r & TPI_IOREG_NVMCSR_NVMBSY);
+
+  return 0;
+}
+
+/*
+ * TPI block read: the pointer register is set up once, then the
+ * bytes are streamed in with SLD_PI, bypassing bitbang_cmd_tpi().
+ * Frames are collected first and checked afterwards.
+ */
+int bitbang_tpi_block_read(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
+                           unsigned int addr, unsigned int n_bytes)
+{
+  unsigned short sld_pi = TPI_FRAME(TPI_CMD_SLD_PI);
+  unsigned short frames[TPI_MAX_FRAMES];
+  unsigned int i, done, n;
+  int r;
+
+  if (bitbang_tpi_nvm_waitbusy(pgm) < 0 ||
+      avr_tpi_setup_rw(pgm, m, addr, TPI_NVMCMD_NO_OPERATION) < 0)
+    return -1;
+
+  pgm->pgm_led(pgm, ON);
+
+  for (done = 0; done < n_bytes; done += n) {
+    n = n_bytes - done;
+    if (n > TPI_MAX_FRAMES)
+      n = TPI_MAX_FRAMES;
+
+    for (i = 0; i < n; i++) {
+      bitbang_tpi_tx_frames(pgm, &sld_pi, 1);
+      r = bitbang_tpi_rx_frame(pgm);
+      if (r == -1) {
+        pgm->pgm_led(pgm, OFF);
+        return -1;
+      }
+      frames[i] = r;
+    }
+
+    for (i = 0; i < n; i++) {
+      r = bitbang_tpi_frame2byte(frames[i]);
+      if (r == -1) {
+        fprintf(stderr, "%s: bitbang_tpi_block_read(): bad frame at 0x%04x\n",
+                progname, addr + done + i);
+        pgm->pgm_led(pgm, OFF);
+        return -1;
+      }
+      m->buf[addr + done + i] = r;
+    }
+  }
+
+  pgm->pgm_led(pgm, OFF);
+
+  return n_bytes;
+}
+
+/*
+ * TPI block write: NVMCMD and the pointer register are set up once,
+ * each word is then sent as four precomputed SST_PI frames, followed
+ * by a single NVM busy poll
+ */
+int bitbang_tpi_block_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
+                            unsigned int addr, unsigned int n_bytes)
+{
+  unsigned short frames[4];
+  unsigned int i;
+
+  if (bitbang_tpi_nvm_waitbusy(pgm) < 0 ||
+      avr_tpi_setup_rw(pgm, m, addr, TPI_NVMCMD_WORD_WRITE) < 0)
+    return -1;
+
+  pgm->pgm_led(pgm, ON);
+
+  /* write words, low byte first */
+  frames[0] = frames[2] = TPI_FRAME(TPI_CMD_SST_PI);
+  for (i = 0; i < n_bytes; i += 2) {
+    frames[1] = TPI_FRAME(m->buf[addr + i]);
+    frames[3] = TPI_FRAME(m->buf[addr + i + 1]);
+    bitbang_tpi_tx_frames(pgm, frames, 4);
+
+    if (bitbang_tpi_nvm_waitbusy(pgm) < 0) {
+      pgm->pgm_led(pgm, OFF);
+      return -1;
+    }
+  }
+
+  pgm->pgm_led(pgm, OFF);
+
+  return n_bytes;
 }
 
 int bitbang_rdy_led(PROGRAMMER * pgm, int value)
@@ -362,9 +516,7 @@ int bitbang_cmd_tpi(PROGRAMMER * pgm, const unsigned char *cmd,
 
   pgm->pgm_led(pgm, ON);
 
-  for (i=0; i<cmd_len; i++) {
-    bitbang_tpi_tx(pgm, cmd[i]);
-  }
+  bitbang_tpi_tx_seq(pgm, cmd, cmd_len);
 
   r = 0;
   for (i=0; i<res_len; i++) {
@@ -434,6 +586,7 @@ int bitbang_chip_erase(PROGRAMMER * pgm, AVRPART * p)
 {
   unsigned char cmd[4];
   unsigned char res[4];
+  unsigned char seq[8];
   AVRMEM *mem;
 
   if (p->flags & AVRPART_HAS_TPI) {
@@ -441,25 +594,25 @@ int bitbang_chip_erase(PROGRAMMER * pgm, AVRPART * p)
 
     while (avr_tpi_poll_nvmbsy(pgm));
 
-    /* NVMCMD <- CHIP_ERASE */
-    bitbang_tpi_tx(pgm, TPI_CMD_SOUT | TPI_SIO_ADDR(TPI_IOREG_NVMCMD));
-    bitbang_tpi_tx(pgm, TPI_NVMCMD_CHIP_ERASE); /* CHIP_ERASE */
-
-    /* Set Pointer Register */
     mem = avr_locate_mem(p, "flash");
     if (mem == NULL) {
       fprintf(stderr, "No flash memory to erase for part %s\n",
           p->desc);
       return -1;
     }
-    bitbang_tpi_tx(pgm, TPI_CMD_SSTPR | 0);
-    bitbang_tpi_tx(pgm, (mem->offset & 0xFF) | 1);  /* high byte */
-    bitbang_tpi_tx(pgm, TPI_CMD_SSTPR | 1);
-    bitbang_tpi_tx(pgm, (mem->offset >> 8) & 0xFF);
 
+    /* NVMCMD <- CHIP_ERASE */
+    seq[0] = TPI_CMD_SOUT | TPI_SIO_ADDR(TPI_IOREG_NVMCMD);
+    seq[1] = TPI_NVMCMD_CHIP_ERASE;
+    /* Set Pointer Register */
+    seq[2] = TPI_CMD_SSTPR | 0;
+    seq[3] = (mem->offset & 0xFF) | 1;  /* high byte */
+    seq[4] = TPI_CMD_SSTPR | 1;
+    seq[5] = (mem->offset >> 8) & 0xFF;
     /* write dummy value to start erase */
-    bitbang_tpi_tx(pgm, TPI_CMD_SST);
-    bitbang_tpi_tx(pgm, 0xFF);
+    seq[6] = TPI_CMD_SST;
+    seq[7] = 0xFF;
+    bitbang_tpi_tx_seq(pgm, seq, sizeof(seq));
 
     while (avr_tpi_poll_nvmbsy(pgm));
 
@@ -499,9 +652,7 @@ int bitbang_program_enable(PROGRAMMER * pgm, AVRPART * p)
 
   if (p->flags & AVRPART_HAS_TPI) {
     /* enable NVM programming */
-    bitbang_tpi_tx(pgm, TPI_CMD_SKEY);
-    for (i = sizeof(tpi_skey) - 1; i >= 0; i--)
-      bitbang_tpi_tx(pgm, tpi_skey[i]);
+    bitbang_tpi_tx_seq(pgm, tpi_skey_cmd, sizeof(tpi_skey_cmd));
 
     /* check NVMEN bit */
     bitbang_tpi_tx(pgm, TPI_CMD_SLDCS | TPI_REG_TPISR);
@@ -530,6 +681,10 @@ int bitbang_program_enable(PROGRAMMER * pgm, AVRPART * p)
  */
 int bitbang_initialize(PROGRAMMER * pgm, AVRPART * p)
 {
+  static const unsigned char tpi_init[] = {
+    TPI_CMD_SSTCS | TPI_REG_TPIPCR, 0x7,
+    TPI_CMD_SLDCS | TPI_REG_TPIIR
+  };
   int rc;
   int tries;
   int i;
@@ -580,12 +735,8 @@ int bitbang_initialize(PROGRAMMER * pgm, AVRPART * p)
     for (i = 0; i < 16; i++)
       pgm->highpulsepin(pgm, pgm->pinno[PIN_AVR_SCK]);
 
-    /* remove extra guard timing bits */
-    bitbang_tpi_tx(pgm, TPI_CMD_SSTCS | TPI_REG_TPIPCR);
-    bitbang_tpi_tx(pgm, 0x7);
-
-    /* read TPI ident reg */
-    bitbang_tpi_tx(pgm, TPI_CMD_SLDCS | TPI_REG_TPIIR);
+    /* remove extra guard timing bits, then read TPI ident reg */
+    bitbang_tpi_tx_seq(pgm, tpi_init, sizeof(tpi_init));
     rc = bitbang_tpi_rx(pgm);
     if (rc != 0x80) {
       fprintf(stderr, "TPIIR not correct\n");
@@ -41,6 +41,10 @@ int  bitbang_cmd            (PROGRAMMER * pgm, const unsigned char *cmd,
                                 unsigned char *res);
 int  bitbang_cmd_tpi        (PROGRAMMER * pgm, const unsigned char *cmd,
                                 int cmd_len, unsigned char *res, int res_len);
+int  bitbang_tpi_block_read (PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
+                                unsigned int addr, unsigned int n_bytes);
+int  bitbang_tpi_block_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
+                                unsigned int addr, unsigned int n_bytes);
 int  bitbang_spi            (PROGRAMMER * pgm, const unsigned char *cmd,
                                 unsigned char *res, int count);
 int  bitbang_chip_erase     (PROGRAMMER * pgm, AVRPART * p);
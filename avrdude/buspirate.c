@@ -68,6 +68,10 @@
 #define BP_FLAG_XPARM_RAWFREQ       (1<<6)
 #define BP_FLAG_NOPAGEDREAD         (1<<7)
 
+#define BP_UART_CLOCK   4000000L	/* UART clock, divided by BRG+1 */
+#define BP_UART_DEFAULT 115200L
+#define BP_BB_BUFSIZE   256		/* most bitbang commands sent in one go */
+
 struct pdata
 {
 	int	binmode_version;
@@ -80,6 +84,9 @@ struct pdata
 	unsigned char pin_dir;		/* Last written pin direction for bitbang mode */
 	unsigned char pin_val;		/* Last written pin values for bitbang mode */
 	int     unread_bytes;		/* How many bytes we expected, but ignored */
+	unsigned char bb_buf[BP_BB_BUFSIZE]; /* Bitbang commands not sent yet */
+	int	bb_len;			/* Number of bytes in bb_buf */
+	long	serial_speed;		/* UART speed for the session, 0 = keep */
 };
 #define PDATA(pgm) ((struct pdata *)(pgm->cookie))
 
@@ -374,6 +381,21 @@ buspirate_parseextparms(struct programmer_t *pgm, LISTID extparms)
 			pgm->flag |= BP_FLAG_NOPAGEDREAD;
 			continue;
 		}
+		long serial_speed;
+		if (sscanf(extended_param, "serial_speed=%ld", &serial_speed) == 1) {
+			/* The UART runs from a 4 MHz clock divided by BRG+1;
+			 * the rate must come out within 3 %. */
+			long brg = (BP_UART_CLOCK + serial_speed/2) / serial_speed - 1;
+			long actual = brg >= 0? BP_UART_CLOCK / (brg + 1): 0;
+			if (serial_speed < 115200 || brg < 0 ||
+			    labs(actual - serial_speed) * 100 > 3 * serial_speed) {
+				fprintf(stderr, "BusPirate: serial_speed %ld is not supported.\n",
+					serial_speed);
+				return -1;
+			}
+			PDATA(pgm)->serial_speed = serial_speed;
+			continue;
+		}
 		if (sscanf(extended_param, "serial_recv_timeout=%d", &serial_recv_timeout) == 1) {
 			if (serial_recv_timeout < 1) {
 				fprintf(stderr, "BusPirate: serial_recv_timeout must be greater 0.\n");
@@ -655,6 +677,58 @@ static int buspirate_start_spi_mode_ascii(struct programmer_t *pgm)
 	return 0;
 }
 
+/*
+ * Switch the Bus Pirate's UART, and the host's, to another speed using
+ * the 'b' menu of the user terminal.  The Bus Pirate must be at its
+ * prompt.
+ */
+static int buspirate_set_serial_speed(struct programmer_t *pgm, long baud)
+{
+	char buf[16];
+	char *rcvd;
+	int brg;
+
+	if (verbose)
+		fprintf(stderr, "BusPirate: switching to %ld baud\n", baud);
+
+	buspirate_send(pgm, "b\n");
+	while (!buspirate_is_prompt(buspirate_readline(pgm, NULL, 0)))
+		/* speed menu */;
+	if (baud == BP_UART_DEFAULT) {
+		buspirate_send(pgm, "9\n");
+	} else {
+		/* "10. BRG raw value" */
+		buspirate_send(pgm, "10\n");
+		while (!buspirate_is_prompt(buspirate_readline(pgm, NULL, 0)))
+			/* value prompt */;
+		brg = (BP_UART_CLOCK + baud/2) / baud - 1;
+		snprintf(buf, sizeof(buf), "%d\n", brg);
+		buspirate_send(pgm, buf);
+	}
+
+	/* "Adjust your terminal", "Space to continue" */
+	while ((rcvd = buspirate_readline_noexit(pgm, NULL, 0)) != NULL &&
+	       strstr(rcvd, "Space") == NULL)
+		;
+
+	if (serial_setspeed(&pgm->fd, baud) != 0) {
+		fprintf(stderr, "BusPirate: cannot set the serial port to %ld baud\n",
+			baud);
+		return -1;
+	}
+	serial_drain(&pgm->fd, 0);
+	serial_send(&pgm->fd, (unsigned char *)" ", 1);
+	while ((rcvd = buspirate_readline_noexit(pgm, NULL, 0)) != NULL &&
+	       !buspirate_is_prompt(rcvd))
+		;
+	if (rcvd == NULL) {
+		fprintf(stderr, "BusPirate: no prompt at %ld baud\n", baud);
+		return -1;
+	}
+
+	return 0;
+}
+
 static void buspirate_enable(struct programmer_t *pgm)
 {
 	unsigned char *reset_str = "#\n";
@@ -666,6 +740,19 @@ static void buspirate_enable(struct programmer_t *pgm)
 	if (buspirate_verifyconfig(pgm)<0)
 		exit(1);
 
+	/* Move to the faster UART speed first; both modes gain from it. */
+	if (PDATA(pgm)->serial_speed &&
+	    PDATA(pgm)->serial_speed != pgm->baudrate) {
+		buspirate_send_bin(pgm, "\n\n", 2);
+		serial_drain(&pgm->fd, 0);
+		if (buspirate_set_serial_speed(pgm, PDATA(pgm)->serial_speed) < 0) {
+			fprintf(stderr, "%s: Failed to change the BusPirate serial speed\n",
+				progname);
+			exit(1);
+		}
+	} else
+		PDATA(pgm)->serial_speed = 0;
+
 	/* Attempt to start binary SPI mode unless explicitly told otherwise: */
 	if (!buspirate_uses_ascii(pgm)) {
 		fprintf(stderr, "Attempting to initiate BusPirate binary mode...\n");
@@ -728,8 +815,15 @@ static void buspirate_disable(struct programmer_t *pgm)
 	if (pgm->flag & BP_FLAG_IN_BINMODE) {
 		serial_recv_timeout = 100;
 		buspirate_reset_from_binmode(pgm);
-	} else
+		/* Leave the Bus Pirate at the speed it started with. */
+		if (PDATA(pgm)->serial_speed)
+			buspirate_set_serial_speed(pgm, pgm->baudrate);
+	} else {
+		/* Back to the starting speed first, for the reset banner. */
+		if (PDATA(pgm)->serial_speed)
+			buspirate_set_serial_speed(pgm, pgm->baudrate);
 		buspirate_expect(pgm, "#\n", "RESET", 1);
+	}
 }
 
 static int buspirate_initialize(struct programmer_t *pgm, AVRPART * p)
@@ -857,8 +951,7 @@ static int buspirate_paged_load(
 		unsigned int n_bytes)
 {
 	unsigned char commandbuf[10];
-	unsigned char buf[275];
-	unsigned int addr = 0;
+	unsigned char buf[2];
 
 	if (verbose > 1) fprintf(stderr, "BusPirate: buspirate_paged_load(..,%s,%d,%d,%d)\n",m->desc,m->page_size,address,n_bytes);
 
@@ -889,16 +982,17 @@ static int buspirate_paged_load(
 	commandbuf[9] = (n_bytes) & 0xff;
 
 	buspirate_send_bin(pgm, commandbuf, 10);
-	buspirate_recv_bin(pgm, buf, 1);
-	buspirate_recv_bin(pgm, buf, 1);
+	buspirate_recv_bin(pgm, buf, 2);
 
-	if (buf[0] != 0x01) {
+	if (buf[1] != 0x01) {
 		fprintf(stderr, "BusPirate: Paged Read command returned zero.\n");
 		return -1;
 	}
 
-	for (addr = 0; addr < n_bytes; addr++) {	
-		buspirate_recv_bin(pgm, &m->buf[addr+address], 1);
+	/* The data follows in one piece; take it the same way. */
+	if (buspirate_recv_bin(pgm, (char *)&m->buf[address], n_bytes) == EOF) {
+		fprintf(stderr, "BusPirate: Paged Read data incomplete.\n");
+		return -1;
 	}
 
 	return n_bytes;
@@ -911,12 +1005,19 @@ static int buspirate_paged_write(struct programmer_t *pgm,
 		unsigned int base_addr,
 		unsigned int n_data_bytes)
 {
-	int page, i;
+	int page, i, n;
 	int addr = base_addr;
+	int a_div;
 	int n_page_writes;
 	int this_page_size;
-	char cmd_buf[4096] = {'\0'};
-	char send_byte, recv_byte;
+	int is_flash;
+	/* Write then Read header, the page load commands, and up to
+	 * two commands to commit the page */
+	unsigned char cmd_buf[5 + 4096];
+	unsigned char *cmds = &cmd_buf[5];
+	unsigned char load_lo[4], load_hi[4];
+	OPCODE *lext, *wp;
+	char recv_byte;
 
 	if (!(pgm->flag & BP_FLAG_IN_BINMODE)) {
 		/* Return if we are not in binary mode. */
@@ -928,29 +1029,55 @@ static int buspirate_paged_write(struct programmer_t *pgm,
 		return -1;
 	}
 
-	if (page_size>1024) {
-		/* Page sizes greater than 1kB not yet supported. */
+	if (4*page_size + 8 > 4096) {
+		/* The Bus Pirate writes at most 4 kB at once. */
 		return -1;
 	}
 
-	if (strcmp(m->desc,"flash") != 0) {
-		/* Only flash memory currently supported. */
+	if (strcmp(m->desc,"flash") == 0)
+		is_flash = 1;
+	else if (strcmp(m->desc,"eeprom") == 0)
+		is_flash = 0;
+	else
+		/* Only flash and EEPROM memory currently supported. */
 		return -1;
-	}
 
 	/* pre-check opcodes */
 	if (m->op[AVR_OP_LOADPAGE_LO] == NULL) {
+		if (!is_flash)
+			/* byte-wise EEPROM; leave that to avr_write() */
+			return -1;
 		fprintf(stderr,
 			"%s failure: %s command not defined for %s\n",
 			progname, "AVR_OP_LOADPAGE_LO", p->desc);
 		return -1;
 	}
-	if (m->op[AVR_OP_LOADPAGE_HI] == NULL) {
+	if (is_flash && m->op[AVR_OP_LOADPAGE_HI] == NULL) {
 		fprintf(stderr,
 			"%s failure: %s command not defined for %s\n",
 			progname, "AVR_OP_LOADPAGE_HI", p->desc);
 		return -1;
 	}
+	if ((wp = m->op[AVR_OP_WRITEPAGE]) == NULL) {
+		fprintf(stderr,
+			"%s failure: %s command not defined for %s\n",
+			progname, "AVR_OP_WRITEPAGE", p->desc);
+		return -1;
+	}
+	lext = m->op[AVR_OP_LOAD_EXT_ADDR];
+
+	/* Flash is loaded and committed by word address, EEPROM by byte
+	 * address. */
+	a_div = is_flash? 2: 1;
+
+	/* The fixed bits of the page load commands only need to be set
+	 * up once. */
+	memset(load_lo, 0, sizeof(load_lo));
+	avr_set_bits(m->op[AVR_OP_LOADPAGE_LO], load_lo);
+	if (is_flash) {
+		memset(load_hi, 0, sizeof(load_hi));
+		avr_set_bits(m->op[AVR_OP_LOADPAGE_HI], load_hi);
+	}
 
 	/* Calculate total number of page writes needed: */
 	n_page_writes = n_data_bytes/page_size;
@@ -969,42 +1096,52 @@ static int buspirate_paged_write(struct programmer_t *pgm,
 			this_page_size = n_data_bytes - page_size*page;
 
 		/* Set up command buffer: */
-		memset(cmd_buf, 0, 4*this_page_size);
 		for (i=0; i<this_page_size; i++) {
+			OPCODE *op;
 
 			addr = base_addr + page*page_size + i;
 
-			if (i%2 == 0) {
-				avr_set_bits(m->op[AVR_OP_LOADPAGE_LO], &(cmd_buf[4*i]));
-				avr_set_addr(m->op[AVR_OP_LOADPAGE_LO], &(cmd_buf[4*i]), addr/2);
-				avr_set_input(m->op[AVR_OP_LOADPAGE_LO], &(cmd_buf[4*i]), m->buf[addr]);
+			if (!is_flash || i%2 == 0) {
+				op = m->op[AVR_OP_LOADPAGE_LO];
+				memcpy(&cmds[4*i], load_lo, 4);
 			} else {
-				avr_set_bits(m->op[AVR_OP_LOADPAGE_HI], &(cmd_buf[4*i]));
-				avr_set_addr(m->op[AVR_OP_LOADPAGE_HI], &(cmd_buf[4*i]), addr/2);
-				avr_set_input(m->op[AVR_OP_LOADPAGE_HI], &(cmd_buf[4*i]), m->buf[addr]);
+				op = m->op[AVR_OP_LOADPAGE_HI];
+				memcpy(&cmds[4*i], load_hi, 4);
 			}
+			avr_set_addr(op, &cmds[4*i], addr/a_div);
+			avr_set_input(op, &cmds[4*i], m->buf[addr]);
+		}
+		n = 4*this_page_size;
+
+		/* Commit the page in the same transfer, as
+		 * avr_write_page() would: */
+		if (lext != NULL) {
+			memset(&cmds[n], 0, 4);
+			avr_set_bits(lext, &cmds[n]);
+			avr_set_addr(lext, &cmds[n], addr/a_div);
+			n += 4;
 		}
+		memset(&cmds[n], 0, 4);
+		avr_set_bits(wp, &cmds[n]);
+		avr_set_addr(wp, &cmds[n], addr/a_div);
+		n += 4;
 
-		/* 00000100 - Write then read */
-		send_byte = 0x05;
-		buspirate_send_bin(pgm, &send_byte, 1);
+		/* 00000101 - Write then read, without CS changes */
+		cmd_buf[0] = 0x05;
 
 		/* Number of bytes to write: */
-		send_byte = (4*this_page_size)/0x100;
-		buspirate_send_bin(pgm, &send_byte, 1); /* High byte */
-		send_byte = (4*this_page_size)%0x100;
-		buspirate_send_bin(pgm, &send_byte, 1); /* Low byte */
+		cmd_buf[1] = n/0x100;	/* High byte */
+		cmd_buf[2] = n%0x100;	/* Low byte */
 
 		/* Number of bytes to read: */
-		send_byte = 0x0;
-		buspirate_send_bin(pgm, &send_byte, 1); /* High byte */
-		buspirate_send_bin(pgm, &send_byte, 1); /* Low byte */
+		cmd_buf[3] = 0x0;	/* High byte */
+		cmd_buf[4] = 0x0;	/* Low byte */
 
 		/* Set programming LED: */
 		pgm->pgm_led(pgm, ON);
 
-		/* Send command buffer: */
-		buspirate_send_bin(pgm, cmd_buf, 4*this_page_size);
+		/* Send header and command buffer at once: */
+		buspirate_send_bin(pgm, (char *)cmd_buf, 5 + n);
 
 		/* Check for write failure: */
 		if ((buspirate_recv_bin(pgm, &recv_byte, 1) == EOF) || (recv_byte != 0x01)) {
@@ -1014,11 +1151,15 @@ static int buspirate_paged_write(struct programmer_t *pgm,
 			exit(1);
 		}
 
+		/*
+		 * since we don't know what voltage the target AVR is powered
+		 * by, be conservative and delay the max amount the spec says
+		 * to wait
+		 */
+		usleep(m->max_write_delay);
+
 		/* Unset programming LED: */
 		pgm->pgm_led(pgm, OFF);
-
-		/* Write loaded page to flash: */
-		avr_write_page(pgm, p, m, addr);
 	}
 
 	return n_data_bytes;
@@ -1191,9 +1332,88 @@ static void buspirate_bb_enable(struct programmer_t *pgm)
    Both respond with a byte with current status:
    0|POWER|PULLUP|AUX|MOSI|CLK|MISO|CS
 */
+/*
+   Commands are queued in bb_buf and go out with buspirate_bb_flush();
+   from then on, their status bytes count as unread_bytes until a read
+   result is needed.
+*/
+static int buspirate_bb_flush(struct programmer_t *pgm)
+{
+	int len = PDATA(pgm)->bb_len;
+
+	if (len == 0)
+		return 0;
+	PDATA(pgm)->bb_len = 0;
+	if (buspirate_send_bin(pgm, (char *)PDATA(pgm)->bb_buf, len) < 0)
+		return -1;
+	PDATA(pgm)->unread_bytes += len;
+
+	return 0;
+}
+
+static int buspirate_bb_queue(struct programmer_t *pgm, unsigned char cmd)
+{
+	if (PDATA(pgm)->bb_len == BP_BB_BUFSIZE &&
+	    buspirate_bb_flush(pgm) < 0)
+		return -1;
+	PDATA(pgm)->bb_buf[PDATA(pgm)->bb_len++] = cmd;
+
+	return 0;
+}
+
+/* Queue a new output value for one pin */
+static int buspirate_bb_queue_pin(struct programmer_t *pgm, int pin, int value)
+{
+	if (pin & PIN_INVERSE) {
+		value = !value;
+		pin &= PIN_MASK;
+	}
+
+	if ((pin < 1 || pin > 5) && (pin != 7)) // 7 is POWER
+		return -1;
+
+	if (verbose > 1)
+		printf("set pin %d = %d\n", pin, value);
+
+	if (value)
+		PDATA(pgm)->pin_val |= (1 << (pin - 1));
+	else 
+		PDATA(pgm)->pin_val &= ~(1 << (pin - 1));
+
+	return buspirate_bb_queue(pgm, PDATA(pgm)->pin_val | 0x80);
+}
+
+/*
+   Send whatever is queued and read all outstanding status bytes in
+   bulk; the last len of them end up in res.
+*/
+static int buspirate_bb_collect(struct programmer_t *pgm,
+				unsigned char *res, int len)
+{
+	char junk[BP_BB_BUFSIZE];
+	int n;
+
+	if (buspirate_bb_flush(pgm) < 0)
+		return -1;
+
+	while (PDATA(pgm)->unread_bytes > len) {
+		n = PDATA(pgm)->unread_bytes - len;
+		if (n > (int)sizeof(junk))
+			n = sizeof(junk);
+		if (buspirate_recv_bin(pgm, junk, n) < 0)
+			return -1;
+		PDATA(pgm)->unread_bytes -= n;
+	}
+	if (buspirate_recv_bin(pgm, (char *)res, len) < 0)
+		return -1;
+	PDATA(pgm)->unread_bytes = 0;
+
+	return 0;
+}
+
 static int buspirate_bb_getpin(struct programmer_t *pgm, int pin)
 {
-	unsigned char buf[10];
+	unsigned char buf[1];
 	int value = 0;
 
 	if (pin & PIN_INVERSE) {
@@ -1204,19 +1424,10 @@ static int buspirate_bb_getpin(struct programmer_t *pgm, int pin)
 	if (pin < 1 || pin > 5)
 		return -1;
 	
-	buf[0] = PDATA(pgm)->pin_dir | 0x40;
-	if (buspirate_send_bin(pgm, buf, 1) < 0)
+	/* Re-writing the direction just fetches a status byte */
+	if (buspirate_bb_queue(pgm, PDATA(pgm)->pin_dir | 0x40) < 0 ||
+	    buspirate_bb_collect(pgm, buf, 1) < 0)
 		return -1;
-	/* Read all of the previously-expected-but-unread bytes */
-	while (PDATA(pgm)->unread_bytes > 0) {
-		if (buspirate_recv_bin(pgm, buf, 1) < 0)
-			return -1;
-		PDATA(pgm)->unread_bytes--;
-	}
-		
-	/* Now read the actual response */
-	if (buspirate_recv_bin(pgm, buf, 1) < 0)
-		return -1;	
 
 	if (buf[0] & (1 << (pin - 1)))
 		value ^= 1;
@@ -1229,31 +1440,61 @@ static int buspirate_bb_getpin(struct programmer_t *pgm, int pin)
 
 static int buspirate_bb_setpin(struct programmer_t *pgm, int pin, int value)
 {
-	unsigned char buf[10];
+	if (buspirate_bb_queue_pin(pgm, pin, value) < 0)
+		return -1;
 
-	if (pin & PIN_INVERSE) {
-		value = !value;
-		pin &= PIN_MASK;
+	/* Send it right away, bitbang.c times resets with usleep().
+	   We'll get a byte back, but we don't need to read it now.
+	   This is just a quick optimization that saves some USB
+	   round trips, improving read times by a factor of 3. */
+	return buspirate_bb_flush(pgm);
+}
+
+/*
+   Same bit sequence as bitbang_cmd(), but all 32 bits go out in one
+   write and their status bytes come back in one read: MISO is taken
+   from the answer to raising SCK, which is where bitbang_txrx() reads
+   it.
+*/
+static int buspirate_bb_cmd(struct programmer_t *pgm, const unsigned char *cmd,
+			    unsigned char *res)
+{
+	unsigned char status[32 * 3];
+	int miso = pgm->pinno[PIN_AVR_MISO];
+	int i, b, inverse = 0;
+
+	if (miso & PIN_INVERSE) {
+		miso &= PIN_MASK;
+		inverse = 1;
 	}
+	if (miso < 1 || miso > 5)
+		return -1;
 
-	if ((pin < 1 || pin > 5) && (pin != 7)) // 7 is POWER
+	for (i = 0; i < 32; i++) {
+		b = (cmd[i / 8] >> (7 - i % 8)) & 0x01;
+		if (buspirate_bb_queue_pin(pgm, pgm->pinno[PIN_AVR_MOSI], b) < 0 ||
+		    buspirate_bb_queue_pin(pgm, pgm->pinno[PIN_AVR_SCK], 1) < 0 ||
+		    buspirate_bb_queue_pin(pgm, pgm->pinno[PIN_AVR_SCK], 0) < 0)
+			return -1;
+	}
+	if (buspirate_bb_collect(pgm, status, sizeof(status)) < 0)
 		return -1;
 
-	if (verbose > 1)
-		printf("set pin %d = %d\n", pin, value);
+	memset(res, 0, 4);
+	for (i = 0; i < 32; i++) {
+		b = ((status[3 * i + 1] >> (miso - 1)) & 0x01) ^ inverse;
+		res[i / 8] |= b << (7 - i % 8);
+	}
 
-	if (value)
-		PDATA(pgm)->pin_val |= (1 << (pin - 1));
-	else 
-		PDATA(pgm)->pin_val &= ~(1 << (pin - 1));
-		
-	buf[0] = PDATA(pgm)->pin_val | 0x80;
-	if (buspirate_send_bin(pgm, buf, 1) < 0)
-		return -1;
-	/* We'll get a byte back, but we don't need to read it now.
-	   This is just a quick optimization that saves some USB
-	   round trips, improving read times by a factor of 3. */
-	PDATA(pgm)->unread_bytes++;
+	if (verbose >= 2) {
+		fprintf(stderr, "buspirate_bb_cmd(): [ ");
+		for (i = 0; i < 4; i++)
+			fprintf(stderr, "%02X ", cmd[i]);
+		fprintf(stderr, "] [ ");
+		for (i = 0; i < 4; i++)
+			fprintf(stderr, "%02X ", res[i]);
+		fprintf(stderr, "]\n");
+	}
 
 	return 0;
 }
@@ -1303,8 +1544,10 @@ void buspirate_bb_initpgm(struct programmer_t *pgm)
 	pgm->vfy_led        = bitbang_vfy_led;
 	pgm->program_enable = bitbang_program_enable;
 	pgm->chip_erase     = bitbang_chip_erase;
-	pgm->cmd            = bitbang_cmd;
+	pgm->cmd            = buspirate_bb_cmd;
 	pgm->cmd_tpi        = bitbang_cmd_tpi;
+	pgm->tpi_block_read = bitbang_tpi_block_read;
+	pgm->tpi_block_write = bitbang_tpi_block_write;
 	pgm->powerup        = buspirate_bb_powerup;
 	pgm->powerdown      = buspirate_bb_powerdown;
 	pgm->setpin         = buspirate_bb_setpin;
@@ -49,6 +49,7 @@
 #include "pgm.h"
 #include "butterfly.h"
 #include "serial.h"
+#include "baudrate.h"
 
 /*
  * Private data for this programmer.
@@ -57,6 +58,7 @@ struct pdata
 {
   char has_auto_incr_addr;
   unsigned int buffersize;
+  struct baud_ladder baudrates;   /* -x baudrates=... */
 };
 
 #define PDATA(pgm) ((struct pdata *)(pgm->cookie))
@@ -207,6 +209,17 @@ static void butterfly_powerdown(PROGRAMMER * pgm)
 
 #define IS_BUTTERFLY_MK 0x0001
 
+/*
+ * Ask for the programmer identifier; the answer doubles as a check of
+ * the line at a new speed.
+ */
+static int butterfly_baud_probe(PROGRAMMER * pgm, unsigned char * resp, size_t len)
+{
+  serial_send(&pgm->fd, (unsigned char *)"S", 1);
+  return serial_recv(&pgm->fd, resp, len);
+}
+
+
 /*
  * initialize the AVR device and prepare it to accept commands
  */
@@ -275,6 +288,11 @@ static int butterfly_initialize(PROGRAMMER * pgm, AVRPART * p)
 	  id[sizeof(id)-1] = '\0';
 	}
       } while (c == '?');
+
+      /* Now that the bootloader talks, see how fast it can go. */
+      if (baud_negotiate(pgm, &PDATA(pgm)->baudrates, pgm->baudrate,
+			 butterfly_baud_probe, sizeof(id)-1) < 0)
+	return -1;
     }
 
   /* Get the HW and SW versions to see if the programmer is present. */
@@ -384,6 +402,36 @@ static void butterfly_enable(PROGRAMMER * pgm)
 }
 
 
+static int butterfly_parseextparms(PROGRAMMER * pgm, LISTID extparms)
+{
+  LNODEID ln;
+  const char *extended_param;
+  int rv = 0;
+
+  for (ln = lfirst(extparms); ln; ln = lnext(ln)) {
+    extended_param = ldata(ln);
+
+    if (strncmp(extended_param, "baudrates=", strlen("baudrates=")) == 0) {
+      if (baud_ladder_parse(&PDATA(pgm)->baudrates,
+                            extended_param + strlen("baudrates=")) < 0) {
+        fprintf(stderr,
+                "%s: butterfly_parseextparms(): invalid baud rate list '%s'\n",
+                progname, extended_param);
+        rv = -1;
+      }
+      continue;
+    }
+
+    fprintf(stderr,
+            "%s: butterfly_parseextparms(): invalid extended parameter '%s'\n",
+            progname, extended_param);
+    rv = -1;
+  }
+
+  return rv;
+}
+
+
 static int butterfly_open(PROGRAMMER * pgm, char * port)
 {
   strcpy(pgm->port, port);
@@ -746,6 +794,7 @@ void butterfly_initpgm(PROGRAMMER * pgm)
 
   pgm->read_sig_bytes = butterfly_read_sig_bytes;
 
+  pgm->parseextparams = butterfly_parseextparms;
   pgm->setup          = butterfly_setup;
   pgm->teardown       = butterfly_teardown;
   pgm->flag = 0;
@@ -191,6 +191,7 @@ static int pin_name;
 %token K_IDR			/* address of OCD register in IO space */
 %token K_IS_AT90S1200		/* chip is an AT90S1200 (needs special treatment) */
 %token K_IS_AVR32               /* chip is in the avr32 family */
+%token K_NVM_CRC24              /* NVM checksums flash with the 24-bit CRC */
 %token K_RAMPZ			/* address of RAMPZ reg. in IO space */
 %token K_SPMCR			/* address of SPMC[S]R in memory space */
 %token K_EECR    		/* address of EECR in memory space */
@@ -1042,6 +1043,16 @@ part_parm :
       free_token($3);
     } |
 
+  K_NVM_CRC24 TKN_EQUAL yesno
+    {
+      if ($3->primary == K_YES)
+        current_part->flags |= AVRPART_NVM_CRC24;
+      else if ($3->primary == K_NO)
+        current_part->flags &= ~AVRPART_NVM_CRC24;
+
+      free_token($3);
+    } |
+
   K_IS_AT90S1200 TKN_EQUAL yesno
     {
       if ($3->primary == K_YES)
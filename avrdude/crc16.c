@@ -45,13 +45,50 @@ static const unsigned short crc_table[256] = {
 #define CRC(crcval,newchar) crcval = (crcval >> 8) ^ \
 	crc_table[(crcval ^ newchar) & 0x00ff]
 
+/*
+ * crc_table advanced by one, two and three more bytes of zeros, so
+ * that crcsum() can fold in four message bytes per step.
+ */
+static unsigned short crc_slice[3][256];
+static int crc_slice_ready;
+
+static void
+crc_slice_init(void)
+{
+  int i, k;
+  unsigned short c;
+
+  for (i = 0; i < 256; i++)
+    {
+      c = crc_table[i];
+      for (k = 0; k < 3; k++)
+	{
+	  c = (c >> 8) ^ crc_table[c & 0x00ff];
+	  crc_slice[k][i] = c;
+	}
+    }
+  crc_slice_ready = 1;
+}
+
 unsigned short
 crcsum(const unsigned char* message, unsigned long length,
        unsigned short crc)
 {
-  unsigned long i;
+  unsigned long i = 0;
+
+  if (length >= 8)
+    {
+      if (!crc_slice_ready)
+	crc_slice_init();
+      for (; i + 4 <= length; i += 4)
+	{
+	  crc ^= message[i] | (message[i + 1] << 8);
+	  crc = crc_slice[2][crc & 0x00ff] ^ crc_slice[1][crc >> 8] ^
+	    crc_slice[0][message[i + 2]] ^ crc_table[message[i + 3]];
+	}
+    }
 
-  for(i = 0; i < length; i++)
+  for(; i < length; i++)
     {
       CRC(crc, message[i]);
     }
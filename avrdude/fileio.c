@@ -27,6 +27,8 @@
 #include <errno.h>
 #include <ctype.h>
 #include <stdint.h>
+#include <time.h>
+#include <sys/stat.h>
 
 #ifdef HAVE_LIBELF
 #ifdef HAVE_LIBELF_H
@@ -39,6 +41,7 @@
 
 #include "avrdude.h"
 #include "avr.h"
+#include "crc16.h"
 #include "fileio.h"
 
 
@@ -60,7 +63,7 @@ static int b2ihex(unsigned char * inbuf, int bufsize,
              int recsize, int startaddr,
              char * outfile, FILE * outf);
 
-static int ihex2b(char * infile, FILE * inf,
+static int ihex2b(char * infile, const unsigned char * data, size_t datalen,
              AVRMEM * mem, int bufsize, unsigned int fileoffset);
 
 static int b2srec(unsigned char * inbuf, int bufsize, 
@@ -70,7 +73,8 @@ static int b2srec(unsigned char * inbuf, int bufsize,
 static int srec2b(char * infile, FILE * inf,
              AVRMEM * mem, int bufsize, unsigned int fileoffset);
 
-static int ihex_readrec(struct ihexrec * ihex, char * rec);
+static int ihex_readrec(struct ihexrec * ihex, const unsigned char * rec,
+                        int len);
 
 static int srec_readrec(struct ihexrec * srec, char * rec);
 
@@ -78,7 +82,9 @@ static int fileio_rbin(struct fioparms * fio,
                   char * filename, FILE * f, AVRMEM * mem, int size);
 
 static int fileio_ihex(struct fioparms * fio, 
-                  char * filename, FILE * f, AVRMEM * mem, int size);
+                  char * filename, FILE * f,
+                  const unsigned char * data, size_t datalen,
+                  AVRMEM * mem, int size);
 
 static int fileio_srec(struct fioparms * fio,
                   char * filename, FILE * f, AVRMEM * mem, int size);
@@ -97,7 +103,22 @@ static int fileio_num(struct fioparms * fio,
 		char * filename, FILE * f, AVRMEM * mem, int size,
 		FILEFMT fmt);
 
-static int fmt_autodetect(char * fname);
+static int fileio_bundle(struct fioparms * fio, char * filename,
+                         struct avrpart * p, AVRMEM * mem, int size);
+
+static int fileio_slurp(FILE * f, unsigned char ** data, size_t * datalen);
+
+static int fmt_autodetect(char * fname, unsigned char ** data,
+                          size_t * datalen);
+
+struct imgcache;
+
+static int imgcache_lookup(struct imgcache * ic, char * fname,
+                           FILEFMT format, struct avrpart * p, AVRMEM * mem,
+                           unsigned int fileoffset);
+
+static void imgcache_store(struct imgcache * ic, AVRMEM * mem, int rc,
+                           unsigned char * data, size_t datalen);
 
 
 
@@ -109,162 +130,327 @@ char * fmtstr(FILEFMT format)
     case FMT_IHEX : return "Intel Hex"; break;
     case FMT_RBIN : return "raw binary"; break;
     case FMT_ELF  : return "ELF"; break;
+    case FMT_BUNDLE: return "image bundle"; break;
     default       : return "invalid format"; break;
   };
 }
 
 
 
-static int b2ihex(unsigned char * inbuf, int bufsize, 
-           int recsize, int startaddr,
-           char * outfile, FILE * outf)
+/*
+ * Hex/S-record output: records are formatted into an output buffer
+ * which is handed to fwrite() whenever it fills up.
+ */
+#define HEXOUT_BUFSIZE 16384
+#define HEXOUT_MAXREC  (2 + 2 * (1 + 4 + 255 + 1) + 1)
+
+#define HEXROW(h) \
+  h "0" h "1" h "2" h "3" h "4" h "5" h "6" h "7" \
+  h "8" h "9" h "A" h "B" h "C" h "D" h "E" h "F"
+
+/* two hex digits for each byte value */
+static const char hexpairs[512 + 1] =
+  HEXROW("0") HEXROW("1") HEXROW("2") HEXROW("3")
+  HEXROW("4") HEXROW("5") HEXROW("6") HEXROW("7")
+  HEXROW("8") HEXROW("9") HEXROW("A") HEXROW("B")
+  HEXROW("C") HEXROW("D") HEXROW("E") HEXROW("F");
+
+struct hexout {
+  FILE * f;
+  char * outfile;
+  int    recsize;
+  int    startaddr;
+  unsigned int nextaddr;  /* address of the next record */
+  int    pos;             /* number of input bytes consumed */
+  int    n_64k;           /* Intel Hex: current extended address */
+  int    len;
+  char   buf[HEXOUT_BUFSIZE];
+};
+
+
+static struct hexout * hexout_new(FILE * f, char * outfile,
+                                  int recsize, int startaddr)
+{
+  struct hexout * h;
+
+  h = malloc(sizeof(struct hexout));
+  if (h == NULL) {
+    fprintf(stderr, "%s: out of memory\n", progname);
+    return NULL;
+  }
+  h->f         = f;
+  h->outfile   = outfile;
+  h->recsize   = recsize;
+  h->startaddr = startaddr;
+  h->nextaddr  = startaddr;
+  h->pos       = 0;
+  h->n_64k     = 0;
+  h->len       = 0;
+
+  return h;
+}
+
+
+static int hexout_flush(struct hexout * h)
+{
+  if (h->len > 0 && fwrite(h->buf, 1, h->len, h->f) != (size_t)h->len) {
+    fprintf(stderr, "%s: error writing %s: %s\n",
+            progname, h->outfile, strerror(errno));
+    return -1;
+  }
+  h->len = 0;
+
+  return 0;
+}
+
+
+static unsigned char hex_sum(const unsigned char * data, int n)
+{
+  unsigned char sum;
+  int i;
+
+  sum = 0;
+  for (i = 0; i < n; i++)
+    sum += data[i];
+
+  return sum;
+}
+
+
+static char * hex_encode(char * p, const unsigned char * data, int n)
 {
-  unsigned char * buf;
-  unsigned int nextaddr;
-  int n, nbytes, n_64k;
   int i;
+
+  for (i = 0; i < n; i++) {
+    memcpy(p, &hexpairs[2 * data[i]], 2);
+    p += 2;
+  }
+
+  return p;
+}
+
+
+/*
+ * Append one record: the prefix string, then hdr and data in hex,
+ * followed by the checksum and a newline.  If srec is set, the
+ * checksum is the one's complement of the sum (S-records), otherwise
+ * the two's complement (Intel Hex).
+ */
+static int hexout_rec(struct hexout * h, const char * prefix,
+                      const unsigned char * hdr, int hdrlen,
+                      const unsigned char * data, int n, int srec)
+{
   unsigned char cksum;
+  char * p;
 
-  if (recsize > 255) {
-    fprintf(stderr, "%s: recsize=%d, must be < 256\n",
-              progname, recsize);
+  if (h->len > HEXOUT_BUFSIZE - HEXOUT_MAXREC && hexout_flush(h) < 0)
     return -1;
-  }
 
-  n_64k    = 0;
-  nextaddr = startaddr;
-  buf      = inbuf;
-  nbytes   = 0;
+  cksum = hex_sum(hdr, hdrlen) + hex_sum(data, n);
+  cksum = srec? ~cksum: -cksum;
 
-  while (bufsize) {
-    n = recsize;
-    if (n > bufsize)
-      n = bufsize;
+  p = h->buf + h->len;
+  while (*prefix)
+    *p++ = *prefix++;
+  p = hex_encode(p, hdr, hdrlen);
+  p = hex_encode(p, data, n);
+  p = hex_encode(p, &cksum, 1);
+  *p++ = '\n';
+  h->len = p - h->buf;
 
-    if ((nextaddr + n) > 0x10000)
-      n = 0x10000 - nextaddr;
+  return 0;
+}
 
-    if (n) {
-      cksum = 0;
-      fprintf(outf, ":%02X%04X00", n, nextaddr);
-      cksum += n + ((nextaddr >> 8) & 0x0ff) + (nextaddr & 0x0ff);
-      for (i=0; i<n; i++) {
-        fprintf(outf, "%02X", buf[i]);
-        cksum += buf[i];
-      }
-      cksum = -cksum;
-      fprintf(outf, "%02X\n", cksum);
-      
-      nextaddr += n;
-      nbytes   += n;
+
+/*
+ * Return 1 if all n bytes of data are 0xff.
+ */
+static int hex_erased(const unsigned char * data, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    if (data[i] != 0xff)
+      return 0;
+
+  return 1;
+}
+
+
+/*
+ * Emit Intel Hex records for the first bufsize bytes of inbuf, starting
+ * where the previous call left off.  Unless final is set, a trailing
+ * partial record is held back until more data is available, so the
+ * result does not depend on how the input was split up.
+ */
+static int b2ihex_put(struct hexout * h, unsigned char * inbuf, int bufsize,
+                      int final)
+{
+  unsigned char * buf;
+  unsigned char hdr[6];
+  int n;
+
+  while (h->pos < bufsize) {
+    n = h->recsize;
+    if ((h->nextaddr + n) > 0x10000)
+      n = 0x10000 - h->nextaddr;
+    if (n > bufsize - h->pos) {
+      if (!final)
+        break;
+      n = bufsize - h->pos;
     }
 
-    if (nextaddr >= 0x10000) {
-      int lo, hi;
-      /* output an extended address record */
-      n_64k++;
-      lo = n_64k & 0xff;
-      hi = (n_64k >> 8) & 0xff;
-      cksum = 0;
-      fprintf(outf, ":02000004%02X%02X", hi, lo);
-      cksum += 2 + 0 + 4 + hi + lo;
-      cksum = -cksum;
-      fprintf(outf, "%02X\n", cksum);
-      nextaddr = 0;
+    buf = inbuf + h->pos;
+    if (!skipff || !hex_erased(buf, n)) {
+      hdr[0] = n;
+      hdr[1] = (h->nextaddr >> 8) & 0xff;
+      hdr[2] = h->nextaddr & 0xff;
+      hdr[3] = 0;
+      if (hexout_rec(h, ":", hdr, 4, buf, n, 0) < 0)
+        return -1;
     }
 
-    /* advance to next 'recsize' bytes */
-    buf += n;
-    bufsize -= n;
+    h->nextaddr += n;
+    h->pos      += n;
+
+    if (h->nextaddr >= 0x10000) {
+      /* output an extended address record */
+      h->n_64k++;
+      hdr[0] = 2;
+      hdr[1] = 0;
+      hdr[2] = 0;
+      hdr[3] = 4;
+      hdr[4] = (h->n_64k >> 8) & 0xff;
+      hdr[5] = h->n_64k & 0xff;
+      if (hexout_rec(h, ":", hdr, 6, NULL, 0, 0) < 0)
+        return -1;
+      h->nextaddr = 0;
+    }
   }
 
+  return 0;
+}
+
+
+static int b2ihex_end(struct hexout * h)
+{
+  unsigned char hdr[4];
+
   /*-----------------------------------------------------------------
     add the end of record data line
     -----------------------------------------------------------------*/
-  cksum = 0;
-  n = 0;
-  nextaddr = 0;
-  fprintf(outf, ":%02X%04X01", n, nextaddr);
-  cksum += n + ((nextaddr >> 8) & 0x0ff) + (nextaddr & 0x0ff) + 1;
-  cksum = -cksum;
-  fprintf(outf, "%02X\n", cksum);
+  hdr[0] = 0;
+  hdr[1] = 0;
+  hdr[2] = 0;
+  hdr[3] = 1;
+  if (hexout_rec(h, ":", hdr, 4, NULL, 0, 0) < 0)
+    return -1;
 
-  return nbytes;
+  return hexout_flush(h);
 }
 
 
-static int ihex_readrec(struct ihexrec * ihex, char * rec)
+static int b2ihex(unsigned char * inbuf, int bufsize, 
+           int recsize, int startaddr,
+           char * outfile, FILE * outf)
 {
-  int i, j;
-  char buf[8];
-  int offset, len;
-  char * e;
-  unsigned char cksum;
+  struct hexout * h;
   int rc;
 
-  len    = strlen(rec);
-  offset = 1;
-  cksum  = 0;
-
-  /* reclen */
-  if (offset + 2 > len)
-    return -1;
-  for (i=0; i<2; i++)
-    buf[i] = rec[offset++];
-  buf[i] = 0;
-  ihex->reclen = strtoul(buf, &e, 16);
-  if (e == buf || *e != 0)
+  if (recsize > 255) {
+    fprintf(stderr, "%s: recsize=%d, must be < 256\n",
+              progname, recsize);
     return -1;
+  }
 
-  /* load offset */
-  if (offset + 4 > len)
-    return -1;
-  for (i=0; i<4; i++)
-    buf[i] = rec[offset++];
-  buf[i] = 0;
-  ihex->loadofs = strtoul(buf, &e, 16);
-  if (e == buf || *e != 0)
+  h = hexout_new(outf, outfile, recsize, startaddr);
+  if (h == NULL)
     return -1;
 
-  /* record type */
-  if (offset + 2 > len)
-    return -1;
-  for (i=0; i<2; i++)
-    buf[i] = rec[offset++];
-  buf[i] = 0;
-  ihex->rectyp = strtoul(buf, &e, 16);
-  if (e == buf || *e != 0)
-    return -1;
+  rc = b2ihex_put(h, inbuf, bufsize, 1);
+  if (rc == 0)
+    rc = b2ihex_end(h);
+  if (rc == 0)
+    rc = h->pos;
 
-  cksum = ihex->reclen + ((ihex->loadofs >> 8) & 0x0ff) + 
-    (ihex->loadofs & 0x0ff) + ihex->rectyp;
+  free(h);
 
-  /* data */
-  for (j=0; j<ihex->reclen; j++) {
-    if (offset + 2 > len)
-      return -1;
-    for (i=0; i<2; i++)
-      buf[i] = rec[offset++];
-    buf[i] = 0;
-    ihex->data[j] = strtoul(buf, &e, 16);
-    if (e == buf || *e != 0)
-      return -1;
-    cksum += ihex->data[j];
+  return rc;
+}
+
+
+/*
+ * Hex digit lookup: the value of the digit, or'ed with HEX_VALID;
+ * zero for anything that is not a hex digit.
+ */
+#define HEX_VALID 0x10
+
+static const unsigned char hexval[256] = {
+  ['0'] = HEX_VALID | 0x0, ['1'] = HEX_VALID | 0x1,
+  ['2'] = HEX_VALID | 0x2, ['3'] = HEX_VALID | 0x3,
+  ['4'] = HEX_VALID | 0x4, ['5'] = HEX_VALID | 0x5,
+  ['6'] = HEX_VALID | 0x6, ['7'] = HEX_VALID | 0x7,
+  ['8'] = HEX_VALID | 0x8, ['9'] = HEX_VALID | 0x9,
+  ['A'] = HEX_VALID | 0xa, ['B'] = HEX_VALID | 0xb,
+  ['C'] = HEX_VALID | 0xc, ['D'] = HEX_VALID | 0xd,
+  ['E'] = HEX_VALID | 0xe, ['F'] = HEX_VALID | 0xf,
+  ['a'] = HEX_VALID | 0xa, ['b'] = HEX_VALID | 0xb,
+  ['c'] = HEX_VALID | 0xc, ['d'] = HEX_VALID | 0xd,
+  ['e'] = HEX_VALID | 0xe, ['f'] = HEX_VALID | 0xf,
+};
+
+/*
+ * Decode n bytes worth of hex digit pairs from s into out.  Returns
+ * 0 if all characters were valid hex digits, -1 otherwise.
+ */
+static int hex_decode(unsigned char * out, const unsigned char * s, int n)
+{
+  unsigned char hi, lo, valid;
+  int i;
+
+  valid = HEX_VALID;
+  for (i = 0; i < n; i++) {
+    hi = hexval[s[2 * i]];
+    lo = hexval[s[2 * i + 1]];
+    valid &= hi & lo;
+    out[i] = (hi << 4) | (lo & 0x0f);
   }
 
-  /* cksum */
-  if (offset + 2 > len)
+  return valid? 0: -1;
+}
+
+/*
+ * Parse the record rec of length len (not including the line
+ * terminator).  Returns the computed checksum, or -1 if the record is
+ * malformed.
+ */
+static int ihex_readrec(struct ihexrec * ihex, const unsigned char * rec,
+                        int len)
+{
+  unsigned char hdr[4];
+  unsigned char cksum;
+  int i;
+
+  /* ':' reclen(2) loadofs(4) rectyp(2) ... cksum(2) */
+  if (len < 11 || hex_decode(hdr, rec + 1, 4) < 0)
     return -1;
-  for (i=0; i<2; i++)
-    buf[i] = rec[offset++];
-  buf[i] = 0;
-  ihex->cksum = strtoul(buf, &e, 16);
-  if (e == buf || *e != 0)
+
+  ihex->reclen  = hdr[0];
+  ihex->loadofs = (hdr[1] << 8) | hdr[2];
+  ihex->rectyp  = hdr[3];
+
+  if (len < 1 + 2 * (4 + ihex->reclen + 1))
+    return -1;
+
+  if (hex_decode(ihex->data, rec + 9, ihex->reclen) < 0 ||
+      hex_decode(&ihex->cksum, rec + 9 + 2 * ihex->reclen, 1) < 0)
     return -1;
 
-  rc = -cksum & 0x000000ff;
+  cksum = hdr[0] + hdr[1] + hdr[2] + hdr[3];
+  for (i = 0; i < ihex->reclen; i++)
+    cksum += ihex->data[i];
 
-  return rc;
+  return -cksum & 0x000000ff;
 }
 
 
@@ -272,23 +458,22 @@ static int ihex_readrec(struct ihexrec * ihex, char * rec)
 /*
  * Intel Hex to binary buffer
  *
- * Given an open file 'inf' which contains Intel Hex formated data,
- * parse the file and lay it out within the memory buffer pointed to
- * by outbuf.  The size of outbuf, 'bufsize' is honored; if data would
- * fall outsize of the memory buffer outbuf, an error is generated.
+ * Given the contents of a file in 'data' (length 'datalen') which
+ * contains Intel Hex formated data, parse it and lay it out within
+ * the memory buffer pointed to by outbuf.  The size of outbuf,
+ * 'bufsize' is honored; if data would fall outsize of the memory
+ * buffer outbuf, an error is generated.
  *
  * Return the maximum memory address within 'outbuf' that was written.
  * If an error occurs, return -1.
  *
  * */
-static int ihex2b(char * infile, FILE * inf,
+static int ihex2b(char * infile, const unsigned char * data, size_t datalen,
              AVRMEM * mem, int bufsize, unsigned int fileoffset)
 {
-  char buffer [ MAX_LINE_LEN ];
+  const unsigned char * rec, * eol, * end;
   unsigned int nextaddr, baseaddr, maxaddr;
-  int i;
   int lineno;
-  int len;
   struct ihexrec ihex;
   int rc;
 
@@ -297,14 +482,15 @@ static int ihex2b(char * infile, FILE * inf,
   maxaddr  = 0;
   nextaddr = 0;
 
-  while (fgets((char *)buffer,MAX_LINE_LEN,inf)!=NULL) {
+  end = data + datalen;
+  for (rec = data; rec < end; rec = eol + 1) {
     lineno++;
-    len = strlen(buffer);
-    if (buffer[len-1] == '\n') 
-      buffer[--len] = 0;
-    if (buffer[0] != ':')
+    eol = memchr(rec, '\n', end - rec);
+    if (eol == NULL)
+      eol = end;
+    if (rec[0] != ':')
       continue;
-    rc = ihex_readrec(&ihex, buffer);
+    rc = ihex_readrec(&ihex, rec, eol - rec);
     if (rc < 0) {
       fprintf(stderr, "%s: invalid record at line %d of \"%s\"\n",
               progname, lineno, infile);
@@ -333,10 +519,8 @@ static int ihex2b(char * infile, FILE * inf,
                   progname, nextaddr+ihex.reclen, lineno, infile);
           return -1;
         }
-        for (i=0; i<ihex.reclen; i++) {
-          mem->buf[nextaddr+i] = ihex.data[i];
-          mem->tags[nextaddr+i] = TAG_ALLOCATED;
-        }
+        memcpy(mem->buf + nextaddr, ihex.data, ihex.reclen);
+        memset(mem->tags + nextaddr, TAG_ALLOCATED, ihex.reclen);
         if (nextaddr+ihex.reclen > maxaddr)
           maxaddr = nextaddr+ihex.reclen;
         break;
@@ -370,7 +554,7 @@ static int ihex2b(char * infile, FILE * inf,
         break;
     }
 
-  } /* while */
+  } /* for */
 
   if (maxaddr == 0) {
     fprintf(stderr, 
@@ -390,109 +574,113 @@ static int ihex2b(char * infile, FILE * inf,
   }
 }
 
-static int b2srec(unsigned char * inbuf, int bufsize, 
-           int recsize, int startaddr,
-           char * outfile, FILE * outf)
+/*
+ * Emit S-records for bufsize bytes of inbuf, see b2ihex_put().
+ */
+static int b2srec_put(struct hexout * h, unsigned char * inbuf, int bufsize,
+                      int final)
 {
   unsigned char * buf;
-  unsigned int nextaddr;
-  int n, nbytes, addr_width;
+  unsigned char hdr[5];
+  int n, addr_width;
   int i;
-  unsigned char cksum;
+  char * tmpl;
 
-  char * tmpl=0;
-
-  if (recsize > 255) {
-    fprintf(stderr, "%s: ERROR: recsize=%d, must be < 256\n",
-            progname, recsize);
-    return -1;
-  }
-  
-  nextaddr = startaddr;
-  buf = inbuf;
-  nbytes = 0;    
-
-  addr_width = 0;
-
-  while (bufsize) {
-
-    n = recsize;
-
-    if (n > bufsize) 
-      n = bufsize;
-
-    if (n) {
-      cksum = 0;
-      if (nextaddr + n <= 0xffff) {
-        addr_width = 2;
-        tmpl="S1%02X%04X";
-      }
-      else if (nextaddr + n <= 0xffffff) {
-        addr_width = 3;
-        tmpl="S2%02X%06X";
-      }
-      else if (nextaddr + n <= 0xffffffff) {
-        addr_width = 4;
-        tmpl="S3%02X%08X";
-      }
-      else {
-        fprintf(stderr, "%s: ERROR: address=%d, out of range\n",
-                progname, nextaddr);
-        return -1;
-      }
-
-      fprintf(outf, tmpl, n + addr_width + 1, nextaddr);		
+  while (h->pos < bufsize) {
+    n = h->recsize;
+    if (n > bufsize - h->pos) {
+      if (!final)
+        break;
+      n = bufsize - h->pos;
+    }
 
-      cksum += n + addr_width + 1;
+    if (h->nextaddr + n <= 0xffff) {
+      addr_width = 2;
+      tmpl="S1";
+    }
+    else if (h->nextaddr + n <= 0xffffff) {
+      addr_width = 3;
+      tmpl="S2";
+    }
+    else if (h->nextaddr + n <= 0xffffffff) {
+      addr_width = 4;
+      tmpl="S3";
+    }
+    else {
+      fprintf(stderr, "%s: ERROR: address=%d, out of range\n",
+              progname, h->nextaddr);
+      return -1;
+    }
 
+    buf = inbuf + h->nextaddr;
+    if (!skipff || !hex_erased(buf, n)) {
+      hdr[0] = n + addr_width + 1;
       for (i=addr_width; i>0; i--) 
-        cksum += (nextaddr >> (i-1) * 8) & 0xff;
+        hdr[addr_width - i + 1] = (h->nextaddr >> (i-1) * 8) & 0xff;
+      if (hexout_rec(h, tmpl, hdr, addr_width + 1, buf, n, 1) < 0)
+        return -1;
+    }
 
-      for (i=nextaddr; i<nextaddr + n; i++) {
-        fprintf(outf, "%02X", buf[i]);
-        cksum += buf[i];
-      }
+    h->nextaddr += n;
+    h->pos      += n;
+  }
 
-      cksum = 0xff - cksum;
-      fprintf(outf, "%02X\n", cksum);
+  return 0;
+}
 
-      nextaddr += n;
-      nbytes +=n;
-    }
 
-    /* advance to next 'recsize' bytes */
-    bufsize -= n;
-  }
+static int b2srec_end(struct hexout * h)
+{
+  unsigned char hdr[5];
+  int addr_width;
+  int i;
 
   /*-----------------------------------------------------------------
     add the end of record data line
     -----------------------------------------------------------------*/
-  cksum = 0;
-  n = 0;
-  nextaddr = 0;
-
-  if (startaddr <= 0xffff) {
+  if (h->startaddr <= 0xffff)
     addr_width = 2;
-    tmpl="S9%02X%04X";
-  }
-  else if (startaddr <= 0xffffff) {
+  else if (h->startaddr <= 0xffffff)
     addr_width = 3;
-    tmpl="S9%02X%06X";
-  }
-  else if (startaddr <= 0xffffffff) {
+  else
     addr_width = 4;
-    tmpl="S9%02X%08X";
+
+  hdr[0] = addr_width + 1;
+  for (i=1; i<=addr_width; i++)
+    hdr[i] = 0;
+  if (hexout_rec(h, "S9", hdr, addr_width + 1, NULL, 0, 1) < 0)
+    return -1;
+
+  return hexout_flush(h);
+}
+
+
+static int b2srec(unsigned char * inbuf, int bufsize, 
+           int recsize, int startaddr,
+           char * outfile, FILE * outf)
+{
+  struct hexout * h;
+  int rc;
+
+  if (recsize > 255) {
+    fprintf(stderr, "%s: ERROR: recsize=%d, must be < 256\n",
+            progname, recsize);
+    return -1;
   }
 
-  fprintf(outf, tmpl, n + addr_width + 1, nextaddr);
+  h = hexout_new(outf, outfile, recsize, startaddr);
+  if (h == NULL)
+    return -1;
+
+  rc = b2srec_put(h, inbuf, bufsize, 1);
+  if (rc == 0)
+    rc = b2srec_end(h);
+  if (rc == 0)
+    rc = h->pos;
 
-  cksum += n + addr_width +1;
-  for (i=addr_width; i>0; i--) 
-    cksum += (nextaddr >> (i - 1) * 8) & 0xff;
-  cksum = 0xff - cksum;
-  fprintf(outf, "%02X\n", cksum);
+  free(h);
 
-  return nbytes; 
+  return rc;
 }
 
 
@@ -821,62 +1009,93 @@ static int elf_mem_limits(AVRMEM *mem, struct avrpart * p,
 }
 
 
-static int elf2b(char * infile, FILE * inf,
-                 AVRMEM * mem, struct avrpart * p,
-                 int bufsize, unsigned int fileoffset)
+/*
+ * The ELF file last loaded.  All memory regions of a part are usually
+ * taken from the same ELF file, so it is read and indexed only once:
+ * the file contents are kept in memory, and the sections to consider
+ * are recorded together with their load addresses.
+ */
+struct elfsect {
+  Elf_Scn    * scn;
+  const char * name;
+  unsigned int lma;
+  unsigned int size;
+};
+
+static struct {
+  char          * fname;
+  struct stat     st;
+  int             avr32;
+  unsigned char * image;
+  Elf           * e;
+  int             nsect;
+  struct elfsect * sect;
+} elfcache;
+
+
+static void elf_uncache(void)
+{
+  if (elfcache.e != NULL)
+    (void)elf_end(elfcache.e);
+  free(elfcache.image);
+  free(elfcache.sect);
+  free(elfcache.fname);
+  memset(&elfcache, 0, sizeof(elfcache));
+}
+
+
+/*
+ * Read the ELF file infile (open as inf) into the cache, unless it is
+ * already there.
+ */
+static int elf_load(char * infile, FILE * inf, struct avrpart * p)
 {
   Elf *e;
-  int rv = -1;
-  unsigned int low, high, foff;
+  struct stat st;
+  unsigned char * image;
+  size_t imagelen;
+  int avr32;
+
+  avr32 = (p->flags & AVRPART_AVR32) != 0;
+
+  if (fstat(fileno(inf), &st) == 0 && S_ISREG(st.st_mode)) {
+    if (elfcache.e != NULL && avr32 == elfcache.avr32 &&
+        strcmp(infile, elfcache.fname) == 0 &&
+        st.st_dev == elfcache.st.st_dev && st.st_ino == elfcache.st.st_ino &&
+        st.st_size == elfcache.st.st_size &&
+        st.st_mtime == elfcache.st.st_mtime)
+      return 0;
+  }
+  else {
+    /* not a regular file, do not cache */
+    memset(&st, 0, sizeof(st));
+  }
 
-  if (elf_mem_limits(mem, p, &low, &high, &foff) != 0) {
+  elf_uncache();
+
+  if (elf_version(EV_CURRENT) == EV_NONE) {
     fprintf(stderr,
-            "%s: ERROR: Cannot handle \"%s\" memory region from ELF file\n",
-            progname, mem->desc);
+            "%s: ERROR: ELF library initialization failed: %s\n",
+            progname, elf_errmsg(-1));
+    return -1;
+  }
+  if (fileio_slurp(inf, &image, &imagelen) < 0)
+    return -1;
+  if ((e = elf_memory((char *)image, imagelen)) == NULL) {
+    fprintf(stderr,
+            "%s: ERROR: Cannot open \"%s\" as an ELF file: %s\n",
+            progname, infile, elf_errmsg(-1));
+    free(image);
     return -1;
   }
+  elfcache.e = e;
+  elfcache.image = image;
 
-  /*
-   * The Xmega memory regions for "boot", "application", and
-   * "apptable" are actually sub-regions of "flash".  Refine the
-   * applicable limits.  This allows to select only the appropriate
-   * sections out of an ELF file that contains section data for more
-   * than one sub-segment.
-   */
-  if ((p->flags & AVRPART_HAS_PDI) != 0 &&
-      (strcmp(mem->desc, "boot") == 0 ||
-       strcmp(mem->desc, "application") == 0 ||
-       strcmp(mem->desc, "apptable") == 0)) {
-    AVRMEM *flashmem = avr_locate_mem(p, "flash");
-    if (flashmem == NULL) {
-      fprintf(stderr,
-              "%s: ERROR: No \"flash\" memory region found, "
-              "cannot compute bounds of \"%s\" sub-region.\n",
-              progname, mem->desc);
-      return -1;
-    }
-    /* The config file offsets are PDI offsets, rebase to 0. */
-    low = mem->offset - flashmem->offset;
-    high = low + mem->size - 1;
-  }
-
-  if (elf_version(EV_CURRENT) == EV_NONE) {
-    fprintf(stderr,
-            "%s: ERROR: ELF library initialization failed: %s\n",
-            progname, elf_errmsg(-1));
-    return -1;
-  }
-  if ((e = elf_begin(fileno(inf), ELF_C_READ, NULL)) == NULL) {
-    fprintf(stderr,
-            "%s: ERROR: Cannot open \"%s\" as an ELF file: %s\n",
-            progname, infile, elf_errmsg(-1));
-    return -1;
-  }
   if (elf_kind(e) != ELF_K_ELF) {
     fprintf(stderr,
             "%s: ERROR: Cannot use \"%s\" as an ELF input file\n",
             progname, infile);
-    goto done;
+    goto fail;
   }
 
   size_t i, isize;
@@ -886,12 +1105,12 @@ static int elf2b(char * infile, FILE * inf,
     fprintf(stderr,
             "%s: ERROR: Error reading ident area of \"%s\": %s\n",
             progname, infile, elf_errmsg(-1));
-    goto done;
+    goto fail;
   }
 
   const char *endianname;
   unsigned char endianess;
-  if (p->flags & AVRPART_AVR32) {
+  if (avr32) {
     endianess = ELFDATA2MSB;
     endianname = "little";
   } else {
@@ -904,7 +1123,7 @@ static int elf2b(char * infile, FILE * inf,
             "%s: ERROR: ELF file \"%s\" is not a "
             "32-bit, %s-endian file that was expected\n",
             progname, infile, endianname);
-    goto done;
+    goto fail;
   }
 
   Elf32_Ehdr *eh;
@@ -912,19 +1131,19 @@ static int elf2b(char * infile, FILE * inf,
     fprintf(stderr,
             "%s: ERROR: Error reading ehdr of \"%s\": %s\n",
             progname, infile, elf_errmsg(-1));
-    goto done;
+    goto fail;
   }
 
   if (eh->e_type != ET_EXEC) {
     fprintf(stderr,
             "%s: ERROR: ELF file \"%s\" is not an executable file\n",
             progname, infile);
-    goto done;
+    goto fail;
   }
 
   const char *mname;
   uint16_t machine;
-  if (p->flags & AVRPART_AVR32) {
+  if (avr32) {
     machine = EM_AVR32;
     mname = "AVR32";
   } else {
@@ -935,14 +1154,14 @@ static int elf2b(char * infile, FILE * inf,
     fprintf(stderr,
             "%s: ERROR: ELF file \"%s\" is not for machine %s\n",
             progname, infile, mname);
-    goto done;
+    goto fail;
   }
   if (eh->e_phnum == 0xffff /* PN_XNUM */) {
     fprintf(stderr,
             "%s: ERROR: ELF file \"%s\" uses extended "
             "program header numbers which are not expected\n",
             progname, infile);
-    goto done;
+    goto fail;
   }
 
   Elf32_Phdr *ph;
@@ -950,7 +1169,7 @@ static int elf2b(char * infile, FILE * inf,
     fprintf(stderr,
             "%s: ERROR: Error reading program header table of \"%s\": %s\n",
             progname, infile, elf_errmsg(-1));
-    goto done;
+    goto fail;
   }
 
   size_t sndx;
@@ -961,6 +1180,12 @@ static int elf2b(char * infile, FILE * inf,
     sndx = 0;
   }
 
+  elfcache.sect = malloc(eh->e_phnum * sizeof(struct elfsect) + 1);
+  if (elfcache.sect == NULL) {
+    fprintf(stderr, "%s: out of memory\n", progname);
+    goto fail;
+  }
+
   /*
    * Walk the program header table, pick up entries that are of type
    * PT_LOAD, and have a non-zero p_filesz.
@@ -974,7 +1199,7 @@ static int elf2b(char * infile, FILE * inf,
       fprintf(stderr,
               "%s: Considering PT_LOAD program header entry #%d:\n"
               "    p_vaddr 0x%x, p_paddr 0x%x, p_filesz %d\n",
-              progname, i, ph[i].p_vaddr, ph[i].p_paddr, ph[i].p_filesz);
+              progname, (int)i, ph[i].p_vaddr, ph[i].p_paddr, ph[i].p_filesz);
     }
 
     Elf32_Shdr *sh;
@@ -983,97 +1208,166 @@ static int elf2b(char * infile, FILE * inf,
       continue;
 
     if ((sh->sh_flags & SHF_ALLOC) && sh->sh_size) {
-      const char *sname;
+      struct elfsect *es = elfcache.sect + elfcache.nsect++;
 
+      es->scn = s;
       if (sndx != 0) {
-        sname = elf_strptr(e, sndx, sh->sh_name);
+        es->name = elf_strptr(e, sndx, sh->sh_name);
       } else {
-        sname = "*unknown*";
+        es->name = "*unknown*";
       }
-
-      unsigned int lma;
-      lma = ph[i].p_paddr + sh->sh_offset - ph[i].p_offset;
+      es->lma = ph[i].p_paddr + sh->sh_offset - ph[i].p_offset;
+      es->size = sh->sh_size;
 
       if (verbose >= 2) {
         fprintf(stderr,
                 "%s: Found section \"%s\", LMA 0x%x, sh_size %u\n",
-                progname, sname, lma, sh->sh_size);
+                progname, es->name, es->lma, es->size);
       }
+    }
+  }
 
-      if (lma >= low &&
-          lma + sh->sh_size < high) {
-        /* OK */
-      } else {
-        if (verbose >= 2) {
-          fprintf(stderr,
-                  "    => skipping, inappropriate for \"%s\" memory region\n",
-                  mem->desc);
-        }
-        continue;
-      }
-      /*
-       * 1-byte sized memory regions are special: they are used for fuse
-       * bits, where multiple regions (in the config file) map to a
-       * single, larger region in the ELF file (e.g. "lfuse", "hfuse",
-       * and "efuse" all map to ".fuse").  We silently accept a larger
-       * ELF file region for these, and extract the actual byte to write
-       * from it, using the "foff" offset obtained above.
-       */
-      if (mem->size != 1 &&
-          sh->sh_size > mem->size) {
+  elfcache.fname = strdup(infile);
+  if (elfcache.fname == NULL) {
+    fprintf(stderr, "%s: out of memory\n", progname);
+    goto fail;
+  }
+  elfcache.st = st;
+  elfcache.avr32 = avr32;
+
+  return 0;
+
+fail:
+  elf_uncache();
+  return -1;
+}
+
+
+static int elf2b(char * infile, FILE * inf,
+                 AVRMEM * mem, struct avrpart * p,
+                 int bufsize, unsigned int fileoffset)
+{
+  int rv = -1;
+  int i;
+  unsigned int low, high, foff;
+
+  if (elf_mem_limits(mem, p, &low, &high, &foff) != 0) {
+    fprintf(stderr,
+            "%s: ERROR: Cannot handle \"%s\" memory region from ELF file\n",
+            progname, mem->desc);
+    return -1;
+  }
+
+  /*
+   * The Xmega memory regions for "boot", "application", and
+   * "apptable" are actually sub-regions of "flash".  Refine the
+   * applicable limits.  This allows to select only the appropriate
+   * sections out of an ELF file that contains section data for more
+   * than one sub-segment.
+   */
+  if ((p->flags & AVRPART_HAS_PDI) != 0 &&
+      (strcmp(mem->desc, "boot") == 0 ||
+       strcmp(mem->desc, "application") == 0 ||
+       strcmp(mem->desc, "apptable") == 0)) {
+    AVRMEM *flashmem = avr_locate_mem(p, "flash");
+    if (flashmem == NULL) {
+      fprintf(stderr,
+              "%s: ERROR: No \"flash\" memory region found, "
+              "cannot compute bounds of \"%s\" sub-region.\n",
+              progname, mem->desc);
+      return -1;
+    }
+    /* The config file offsets are PDI offsets, rebase to 0. */
+    low = mem->offset - flashmem->offset;
+    high = low + mem->size - 1;
+  }
+
+  if (elf_load(infile, inf, p) < 0)
+    return -1;
+
+  for (i = 0; i < elfcache.nsect; i++) {
+    struct elfsect *es = elfcache.sect + i;
+    const char *sname = es->name;
+    unsigned int lma = es->lma;
+
+    if (verbose >= 2) {
+      fprintf(stderr,
+              "%s: Considering section \"%s\", LMA 0x%x, sh_size %u\n",
+              progname, sname, lma, es->size);
+    }
+
+    if (lma >= low &&
+        lma + es->size < high) {
+      /* OK */
+    } else {
+      if (verbose >= 2) {
         fprintf(stderr,
-                "%s: ERROR: section \"%s\" does not fit into \"%s\" memory:\n"
-                "    0x%x + %u > %u\n",
-                progname, sname, mem->desc,
-                lma, sh->sh_size, mem->size);
-        continue;
+                "    => skipping, inappropriate for \"%s\" memory region\n",
+                mem->desc);
       }
+      continue;
+    }
+    /*
+     * 1-byte sized memory regions are special: they are used for fuse
+     * bits, where multiple regions (in the config file) map to a
+     * single, larger region in the ELF file (e.g. "lfuse", "hfuse",
+     * and "efuse" all map to ".fuse").  We silently accept a larger
+     * ELF file region for these, and extract the actual byte to write
+     * from it, using the "foff" offset obtained above.
+     */
+    if (mem->size != 1 &&
+        es->size > mem->size) {
+      fprintf(stderr,
+              "%s: ERROR: section \"%s\" does not fit into \"%s\" memory:\n"
+              "    0x%x + %u > %u\n",
+              progname, sname, mem->desc,
+              lma, es->size, mem->size);
+      continue;
+    }
 
-      Elf_Data *d = NULL;
-      while ((d = elf_getdata(s, d)) != NULL) {
-        if (verbose >= 2) {
+    Elf_Data *d = NULL;
+    while ((d = elf_getdata(es->scn, d)) != NULL) {
+      if (verbose >= 2) {
+        fprintf(stderr,
+                "    Data block: d_buf %p, d_off 0x%x, d_size %d\n",
+                d->d_buf, (unsigned int)d->d_off, d->d_size);
+      }
+      if (mem->size == 1) {
+        if (d->d_off != 0) {
           fprintf(stderr,
-                  "    Data block: d_buf %p, d_off 0x%x, d_size %d\n",
-                  d->d_buf, (unsigned int)d->d_off, d->d_size);
-        }
-        if (mem->size == 1) {
-          if (d->d_off != 0) {
-            fprintf(stderr,
-                    "%s: ERROR: unexpected data block at offset != 0\n",
-                    progname);
-          } else if (foff >= d->d_size) {
-            fprintf(stderr,
-                    "%s: ERROR: ELF file section does not contain byte at offset %d\n",
-                    progname, foff);
-          } else {
-            if (verbose >= 2) {
-              fprintf(stderr,
-                      "    Extracting one byte from file offset %d\n",
-                      foff);
-            }
-            mem->buf[0] = ((unsigned char *)d->d_buf)[foff];
-            mem->tags[0] = TAG_ALLOCATED;
-            rv = 1;
-          }
+                  "%s: ERROR: unexpected data block at offset != 0\n",
+                  progname);
+        } else if (foff >= d->d_size) {
+          fprintf(stderr,
+                  "%s: ERROR: ELF file section does not contain byte at offset %d\n",
+                  progname, foff);
         } else {
-          unsigned int idx;
-
-          idx = lma - low + d->d_off;
-          if ((int)(idx + d->d_size) > rv)
-            rv = idx + d->d_size;
-          if (verbose >= 3) {
+          if (verbose >= 2) {
             fprintf(stderr,
-                    "    Writing %d bytes to mem offset 0x%x\n",
-                    d->d_size, idx);
+                    "    Extracting one byte from file offset %d\n",
+                    foff);
           }
-          memcpy(mem->buf + idx, d->d_buf, d->d_size);
-          memset(mem->tags + idx, TAG_ALLOCATED, d->d_size);
+          mem->buf[0] = ((unsigned char *)d->d_buf)[foff];
+          mem->tags[0] = TAG_ALLOCATED;
+          rv = 1;
+        }
+      } else {
+        unsigned int idx;
+
+        idx = lma - low + d->d_off;
+        if ((int)(idx + d->d_size) > rv)
+          rv = idx + d->d_size;
+        if (verbose >= 3) {
+          fprintf(stderr,
+                  "    Writing %d bytes to mem offset 0x%x\n",
+                  d->d_size, idx);
         }
+        memcpy(mem->buf + idx, d->d_buf, d->d_size);
+        memset(mem->tags + idx, TAG_ALLOCATED, d->d_size);
       }
     }
   }
-done:
-  (void)elf_end(e);
+
   return rv;
 }
 #endif  /* HAVE_LIBELF */
@@ -1131,7 +1425,7 @@ static int fileio_rbin(struct fioparms * fio,
         memset(mem->tags, TAG_ALLOCATED, rc);
       break;
     case FIO_WRITE:
-      rc = fwrite(buf, 1, size, f);
+      rc = fwrite(buf + fio->start, 1, size, f);
       break;
     default:
       fprintf(stderr, "%s: fileio: invalid operation=%d\n",
@@ -1200,20 +1494,23 @@ static int fileio_imm(struct fioparms * fio,
 
 
 static int fileio_ihex(struct fioparms * fio, 
-                  char * filename, FILE * f, AVRMEM * mem, int size)
+                  char * filename, FILE * f,
+                  const unsigned char * data, size_t datalen,
+                  AVRMEM * mem, int size)
 {
   int rc;
 
   switch (fio->op) {
     case FIO_WRITE:
-      rc = b2ihex(mem->buf, size, 32, fio->fileoffset, filename, f);
+      rc = b2ihex(mem->buf + fio->start, size, 32,
+                  fio->fileoffset + fio->start, filename, f);
       if (rc < 0) {
         return -1;
       }
       break;
 
     case FIO_READ:
-      rc = ihex2b(filename, f, mem, size, fio->fileoffset);
+      rc = ihex2b(filename, data, datalen, mem, size, fio->fileoffset);
       if (rc < 0)
         return -1;
       break;
@@ -1236,7 +1533,8 @@ static int fileio_srec(struct fioparms * fio,
 
   switch (fio->op) {
     case FIO_WRITE:
-      rc = b2srec(mem->buf, size, 32, fio->fileoffset, filename, f);
+      rc = b2srec(mem->buf + fio->start, size, 32,
+                  fio->fileoffset + fio->start, filename, f);
       if (rc < 0) {
         return -1;
       }
@@ -1336,7 +1634,7 @@ static int fileio_num(struct fioparms * fio,
       if (putc(',', f) == EOF)
 	goto writeerr;
     }
-    num = (unsigned int)(mem->buf[i]);
+    num = (unsigned int)(mem->buf[fio->start + i]);
     /*
      * For a base of 8 and a value < 8 to convert, don't write the
      * prefix.  The conversion will be indistinguishable from a
@@ -1362,142 +1660,991 @@ static int fileio_num(struct fioparms * fio,
 }
 
 
-int fileio_setparms(int op, struct fioparms * fp,
-                    struct avrpart * p, AVRMEM * m)
-{
-  fp->op = op;
-
-  switch (op) {
-    case FIO_READ:
-      fp->mode   = "r";
-      fp->iodesc = "input";
-      fp->dir    = "from";
-      fp->rw     = "read";
-      break;
+/*
+ * Image bundles hold the contents of several memories of one part in
+ * a single file, padded to whole pages, along with a bitmap of the
+ * pages present and a CRC for each page, so they can be loaded
+ * without any parsing.  All numbers are 32-bit little-endian:
+ *
+ *   header:  magic[8] "AVRBND1", part id[32], number of memories, 0
+ *   for each memory:
+ *            desc[64], size, page size, number of pages, fileio()
+ *            result, offsets of the page data, of the page bitmap and
+ *            of the (16-bit) page CRCs, 0
+ *
+ * The page data of each memory starts on a BUNDLE_ALIGN boundary.
+ */
+#define BUNDLE_MAGIC    "AVRBND1"
+#define BUNDLE_HDRSIZE  48
+#define BUNDLE_ENTSIZE  96
+#define BUNDLE_ALIGN    512
+
+struct bundle_ent {
+  char     desc[AVR_MEMDESCLEN];
+  uint32_t size;
+  uint32_t pagesize;
+  uint32_t npages;
+  uint32_t rc;
+  uint32_t data;
+  uint32_t bitmap;
+  uint32_t crc;
+};
 
-    case FIO_WRITE:
-      fp->mode   = "w";
-      fp->iodesc = "output";
-      fp->dir    = "to";
-      fp->rw     = "wrote";
-      break;
 
-    default:
-      fprintf(stderr, "%s: invalid I/O operation %d\n",
-              progname, op);
-      return -1;
-      break;
-  }
+static uint32_t bundle_get32(const unsigned char * b)
+{
+  return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+}
 
-  /*
-   * AVR32 devices maintain their load offset within the file itself,
-   * but AVRDUDE maintains all memory images 0-based.
-   */
-  if ((p->flags & AVRPART_AVR32) != 0)
-  {
-    fp->fileoffset = m->offset;
-  }
-  else
-  {
-    fp->fileoffset = 0;
-  }
 
-  return 0;
+static void bundle_put32(unsigned char * b, uint32_t v)
+{
+  b[0] = v & 0xff;
+  b[1] = (v >> 8) & 0xff;
+  b[2] = (v >> 16) & 0xff;
+  b[3] = (v >> 24) & 0xff;
 }
 
 
-
-static int fmt_autodetect(char * fname)
+/*
+ * Read the bundle file filename into *img, and its memory directory
+ * into *ents (both malloc()ed).  Returns the number of memories, or
+ * -1 if the file cannot be read or is not a valid bundle.
+ */
+static int bundle_load(char * filename, unsigned char ** img,
+                       struct bundle_ent ** ents, char * partid)
 {
   FILE * f;
-  unsigned char buf[MAX_LINE_LEN];
-  int i;
-  int len;
-  int found;
-  int first = 1;
+  unsigned char * b, * e;
+  size_t len;
+  struct bundle_ent * ent;
+  uint32_t n, i, datalen;
 
-  f = fopen(fname, "r");
+  f = fopen(filename, "rb");
   if (f == NULL) {
-    fprintf(stderr, "%s: error opening %s: %s\n",
-            progname, fname, strerror(errno));
+    fprintf(stderr, "%s: can't open bundle %s: %s\n",
+            progname, filename, strerror(errno));
+    return -1;
+  }
+  if (fileio_slurp(f, &b, &len) < 0) {
+    fclose(f);
     return -1;
   }
+  fclose(f);
 
-  while (fgets((char *)buf, MAX_LINE_LEN, f)!=NULL) {
-    /* check for ELF file */
-    if (first &&
-        (buf[0] == 0177 && buf[1] == 'E' &&
-         buf[2] == 'L' && buf[3] == 'F')) {
-      fclose(f);
-      return FMT_ELF;
+  if (len < BUNDLE_HDRSIZE ||
+      memcmp(b, BUNDLE_MAGIC, sizeof(BUNDLE_MAGIC)) != 0)
+    goto bad;
+  n = bundle_get32(b + 40);
+  if (n > (len - BUNDLE_HDRSIZE) / BUNDLE_ENTSIZE)
+    goto bad;
+
+  ent = calloc(n + 1, sizeof(struct bundle_ent));
+  if (ent == NULL) {
+    fprintf(stderr, "%s: out of memory\n", progname);
+    free(b);
+    return -1;
+  }
+  for (i = 0; i < n; i++) {
+    e = b + BUNDLE_HDRSIZE + i * BUNDLE_ENTSIZE;
+    memcpy(ent[i].desc, e, AVR_MEMDESCLEN);
+    ent[i].desc[AVR_MEMDESCLEN - 1] = 0;
+    ent[i].size     = bundle_get32(e + 64);
+    ent[i].pagesize = bundle_get32(e + 68);
+    ent[i].npages   = bundle_get32(e + 72);
+    ent[i].rc       = bundle_get32(e + 76);
+    ent[i].data     = bundle_get32(e + 80);
+    ent[i].bitmap   = bundle_get32(e + 84);
+    ent[i].crc      = bundle_get32(e + 88);
+
+    if (ent[i].pagesize == 0 || ent[i].npages > len ||
+        ent[i].pagesize > len / (ent[i].npages + 1)) {
+      free(ent);
+      goto bad;
     }
+    datalen = ent[i].npages * ent[i].pagesize;
+    if (ent[i].data > len || datalen > len - ent[i].data ||
+        ent[i].bitmap > len || (ent[i].npages + 7) / 8 > len - ent[i].bitmap ||
+        ent[i].crc > len || ent[i].npages * 2 > len - ent[i].crc ||
+        datalen < ent[i].size) {
+      free(ent);
+      goto bad;
+    }
+  }
 
-    buf[MAX_LINE_LEN-1] = 0;
-    len = strlen((char *)buf);
-    if (buf[len-1] == '\n')
-      buf[--len] = 0;
+  memcpy(partid, b + 8, AVR_IDLEN);
+  partid[AVR_IDLEN - 1] = 0;
+  *img = b;
+  *ents = ent;
 
-    /* check for binary data */
-    found = 0;
-    for (i=0; i<len; i++) {
-      if (buf[i] > 127) {
-        found = 1;
-        break;
-      }
-    }
-    if (found) {
-      fclose(f);
-      return FMT_RBIN;
-    }
+  return n;
 
-    /* check for lines that look like intel hex */
-    if ((buf[0] == ':') && (len >= 11)) {
-      found = 1;
-      for (i=1; i<len; i++) {
-        if (!isxdigit(buf[1])) {
-          found = 0;
-          break;
-        }
-      }
-      if (found) {
-        fclose(f);
-        return FMT_IHEX;
-      }
-    }
+bad:
+  fprintf(stderr, "%s: %s is not a valid image bundle\n",
+          progname, filename);
+  free(b);
+  return -1;
+}
 
-    /* check for lines that look like motorola s-record */
-    if ((buf[0] == 'S') && (len >= 10) && isdigit(buf[1])) {
-      found = 1;
-      for (i=1; i<len; i++) {
-        if (!isxdigit(buf[1])) {
-          found = 0;
-          break;
-        }
-      }
-      if (found) {
-        fclose(f);
-        return FMT_SREC;
-      }
-    }
 
-    first = 0;
+/*
+ * Add the names of all memories in bundle filename to the list names.
+ */
+int fileio_bundle_list(char * filename, LISTID names)
+{
+  unsigned char * img;
+  struct bundle_ent * ent;
+  char partid[AVR_IDLEN];
+  char * name;
+  int i, n;
+
+  n = bundle_load(filename, &img, &ent, partid);
+  if (n < 0)
+    return -1;
+
+  for (i = 0; i < n; i++) {
+    if ((name = strdup(ent[i].desc)) == NULL) {
+      fprintf(stderr, "%s: out of memory\n", progname);
+      n = -1;
+      break;
+    }
+    ladd(names, name);
   }
 
-  fclose(f);
-  return -1;
-}
+  free(img);
+  free(ent);
 
+  return n;
+}
 
 
-int fileio(int op, char * filename, FILEFMT format, 
-             struct avrpart * p, char * memtype, int size)
+static int bundle_read(char * filename, struct avrpart * p, AVRMEM * mem)
 {
-  int rc;
-  FILE * f;
-  char * fname;
-  struct fioparms fio;
-  AVRMEM * mem;
+  unsigned char * img, * page;
+  struct bundle_ent * ent, * e;
+  char partid[AVR_IDLEN];
+  unsigned int i, len;
+  int n, rc;
+
+  n = bundle_load(filename, &img, &ent, partid);
+  if (n < 0)
+    return -1;
+
+  rc = -1;
+  if (strcmp(partid, p->id) != 0) {
+    fprintf(stderr, "%s: bundle %s is for part %s, not %s\n",
+            progname, filename, partid, p->id);
+    goto done;
+  }
+
+  for (e = NULL, i = 0; i < (unsigned int)n; i++)
+    if (strcmp(ent[i].desc, mem->desc) == 0)
+      e = &ent[i];
+  if (e == NULL) {
+    fprintf(stderr, "%s: bundle %s does not contain \"%s\" memory\n",
+            progname, filename, mem->desc);
+    goto done;
+  }
+  if (e->size != (unsigned int)mem->size) {
+    fprintf(stderr, "%s: \"%s\" memory in bundle %s has %u bytes, "
+            "expected %d\n",
+            progname, mem->desc, filename, e->size, mem->size);
+    goto done;
+  }
+
+  for (i = 0; i < e->npages; i++) {
+    if ((img[e->bitmap + i / 8] & (1 << (i % 8))) == 0)
+      continue;
+    page = img + e->data + i * e->pagesize;
+    if (crcsum(page, e->pagesize, 0xffff) !=
+        (img[e->crc + 2 * i] | (img[e->crc + 2 * i + 1] << 8))) {
+      fprintf(stderr, "%s: bundle %s: checksum error in \"%s\" page %u\n",
+              progname, filename, mem->desc, i);
+      goto done;
+    }
+    len = e->pagesize;
+    if (i * e->pagesize + len > e->size)
+      len = e->size - i * e->pagesize;
+    memcpy(mem->buf + i * e->pagesize, page, len);
+    memset(mem->tags + i * e->pagesize, TAG_ALLOCATED, len);
+  }
+  rc = e->rc;
+
+done:
+  free(img);
+  free(ent);
+  return rc;
+}
+
+
+/*
+ * Add the first size bytes of mem to bundle filename, replacing an
+ * earlier copy of the same memory.  Other memories already in the
+ * bundle are kept if it is for the same part.
+ */
+static int bundle_write(char * filename, struct avrpart * p, AVRMEM * mem,
+                        int size)
+{
+  unsigned char * img, * out, * b;
+  struct bundle_ent * ent, * e, * oent;
+  char partid[AVR_IDLEN];
+  unsigned int i, j, n, on, off, len, pagesize;
+  unsigned short crc;
+  FILE * f;
+  int rc;
+
+  /* pick up what is in the bundle already */
+  img = NULL;
+  oent = NULL;
+  on = 0;
+  f = fopen(filename, "rb");
+  if (f != NULL) {
+    fclose(f);
+    rc = bundle_load(filename, &img, &oent, partid);
+    if (rc < 0) {
+      /* don't clobber a file that is not ours */
+      fprintf(stderr, "%s: not overwriting %s\n", progname, filename);
+      return -1;
+    }
+    if (rc > 0 && strcmp(partid, p->id) != 0) {
+      fprintf(stderr, "%s: bundle %s is for part %s, not %s\n",
+              progname, filename, partid, p->id);
+      free(img);
+      free(oent);
+      return -1;
+    }
+    if (rc > 0)
+      on = rc;
+  }
+
+  ent = calloc(on + 1, sizeof(struct bundle_ent));
+  if (ent == NULL) {
+    fprintf(stderr, "%s: out of memory\n", progname);
+    free(img);
+    free(oent);
+    return -1;
+  }
+  for (i = 0, n = 0; i < on; i++)
+    if (strcmp(oent[i].desc, mem->desc) != 0)
+      ent[n++] = oent[i];
+
+  pagesize = mem->page_size > 0? mem->page_size: mem->size;
+  e = &ent[n++];
+  len = strlen(mem->desc);
+  if (len > AVR_MEMDESCLEN - 1)
+    len = AVR_MEMDESCLEN - 1;
+  memcpy(e->desc, mem->desc, len);
+  e->desc[len] = 0;
+  e->size = mem->size;
+  e->pagesize = pagesize;
+  e->npages = (mem->size + pagesize - 1) / pagesize;
+  e->rc = size;
+  e->data = 0; /* new */
+
+  /* lay out the file */
+  off = BUNDLE_HDRSIZE + n * BUNDLE_ENTSIZE;
+  for (i = 0; i < n; i++) {
+    ent[i].bitmap = off;
+    off += (ent[i].npages + 7) / 8;
+    ent[i].crc = off;
+    off += 2 * ent[i].npages;
+  }
+  for (i = 0; i < n; i++) {
+    off = (off + BUNDLE_ALIGN - 1) & ~(BUNDLE_ALIGN - 1);
+    ent[i].data = off;
+    off += ent[i].npages * ent[i].pagesize;
+  }
+
+  out = calloc(1, off);
+  if (out == NULL) {
+    fprintf(stderr, "%s: out of memory\n", progname);
+    free(img);
+    free(oent);
+    free(ent);
+    return -1;
+  }
+
+  memcpy(out, BUNDLE_MAGIC, sizeof(BUNDLE_MAGIC));
+  len = strlen(p->id);
+  if (len > AVR_IDLEN - 1)
+    len = AVR_IDLEN - 1;
+  memcpy(out + 8, p->id, len); /* zero terminated by calloc() */
+  bundle_put32(out + 40, n);
+  for (i = 0; i < n; i++) {
+    b = out + BUNDLE_HDRSIZE + i * BUNDLE_ENTSIZE;
+    memcpy(b, ent[i].desc, AVR_MEMDESCLEN);
+    bundle_put32(b + 64, ent[i].size);
+    bundle_put32(b + 68, ent[i].pagesize);
+    bundle_put32(b + 72, ent[i].npages);
+    bundle_put32(b + 76, ent[i].rc);
+    bundle_put32(b + 80, ent[i].data);
+    bundle_put32(b + 84, ent[i].bitmap);
+    bundle_put32(b + 88, ent[i].crc);
+
+    if (i < n - 1) {
+      /* copy an existing memory over from the old bundle */
+      for (j = 0; strcmp(oent[j].desc, ent[i].desc) != 0; j++)
+        ;
+      memcpy(out + ent[i].bitmap, img + oent[j].bitmap,
+             (ent[i].npages + 7) / 8);
+      memcpy(out + ent[i].crc, img + oent[j].crc, 2 * ent[i].npages);
+      memcpy(out + ent[i].data, img + oent[j].data,
+             ent[i].npages * ent[i].pagesize);
+      continue;
+    }
+
+    /* the new memory, padded with 0xff */
+    b = out + ent[i].data;
+    memset(b, 0xff, ent[i].npages * pagesize);
+    memcpy(b, mem->buf, mem->size);
+    for (j = 0; j < ent[i].npages; j++) {
+      if (j * pagesize < (unsigned int)size)
+        out[ent[i].bitmap + j / 8] |= 1 << (j % 8);
+      crc = crcsum(b + j * pagesize, pagesize, 0xffff);
+      out[ent[i].crc + 2 * j] = crc & 0xff;
+      out[ent[i].crc + 2 * j + 1] = crc >> 8;
+    }
+  }
+
+  rc = size;
+  f = fopen(filename, "wb");
+  if (f == NULL) {
+    fprintf(stderr, "%s: can't open bundle %s: %s\n",
+            progname, filename, strerror(errno));
+    rc = -1;
+  }
+  else {
+    len = fwrite(out, 1, off, f);
+    if (fclose(f) != 0 || len != off) {
+      fprintf(stderr, "%s: error writing bundle %s: %s\n",
+              progname, filename, strerror(errno));
+      rc = -1;
+    }
+  }
+
+  free(out);
+  free(img);
+  free(oent);
+  free(ent);
+
+  return rc;
+}
+
+
+static int fileio_bundle(struct fioparms * fio, char * filename,
+                         struct avrpart * p, AVRMEM * mem, int size)
+{
+  switch (fio->op) {
+    case FIO_READ:
+      return bundle_read(filename, p, mem);
+
+    case FIO_WRITE:
+      return bundle_write(filename, p, mem, size);
+
+    default:
+      fprintf(stderr, "%s: invalid image bundle I/O operation=%d\n",
+              progname, fio->op);
+      return -1;
+  }
+}
+
+
+
+int fileio_setparms(int op, struct fioparms * fp,
+                    struct avrpart * p, AVRMEM * m)
+{
+  fp->op = op;
+  fp->start = 0;
+
+  switch (op) {
+    case FIO_READ:
+      fp->mode   = "r";
+      fp->iodesc = "input";
+      fp->dir    = "from";
+      fp->rw     = "read";
+      break;
+
+    case FIO_WRITE:
+      fp->mode   = "w";
+      fp->iodesc = "output";
+      fp->dir    = "to";
+      fp->rw     = "wrote";
+      break;
+
+    default:
+      fprintf(stderr, "%s: invalid I/O operation %d\n",
+              progname, op);
+      return -1;
+      break;
+  }
+
+  /*
+   * AVR32 devices maintain their load offset within the file itself,
+   * but AVRDUDE maintains all memory images 0-based.
+   */
+  if ((p->flags & AVRPART_AVR32) != 0)
+  {
+    fp->fileoffset = m->offset;
+  }
+  else
+  {
+    fp->fileoffset = 0;
+  }
+
+  return 0;
+}
+
+
+
+/*
+ * Read the remainder of the open file f into a malloc()ed buffer.  On
+ * success, the buffer and its length are returned via data and
+ * datalen, and the caller is responsible for freeing the buffer.
+ */
+static int fileio_slurp(FILE * f, unsigned char ** data, size_t * datalen)
+{
+  unsigned char * buf, * nbuf;
+  size_t len, size, n;
+
+  size = 64 * 1024;
+  len  = 0;
+  buf  = malloc(size);
+  if (buf == NULL) {
+    fprintf(stderr, "%s: out of memory reading input file\n", progname);
+    return -1;
+  }
+
+  while ((n = fread(buf + len, 1, size - len, f)) > 0) {
+    len += n;
+    if (len == size) {
+      size *= 2;
+      nbuf = realloc(buf, size);
+      if (nbuf == NULL) {
+        fprintf(stderr, "%s: out of memory reading input file\n", progname);
+        free(buf);
+        return -1;
+      }
+      buf = nbuf;
+    }
+  }
+
+  if (ferror(f)) {
+    fprintf(stderr, "%s: read error: %s\n", progname, strerror(errno));
+    free(buf);
+    return -1;
+  }
+
+  *data    = buf;
+  *datalen = len;
+
+  return 0;
+}
+
+
+
+/*
+ * Guess the format of file fname.  If *data already holds the file
+ * contents, they are used as they are.  Otherwise the file is read in
+ * once; if data is not NULL, its contents are handed back to the
+ * caller (who must free them) so the file does not need to be read a
+ * second time.
+ */
+static int fmt_autodetect(char * fname, unsigned char ** data,
+                          size_t * datalen)
+{
+  FILE * f;
+  unsigned char * contents, * rec, * end;
+  unsigned char buf[MAX_LINE_LEN];
+  size_t contentlen;
+  int i;
+  int len, linelen;
+  int found;
+  int first = 1;
+  int format;
+
+  if (data != NULL && *data != NULL) {
+    contents = *data;
+    contentlen = *datalen;
+  }
+  else {
+    f = fopen(fname, "r");
+    if (f == NULL) {
+      fprintf(stderr, "%s: error opening %s: %s\n",
+              progname, fname, strerror(errno));
+      return -1;
+    }
+
+    if (fileio_slurp(f, &contents, &contentlen) < 0) {
+      fclose(f);
+      return -1;
+    }
+    fclose(f);
+  }
+
+  format = -1;
+  end = contents + contentlen;
+  for (rec = contents; rec < end; rec += linelen) {
+    /* split into lines the same way fgets() would */
+    for (linelen = 0; rec + linelen < end && linelen < MAX_LINE_LEN - 1; )
+      if (rec[linelen++] == '\n')
+        break;
+    memcpy(buf, rec, linelen);
+    buf[linelen] = 0;
+
+    /* check for ELF file */
+    if (first &&
+        (buf[0] == 0177 && buf[1] == 'E' &&
+         buf[2] == 'L' && buf[3] == 'F')) {
+      format = FMT_ELF;
+      break;
+    }
+
+    /* check for image bundle */
+    if (first && linelen >= (int)sizeof(BUNDLE_MAGIC) &&
+        memcmp(buf, BUNDLE_MAGIC, sizeof(BUNDLE_MAGIC)) == 0) {
+      format = FMT_BUNDLE;
+      break;
+    }
+
+    len = strlen((char *)buf);
+    if (len > 0 && buf[len-1] == '\n')
+      buf[--len] = 0;
+
+    /* check for binary data */
+    found = 0;
+    for (i=0; i<len; i++) {
+      if (buf[i] > 127) {
+        found = 1;
+        break;
+      }
+    }
+    if (found) {
+      format = FMT_RBIN;
+      break;
+    }
+
+    /* check for lines that look like intel hex */
+    if ((buf[0] == ':') && (len >= 11)) {
+      found = 1;
+      for (i=1; i<len; i++) {
+        if (!isxdigit(buf[1])) {
+          found = 0;
+          break;
+        }
+      }
+      if (found) {
+        format = FMT_IHEX;
+        break;
+      }
+    }
+
+    /* check for lines that look like motorola s-record */
+    if ((buf[0] == 'S') && (len >= 10) && isdigit(buf[1])) {
+      found = 1;
+      for (i=1; i<len; i++) {
+        if (!isxdigit(buf[1])) {
+          found = 0;
+          break;
+        }
+      }
+      if (found) {
+        format = FMT_SREC;
+        break;
+      }
+    }
+
+    first = 0;
+  }
+
+  if (data != NULL) {
+    *data = contents;
+    *datalen = contentlen;
+  }
+  else {
+    free(contents);
+  }
+
+  return format;
+}
+
+
+
+/*
+ * Cache of parsed input files.  If the environment variable
+ * AVRDUDE_CACHE names a directory, the memory contents obtained from
+ * an input file are stored there, keyed by the identity of the file
+ * (device and inode) and the memory layout, and reused whenever the
+ * same file is loaded into the same memory again.
+ *
+ * An entry is trusted if the file still has the size and modification
+ * time it had when the entry was made, and was last modified before
+ * that.  If only the size matches, or the file may have changed within
+ * the same second, the file contents are hashed and compared with the
+ * hash recorded in the entry, if there is one.
+ *
+ * A cache file consists of a struct imgcache_hdr, the allocated
+ * extents of the memory (pairs of start address and length), a CRC
+ * for each page of the memory, and the data of all extents.  Bytes
+ * outside the extents are 0xff.
+ */
+#define IMGCACHE_MAGIC "AVRIMG2"
+
+struct imgcache {
+  char     path[PATH_MAX];
+  uint64_t key;
+  uint64_t hash;        /* file contents, 0 if not known */
+  int64_t  fsize;
+  int64_t  mtime;
+  unsigned char * data; /* file contents read for the lookup, or NULL */
+  size_t   datalen;
+};
+
+struct imgcache_hdr {
+  char     magic[8];
+  uint64_t key;
+  uint64_t hash;        /* file contents, 0 if not known */
+  int64_t  fsize;       /* file size and modification time ... */
+  int64_t  mtime;
+  int64_t  stored;      /* ... when the entry was stored */
+  int32_t  rc;          /* fileio() result */
+  int32_t  memsize;
+  int32_t  pagesize;
+  int32_t  nextents;
+};
+
+
+static uint64_t fnv1a(uint64_t h, const void * data, size_t len)
+{
+  const unsigned char * p = data;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    h ^= p[i];
+    h *= 0x100000001b3ULL;
+  }
+
+  return h;
+}
+
+
+static uint64_t imgcache_hash(const unsigned char * data, size_t len)
+{
+  return fnv1a(0xcbf29ce484222325ULL, data, len);
+}
+
+
+static int imgcache_pagesize(AVRMEM * mem)
+{
+  return mem->page_size > 0? mem->page_size: 256;
+}
+
+
+static unsigned short imgcache_pagecrc(AVRMEM * mem, int addr, int pagesize)
+{
+  if (addr + pagesize > mem->size)
+    pagesize = mem->size - addr;
+
+  return crcsum(mem->buf + addr, pagesize, 0xffff);
+}
+
+
+/*
+ * Record the current state of the input file in the header of the
+ * cache entry after its contents were found unchanged, so the next
+ * lookup can go by stat() alone.
+ */
+static void imgcache_refresh(struct imgcache * ic, struct imgcache_hdr * hdr)
+{
+  FILE * f;
+
+  hdr->mtime = ic->mtime;
+  hdr->stored = time(NULL);
+  f = fopen(ic->path, "r+b");
+  if (f == NULL)
+    return;
+  fwrite(hdr, sizeof(*hdr), 1, f);
+  fclose(f);
+}
+
+
+/*
+ * Look up the input file fname in the cache.  If it is there, fill
+ * in the memory and return what fileio_*() returned when parsing it.
+ * Otherwise, return -1; ic then tells imgcache_store() where the
+ * result belongs (ic->path is empty if caching is disabled), and
+ * ic->data holds the file contents if they had to be read.
+ */
+static int imgcache_lookup(struct imgcache * ic, char * fname,
+                           FILEFMT format, struct avrpart * p, AVRMEM * mem,
+                           unsigned int fileoffset)
+{
+  char * dir;
+  FILE * f;
+  unsigned char * data, * dp;
+  size_t datalen, need;
+  struct imgcache_hdr hdr;
+  struct stat st;
+  int32_t * ext;
+  unsigned short * crc;
+  int pagesize, npages, i, fmt, refresh;
+  unsigned int flags;
+  uint64_t h, dev, ino;
+
+  ic->path[0] = 0;
+  ic->hash = 0;
+  ic->data = NULL;
+  ic->datalen = 0;
+
+  dir = getenv("AVRDUDE_CACHE");
+  if (dir == NULL || *dir == 0)
+    return -1;
+
+  if (stat(fname, &st) != 0)
+    return -1; /* let the caller report it */
+  ic->fsize = st.st_size;
+  ic->mtime = st.st_mtime;
+
+  fmt = format;
+  flags = p->flags & (AVRPART_AVR32 | AVRPART_HAS_PDI);
+  dev = st.st_dev;
+  ino = st.st_ino;
+  h = fnv1a(0xcbf29ce484222325ULL, &dev, sizeof(dev));
+  h = fnv1a(h, &ino, sizeof(ino));
+  if (ino == 0)
+    /* no inode numbers (Win32): go by the name */
+    h = fnv1a(h, fname, strlen(fname));
+  h = fnv1a(h, &fmt, sizeof(fmt));
+  h = fnv1a(h, p->id, strlen(p->id));
+  h = fnv1a(h, &flags, sizeof(flags));
+  h = fnv1a(h, mem->desc, strlen(mem->desc));
+  h = fnv1a(h, &mem->size, sizeof(mem->size));
+  h = fnv1a(h, &mem->page_size, sizeof(mem->page_size));
+  h = fnv1a(h, &mem->offset, sizeof(mem->offset));
+  h = fnv1a(h, &fileoffset, sizeof(fileoffset));
+
+  ic->key = h;
+  snprintf(ic->path, sizeof(ic->path), "%s/%016llx.img",
+           dir, (unsigned long long)h);
+
+  f = fopen(ic->path, "rb");
+  if (f == NULL)
+    return -1;
+  i = fileio_slurp(f, &data, &datalen);
+  fclose(f);
+  if (i < 0)
+    return -1;
+
+  pagesize = imgcache_pagesize(mem);
+  npages = (mem->size + pagesize - 1) / pagesize;
+
+  if (datalen < sizeof(hdr))
+    goto bad;
+  memcpy(&hdr, data, sizeof(hdr));
+  if (memcmp(hdr.magic, IMGCACHE_MAGIC, sizeof(hdr.magic)) != 0 ||
+      hdr.key != h || hdr.memsize != mem->size ||
+      hdr.pagesize != pagesize || hdr.nextents < 0 ||
+      hdr.nextents > mem->size)
+    goto bad;
+
+  if (hdr.fsize != ic->fsize) {
+    free(data);
+    return -1;
+  }
+  refresh = 0;
+  if (hdr.mtime != ic->mtime || ic->mtime >= hdr.stored) {
+    /* the file may have changed; compare the contents */
+    if (hdr.hash == 0) {
+      free(data);
+      return -1;
+    }
+    f = fopen(fname, "rb");
+    if (f == NULL || fileio_slurp(f, &ic->data, &ic->datalen) < 0) {
+      if (f != NULL)
+        fclose(f);
+      free(data);
+      return -1;
+    }
+    fclose(f);
+    ic->hash = imgcache_hash(ic->data, ic->datalen);
+    if (ic->hash != hdr.hash) {
+      free(data);
+      return -1;
+    }
+    refresh = 1;
+  }
+
+  need = sizeof(hdr) + hdr.nextents * 2 * sizeof(int32_t) +
+    npages * sizeof(unsigned short);
+  if (datalen < need)
+    goto bad;
+
+  ext = (int32_t *)(data + sizeof(hdr));
+  crc = (unsigned short *)(ext + 2 * hdr.nextents);
+  dp = data + need;
+  for (i = 0; i < hdr.nextents; i++) {
+    if (ext[2 * i] < 0 || ext[2 * i + 1] < 0 ||
+        ext[2 * i] + ext[2 * i + 1] > mem->size ||
+        need + ext[2 * i + 1] > datalen)
+      goto bad;
+    memcpy(mem->buf + ext[2 * i], dp, ext[2 * i + 1]);
+    memset(mem->tags + ext[2 * i], TAG_ALLOCATED, ext[2 * i + 1]);
+    dp += ext[2 * i + 1];
+    need += ext[2 * i + 1];
+  }
+
+  for (i = 0; i < npages; i++)
+    if (imgcache_pagecrc(mem, i * pagesize, pagesize) != crc[i])
+      goto bad;
+
+  if (verbose >= 2) {
+    fprintf(stderr, "%s: using cached image %s for %s\n",
+            progname, ic->path, fname);
+  }
+
+  if (refresh)
+    imgcache_refresh(ic, &hdr);
+  free(ic->data);
+  ic->data = NULL;
+  free(data);
+  return hdr.rc;
+
+bad:
+  if (verbose >= 1) {
+    fprintf(stderr, "%s: ignoring invalid image cache file %s\n",
+            progname, ic->path);
+  }
+  memset(mem->buf, 0xff, mem->size);
+  memset(mem->tags, 0, mem->size);
+  free(data);
+  return -1;
+}
+
+
+/*
+ * Store the memory contents just parsed into the cache file that
+ * imgcache_lookup() determined.  data is the file contents if the
+ * parser had them at hand, else NULL.  Failures are not fatal.
+ */
+static void imgcache_store(struct imgcache * ic, AVRMEM * mem, int rc,
+                           unsigned char * data, size_t datalen)
+{
+  struct imgcache_hdr hdr;
+  char tmp[PATH_MAX + 4];
+  FILE * f;
+  int32_t * ext;
+  unsigned short * crc;
+  int pagesize, npages, i, start, ok;
+
+  if (ic->path[0] == 0)
+    return;
+
+  pagesize = imgcache_pagesize(mem);
+  npages = (mem->size + pagesize - 1) / pagesize;
+
+  /* at most one extent per two bytes of memory */
+  ext = malloc((mem->size / 2 + 1) * 2 * sizeof(int32_t));
+  crc = malloc(npages * sizeof(unsigned short));
+  if (ext == NULL || crc == NULL) {
+    free(ext);
+    free(crc);
+    return;
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, IMGCACHE_MAGIC, sizeof(hdr.magic));
+  hdr.key = ic->key;
+  hdr.hash = ic->hash;
+  if (hdr.hash == 0 && data != NULL)
+    hdr.hash = imgcache_hash(data, datalen);
+  hdr.fsize = ic->fsize;
+  hdr.mtime = ic->mtime;
+  hdr.stored = time(NULL);
+  hdr.rc = rc;
+  hdr.memsize = mem->size;
+  hdr.pagesize = pagesize;
+  for (i = 0; i < mem->size; ) {
+    if ((mem->tags[i] & TAG_ALLOCATED) == 0) {
+      i++;
+      continue;
+    }
+    for (start = i; i < mem->size && (mem->tags[i] & TAG_ALLOCATED); i++)
+      ;
+    ext[2 * hdr.nextents] = start;
+    ext[2 * hdr.nextents + 1] = i - start;
+    hdr.nextents++;
+  }
+  for (i = 0; i < npages; i++)
+    crc[i] = imgcache_pagecrc(mem, i * pagesize, pagesize);
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", ic->path);
+  f = fopen(tmp, "wb");
+  ok = f != NULL;
+  if (ok) {
+    ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 &&
+      fwrite(ext, 2 * sizeof(int32_t), hdr.nextents, f) ==
+      (size_t)hdr.nextents &&
+      fwrite(crc, sizeof(unsigned short), npages, f) == (size_t)npages;
+    for (i = 0; ok && i < hdr.nextents; i++)
+      ok = fwrite(mem->buf + ext[2 * i], 1, ext[2 * i + 1], f) ==
+        (size_t)ext[2 * i + 1];
+    if (fclose(f) != 0)
+      ok = 0;
+    if (ok)
+      ok = rename(tmp, ic->path) == 0;
+    if (!ok)
+      remove(tmp);
+  }
+  if (!ok && verbose >= 1) {
+    fprintf(stderr, "%s: cannot write image cache file %s: %s\n",
+            progname, ic->path, strerror(errno));
+  }
+
+  free(ext);
+  free(crc);
+}
+
+
+/*
+ * For flash memories, a read from a file reports the highest non-0xff
+ * address as its size.
+ */
+static int fileio_flashsize(AVRMEM * mem, int rc)
+{
+  if (rc > 0 && (strcasecmp(mem->desc, "flash") == 0 ||
+                 strcasecmp(mem->desc, "application") == 0 ||
+                 strcasecmp(mem->desc, "apptable") == 0 ||
+                 strcasecmp(mem->desc, "boot") == 0))
+    return avr_mem_hiaddr(mem);
+
+  return rc;
+}
+
+
+
+int fileio(int op, char * filename, FILEFMT format, 
+             struct avrpart * p, char * memtype, int size)
+{
+  return fileio_range(op, filename, format, p, memtype, 0, size);
+}
+
+
+/*
+ * Like fileio(), but an FIO_WRITE only writes the size bytes of the
+ * memory from start on, at their memory addresses where the file
+ * format has addresses.
+ */
+int fileio_range(int op, char * filename, FILEFMT format,
+                 struct avrpart * p, char * memtype, int start, int size)
+{
+  int rc;
+  FILE * f;
+  char * fname;
+  struct fioparms fio;
+  AVRMEM * mem;
   int using_stdio;
+  unsigned char * data;
+  size_t datalen;
+  struct imgcache ic;
 
   mem = avr_locate_mem(p, memtype);
   if (mem == NULL) {
@@ -1511,6 +2658,19 @@ int fileio(int op, char * filename, FILEFMT format,
   if (rc < 0)
     return -1;
 
+  if (start != 0) {
+    if (fio.op != FIO_WRITE || format == FMT_BUNDLE ||
+        start < 0 || start + size > mem->size) {
+      fprintf(stderr, "%s: invalid range 0x%x..0x%x of %s memory\n",
+              progname, start, start + size - 1, mem->desc);
+      return -1;
+    }
+    fio.start = start;
+  }
+
+  if (avr_mem_unshare(mem) < 0)
+    return -1;
+
   if (fio.op == FIO_READ)
     size = mem->size;
 
@@ -1518,7 +2678,7 @@ int fileio(int op, char * filename, FILEFMT format,
     /* 0xff fill unspecified memory */
     memset(mem->buf, 0xff, size);
   }
-  memset(mem->tags, 0, size);
+  memset(mem->tags + fio.start, 0, size);
 
   using_stdio = 0;
 
@@ -1538,6 +2698,20 @@ int fileio(int op, char * filename, FILEFMT format,
     f = NULL;
   }
 
+  data = NULL;
+  datalen = 0;
+
+  ic.path[0] = 0;
+  if (fio.op == FIO_READ && !using_stdio && format != FMT_IMM &&
+      format != FMT_BUNDLE) {
+    rc = imgcache_lookup(&ic, fname, format, p, mem, fio.fileoffset);
+    if (rc >= 0)
+      return fileio_flashsize(mem, rc);
+    /* the lookup may have read the file already */
+    data = ic.data;
+    datalen = ic.datalen;
+  }
+
   if (format == FMT_AUTO) {
     if (using_stdio) {
       fprintf(stderr, 
@@ -1547,13 +2721,19 @@ int fileio(int op, char * filename, FILEFMT format,
       return -1;
     }
 
-    format = fmt_autodetect(fname);
+    format = fmt_autodetect(fname, fio.op == FIO_READ? &data: NULL, &datalen);
     if (format < 0) {
       fprintf(stderr, 
               "%s: can't determine file format for %s, specify explicitly\n",
               progname, fname);
+      free(data);
       return -1;
     }
+    if (format != FMT_IHEX && ic.path[0] == 0) {
+      /* neither the parser nor the cache needs the contents */
+      free(data);
+      data = NULL;
+    }
 
     if (quell_progress < 2) {
       fprintf(stderr, "%s: %s file %s auto detected as %s\n", 
@@ -1561,6 +2741,19 @@ int fileio(int op, char * filename, FILEFMT format,
     }
   }
 
+  if (format == FMT_BUNDLE) {
+    if (using_stdio) {
+      fprintf(stderr, "%s: can't use image bundles with stdin/out\n",
+              progname);
+      return -1;
+    }
+    free(data);
+    rc = fileio_bundle(&fio, fname, p, mem, size);
+    if (rc >= 0 && fio.op == FIO_READ)
+      rc = fileio_flashsize(mem, rc);
+    return rc;
+  }
+
 #if defined(WIN32NATIVE)
   /* Open Raw Binary format in binary mode on Windows.*/
   if(format == FMT_RBIN)
@@ -1582,14 +2775,23 @@ int fileio(int op, char * filename, FILEFMT format,
       if (f == NULL) {
         fprintf(stderr, "%s: can't open %s file %s: %s\n",
                 progname, fio.iodesc, fname, strerror(errno));
+        free(data);
         return -1;
       }
     }
   }
 
+  if (format == FMT_IHEX && fio.op == FIO_READ && data == NULL) {
+    if (fileio_slurp(f, &data, &datalen) < 0) {
+      if (!using_stdio)
+        fclose(f);
+      return -1;
+    }
+  }
+
   switch (format) {
     case FMT_IHEX:
-      rc = fileio_ihex(&fio, fname, f, mem, size);
+      rc = fileio_ihex(&fio, fname, f, data, datalen, mem, size);
       break;
 
     case FMT_SREC:
@@ -1626,21 +2828,20 @@ int fileio(int op, char * filename, FILEFMT format,
     default:
       fprintf(stderr, "%s: invalid %s file format: %d\n",
               progname, fio.iodesc, format);
+      free(data);
       return -1;
   }
 
-  if (rc > 0) {
-    if ((op == FIO_READ) && (strcasecmp(mem->desc, "flash") == 0 ||
-                             strcasecmp(mem->desc, "application") == 0 ||
-                             strcasecmp(mem->desc, "apptable") == 0 ||
-                             strcasecmp(mem->desc, "boot") == 0)) {
-      /*
-       * if we are reading flash, just mark the size as being the
-       * highest non-0xff byte
-       */
-      rc = avr_mem_hiaddr(mem);
-    }
+  if (rc >= 0 && op == FIO_READ) {
+    imgcache_store(&ic, mem, rc, data, datalen);
+
+    /*
+     * if we are reading flash, just mark the size as being the
+     * highest non-0xff byte
+     */
+    rc = fileio_flashsize(mem, rc);
   }
+  free(data);
   if (format != FMT_IMM && !using_stdio) {
     fclose(f);
   }
@@ -1648,3 +2849,217 @@ int fileio(int op, char * filename, FILEFMT format,
   return rc;
 }
 
+
+
+/*
+ * Streaming output of a memory that is being read from the device.
+ * avr_read() reports each completed part of the memory through
+ * fileio_stream_put(), which writes out everything that cannot change
+ * anymore; fileio_stream_close() writes the remainder once the final
+ * size is known.  The file contents are the same as fileio() would
+ * produce after the read.
+ */
+struct fiostream {
+  FILEFMT  format;
+  struct fioparms fio;
+  char   * fname;
+  char     tmpname[PATH_MAX + 4];  /* written first, renamed on success */
+  FILE   * f;
+  int      using_stdio;
+  AVRMEM * mem;
+  int      trim;     /* trailing 0xff bytes will be cut off */
+  int      hiaddr;   /* end of the non-0xff data seen so far */
+  int      scanned;  /* number of bytes looked at for hiaddr */
+  int      pos;      /* raw binary: number of bytes written */
+  struct hexout * h;
+};
+
+
+int fileio_streamable(FILEFMT format)
+{
+  return format == FMT_IHEX || format == FMT_SREC || format == FMT_RBIN;
+}
+
+
+struct fiostream * fileio_stream_open(char * filename, FILEFMT format,
+                                      struct avrpart * p, char * memtype)
+{
+  struct fiostream * s;
+  AVRMEM * mem;
+
+  mem = avr_locate_mem(p, memtype);
+  if (mem == NULL) {
+    fprintf(stderr, 
+            "fileio(): memory type \"%s\" not configured for device \"%s\"\n",
+            memtype, p->desc);
+    return NULL;
+  }
+
+  if (!fileio_streamable(format)) {
+    fprintf(stderr, "%s: cannot stream %s file format\n",
+            progname, fmtstr(format));
+    return NULL;
+  }
+
+  s = calloc(1, sizeof(struct fiostream));
+  if (s == NULL) {
+    fprintf(stderr, "%s: out of memory\n", progname);
+    return NULL;
+  }
+
+  if (fileio_setparms(FIO_WRITE, &s->fio, p, mem) < 0) {
+    free(s);
+    return NULL;
+  }
+
+#if defined(WIN32NATIVE)
+  /* Open Raw Binary format in binary mode on Windows.*/
+  if (format == FMT_RBIN)
+    s->fio.mode = "wb";
+#endif
+
+  s->format = format;
+  s->mem    = mem;
+  s->trim   = strcasecmp(mem->desc, "flash") == 0 ||
+              strcasecmp(mem->desc, "application") == 0 ||
+              strcasecmp(mem->desc, "apptable") == 0 ||
+              strcasecmp(mem->desc, "boot") == 0;
+
+  if (strcmp(filename, "-") == 0) {
+    s->fname = "<stdout>";
+    s->f = stdout;
+    s->using_stdio = 1;
+  }
+  else {
+    /* leave an existing file alone until the read has succeeded */
+    s->fname = filename;
+    if (snprintf(s->tmpname, sizeof(s->tmpname), "%s.tmp", filename) >=
+        (int)sizeof(s->tmpname)) {
+      fprintf(stderr, "%s: file name too long: %s\n", progname, filename);
+      free(s);
+      return NULL;
+    }
+    s->f = fopen(s->tmpname, s->fio.mode);
+    if (s->f == NULL) {
+      fprintf(stderr, "%s: can't open %s file %s: %s\n",
+              progname, s->fio.iodesc, filename, strerror(errno));
+      free(s);
+      return NULL;
+    }
+  }
+
+  if (format != FMT_RBIN) {
+    s->h = hexout_new(s->f, s->fname, 32, s->fio.fileoffset);
+    if (s->h == NULL) {
+      if (!s->using_stdio) {
+        fclose(s->f);
+        remove(s->tmpname);
+      }
+      free(s);
+      return NULL;
+    }
+  }
+
+  return s;
+}
+
+
+static int fileio_stream_write(struct fiostream * s, int upto, int final)
+{
+  int rc;
+
+  switch (s->format) {
+    case FMT_IHEX:
+      rc = b2ihex_put(s->h, s->mem->buf, upto, final);
+      if (rc == 0 && final)
+        rc = b2ihex_end(s->h);
+      break;
+
+    case FMT_SREC:
+      rc = b2srec_put(s->h, s->mem->buf, upto, final);
+      if (rc == 0 && final)
+        rc = b2srec_end(s->h);
+      break;
+
+    default:
+      rc = 0;
+      if (upto > s->pos) {
+        if (fwrite(s->mem->buf + s->pos, 1, upto - s->pos, s->f) !=
+            (size_t)(upto - s->pos)) {
+          fprintf(stderr, "%s: error writing %s: %s\n",
+                  progname, s->fname, strerror(errno));
+          return -1;
+        }
+        s->pos = upto;
+      }
+      break;
+  }
+
+  if (rc == 0 && s->h != NULL)
+    rc = hexout_flush(s->h);
+  if (rc == 0)
+    fflush(s->f);
+
+  return rc;
+}
+
+
+/*
+ * The first 'done' bytes of the memory have been read completely.
+ */
+int fileio_stream_put(void * ctx, unsigned long done)
+{
+  struct fiostream * s = ctx;
+  unsigned long i;
+  int upto;
+
+  if (done > s->mem->size)
+    done = s->mem->size;
+
+  upto = done;
+  if (s->trim) {
+    /* hold back 0xff bytes that might turn out to be trailing ones */
+    for (i = s->scanned > 1? s->scanned: 1; i < done; i++)
+      if (s->mem->buf[i] != 0xff)
+        s->hiaddr = i + 1;
+    s->scanned = done;
+    upto = s->hiaddr;
+  }
+
+  return fileio_stream_write(s, upto, 0);
+}
+
+
+/*
+ * Write out the remaining data up to size and close the stream.  The
+ * output replaces the file only then; if size is negative, the read
+ * failed and the file is left as it was.
+ */
+int fileio_stream_close(struct fiostream * s, int size)
+{
+  int rc;
+
+  rc = -1;
+  if (size >= 0)
+    rc = fileio_stream_write(s, size, 1);
+
+  if (!s->using_stdio) {
+    if (fclose(s->f) != 0 && rc == 0) {
+      fprintf(stderr, "%s: error writing %s: %s\n",
+              progname, s->fname, strerror(errno));
+      rc = -1;
+    }
+    if (rc == 0 && rename(s->tmpname, s->fname) != 0) {
+      fprintf(stderr, "%s: can't replace %s: %s\n",
+              progname, s->fname, strerror(errno));
+      rc = -1;
+    }
+    if (rc < 0)
+      remove(s->tmpname);
+  }
+
+  free(s->h);
+  free(s);
+
+  return rc < 0? -1: size;
+}
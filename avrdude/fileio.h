@@ -31,7 +31,8 @@ typedef enum {
   FMT_DEC,
   FMT_OCT,
   FMT_BIN,
-  FMT_ELF
+  FMT_ELF,
+  FMT_BUNDLE
 } FILEFMT;
 
 struct fioparms {
@@ -41,6 +42,7 @@ struct fioparms {
   char * dir;
   char * rw;
   unsigned int fileoffset;
+  int    start;           /* FIO_WRITE: first byte of the memory to write */
 };
 
 enum {
@@ -48,6 +50,8 @@ enum {
   FIO_WRITE
 };
 
+struct fiostream;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -57,6 +61,20 @@ char * fmtstr(FILEFMT format);
 int fileio(int op, char * filename, FILEFMT format,
            struct avrpart * p, char * memtype, int size);
 
+int fileio_range(int op, char * filename, FILEFMT format,
+                 struct avrpart * p, char * memtype, int start, int size);
+
+int fileio_bundle_list(char * filename, LISTID names);
+
+int fileio_streamable(FILEFMT format);
+
+struct fiostream * fileio_stream_open(char * filename, FILEFMT format,
+                                      struct avrpart * p, char * memtype);
+
+int fileio_stream_put(void * ctx, unsigned long done);
+
+int fileio_stream_close(struct fiostream * s, int size);
+
 #ifdef __cplusplus
 }
 #endif
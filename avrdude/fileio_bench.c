@@ -0,0 +1,199 @@
+/*
+ * avrdude - A Downloader/Uploader for AVR device programmers
+ * avrdude is Copyright (C) 2000-2004  Brian S. Dean <bsd@bsdhome.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* $Id$ */
+
+/*
+ * Time the parsing of Intel Hex and Motorola S-record input files.
+ *
+ *   fileio_bench [-s size] [-n rounds]
+ *
+ * A pseudo-random image of size bytes is written in both formats to
+ * temporary files, and each file is then read back rounds times
+ * through fileio().  The image cache is not used.  The program fails
+ * if a file does not read back as the image it was made from.
+ */
+
+#include "ac_cfg.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "avrdude.h"
+#include "avrpart.h"
+#include "fileio.h"
+
+char * progname = "fileio_bench";
+char   progbuf[PATH_MAX];
+int    verbose;
+int    quell_progress = 2;
+int    ovsigck;
+int    skipff;
+
+
+static void write_ihex(FILE * f, unsigned char * image, int size)
+{
+  int addr, i, n;
+  unsigned char sum;
+
+  for (addr = 0; addr < size; addr += n) {
+    if (addr % 0x10000 == 0 && addr != 0) {
+      /* extended linear address record */
+      sum = 2 + 4 + (addr >> 24) + (addr >> 16);
+      fprintf(f, ":02000004%04X%02X\n", addr >> 16, (unsigned char)-sum);
+    }
+    n = size - addr < 32? size - addr: 32;
+    sum = n + (addr >> 8) + addr;
+    fprintf(f, ":%02X%04X00", n, addr & 0xffff);
+    for (i = 0; i < n; i++) {
+      fprintf(f, "%02X", image[addr + i]);
+      sum += image[addr + i];
+    }
+    fprintf(f, "%02X\n", (unsigned char)-sum);
+  }
+  fprintf(f, ":00000001FF\n");
+}
+
+
+static void write_srec(FILE * f, unsigned char * image, int size)
+{
+  int addr, i, n;
+  unsigned char sum;
+
+  fprintf(f, "S0030000FC\n");
+  for (addr = 0; addr < size; addr += n) {
+    n = size - addr < 32? size - addr: 32;
+    sum = n + 5 + (addr >> 24) + (addr >> 16) + (addr >> 8) + addr;
+    fprintf(f, "S3%02X%08X", n + 5, addr);
+    for (i = 0; i < n; i++) {
+      fprintf(f, "%02X", image[addr + i]);
+      sum += image[addr + i];
+    }
+    fprintf(f, "%02X\n", (unsigned char)~sum);
+  }
+  fprintf(f, "S70500000000FA\n");
+}
+
+
+static double now(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+
+static int bench(AVRPART * p, AVRMEM * m, unsigned char * image, int size,
+                 FILEFMT format, int rounds)
+{
+  char fname[] = "/tmp/fileio_benchXXXXXX";
+  double t;
+  FILE * f;
+  int fd, i, rc;
+
+  if ((fd = mkstemp(fname)) < 0 || (f = fdopen(fd, "w")) == NULL) {
+    fprintf(stderr, "%s: cannot create temporary file\n", progname);
+    return -1;
+  }
+  if (format == FMT_IHEX)
+    write_ihex(f, image, size);
+  else
+    write_srec(f, image, size);
+  fclose(f);
+
+  rc = 0;
+  t = now();
+  for (i = 0; i < rounds; i++) {
+    if (fileio(FIO_READ, fname, format, p, "flash", -1) < 0 ||
+        memcmp(m->buf, image, size) != 0) {
+      fprintf(stderr, "%s: %s file did not read back correctly\n",
+              progname, fmtstr(format));
+      rc = -1;
+      break;
+    }
+  }
+  t = now() - t;
+  unlink(fname);
+
+  if (rc == 0)
+    printf("%-20s %8d bytes  %6.2f ms/round  %7.2f MB/s\n",
+           fmtstr(format), size, t * 1000 / rounds,
+           size * (double)rounds / t / 1e6);
+
+  return rc;
+}
+
+
+int main(int argc, char * argv[])
+{
+  unsigned char * image;
+  AVRPART * p;
+  AVRMEM * m;
+  int size = 256 * 1024, rounds = 20;
+  int ch, i, rc;
+
+  while ((ch = getopt(argc, argv, "n:s:")) != -1) {
+    switch (ch) {
+      case 'n':
+        rounds = atoi(optarg);
+        break;
+      case 's':
+        size = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-s size] [-n rounds]\n", progname);
+        return 1;
+    }
+  }
+  if (size <= 0 || rounds <= 0) {
+    fprintf(stderr, "%s: size and rounds must be positive\n", progname);
+    return 1;
+  }
+
+  /* measure the parser, not the cache */
+  unsetenv("AVRDUDE_CACHE");
+
+  p = avr_new_part();
+  strcpy(p->desc, "benchmark");
+  m = avr_new_memtype();
+  strcpy(m->desc, "flash");
+  m->size = size;
+  m->page_size = 256;
+  ladd(p->mem, m);
+
+  image = malloc(size);
+  if (image == NULL) {
+    fprintf(stderr, "%s: out of memory\n", progname);
+    return 1;
+  }
+  srand(1);
+  for (i = 0; i < size; i++)
+    image[i] = rand();
+
+  rc = bench(p, m, image, size, FMT_IHEX, rounds);
+  if (rc == 0)
+    rc = bench(p, m, image, size, FMT_SREC, rounds);
+
+  free(image);
+  return rc < 0? 1: 0;
+}
@@ -47,6 +47,13 @@
 /*
  * Private data for this programmer.
  */
+/*
+ * Paged reads and writes keep up to this many commands outstanding.
+ * The ICE takes the next command off the bulk pipe once it is done
+ * with the previous one, and answers in order.
+ */
+#define JTAG3_QUEUE_MAX 4
+
 struct pdata
 {
   unsigned short command_sequence; /* Next cmd seqno to issue. */
@@ -73,6 +80,28 @@ struct pdata
 
   /* Function to set the appropriate clock parameter */
   int (*set_sck)(PROGRAMMER *, unsigned char *);
+
+  /* Frame buffer for jtag3_sendv(), kept for the session */
+  unsigned char *txbuf;
+  size_t txbuf_size;
+
+  /*
+   * Paged accesses sent without waiting for their answers, oldest
+   * first; see jtag3_queue_send().
+   */
+  struct {
+    unsigned char cmd;		/* CMD3_WRITE_MEMORY or CMD3_READ_MEMORY */
+    unsigned long addr;		/* offset into the memory buffer */
+    unsigned int len;
+  } queue[JTAG3_QUEUE_MAX];
+  int nqueued;
+  int queue_error;		/* a queued write was answered badly */
+
+  /* Read-ahead of jtag3_paged_load() */
+  AVRMEM *rd_mem;		/* memory being read, NULL if none */
+  unsigned long rd_lo, rd_hi;	/* part of rd_mem->buf filled so far */
+  unsigned long rd_next;	/* next address to ask for */
+  int rd_single;		/* ICE refused reads of several units */
 };
 
 #define PDATA(pgm) ((struct pdata *)(pgm->cookie))
@@ -99,6 +128,7 @@ static int jtag3_paged_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
                                 unsigned int page_size,
                                 unsigned int addr, unsigned int n_bytes);
 static unsigned char jtag3_memtype(PROGRAMMER * pgm, AVRPART * p, unsigned long addr);
+static int jtag3_queue_collect(PROGRAMMER * pgm, int keep);
 static unsigned int jtag3_memaddr(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m, unsigned long addr);
 
 
@@ -115,6 +145,7 @@ void jtag3_setup(PROGRAMMER * pgm)
 
 void jtag3_teardown(PROGRAMMER * pgm)
 {
+  free(PDATA(pgm)->txbuf);
   free(pgm->cookie);
 }
 
@@ -395,39 +426,66 @@ static void jtag3_prevent(PROGRAMMER * pgm, unsigned char * data, size_t len)
 
 
 
-int jtag3_send(PROGRAMMER * pgm, unsigned char * data, size_t len)
+/*
+ * Send prefix followed by data as one message, assembled in a buffer
+ * that lives as long as the session.  Queued paged accesses are left
+ * alone; the message gets the sequence number after theirs.
+ */
+int jtag3_sendv(PROGRAMMER * pgm, const unsigned char * prefix, size_t plen,
+		const unsigned char * data, size_t len)
 {
   unsigned char *buf;
+  size_t n = plen + len;
 
   if (verbose >= 3)
     fprintf(stderr, "\n%s: jtag3_send(): sending %lu bytes\n",
-	    progname, (unsigned long)len);
+	    progname, (unsigned long)n);
 
-  if ((buf = malloc(len + 4)) == NULL)
-    {
-      fprintf(stderr, "%s: jtag3_send(): out of memory",
-	      progname);
-      return -1;
-    }
+  if (n + 4 > PDATA(pgm)->txbuf_size) {
+    if ((buf = realloc(PDATA(pgm)->txbuf, n + 4)) == NULL)
+      {
+	fprintf(stderr, "%s: jtag3_send(): out of memory",
+		progname);
+	return -1;
+      }
+    PDATA(pgm)->txbuf = buf;
+    PDATA(pgm)->txbuf_size = n + 4;
+  }
+  buf = PDATA(pgm)->txbuf;
 
   buf[0] = TOKEN;
   buf[1] = 0;                   /* dummy */
-  u16_to_b2(buf + 2, PDATA(pgm)->command_sequence);
-  memcpy(buf + 4, data, len);
+  u16_to_b2(buf + 2, (PDATA(pgm)->command_sequence + PDATA(pgm)->nqueued) %
+	    0xffff);
+  if (plen > 0)
+    memcpy(buf + 4, prefix, plen);
+  memcpy(buf + 4 + plen, data, len);
 
-  if (serial_send(&pgm->fd, buf, len + 4) != 0) {
+  if (serial_send(&pgm->fd, buf, n + 4) != 0) {
     fprintf(stderr,
 	    "%s: jtag3_send(): failed to send command to serial port\n",
 	    progname);
     exit(1);
   }
 
-  free(buf);
-
   return 0;
 }
 
 
+int jtag3_send(PROGRAMMER * pgm, unsigned char * data, size_t len)
+{
+  /*
+   * Anything but the paged access pipeline itself wants its answer
+   * next, and may change what has been read ahead.  The memory read
+   * ahead may be gone by now, so outstanding reads are dropped.
+   */
+  PDATA(pgm)->rd_mem = NULL;
+  jtag3_queue_collect(pgm, 0);
+
+  return jtag3_sendv(pgm, NULL, 0, data, len);
+}
+
+
 static int jtag3_drain(PROGRAMMER * pgm, int display)
 {
   return serial_drain(&pgm->fd, display);
@@ -1216,14 +1274,166 @@ static int jtag3_page_erase(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
   return 0;
 }
 
-static int jtag3_paged_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
-                                unsigned int page_size,
-                                unsigned int addr, unsigned int n_bytes)
+/*
+ * Take in answers to queued commands until no more than keep are
+ * outstanding.  Read data goes straight into the buffer of the memory
+ * being read ahead, or is dropped if there is none.  A failed write
+ * is also remembered in queue_error for the next jtag3_paged_write()
+ * or jtag3_paged_flush().
+ */
+static int jtag3_queue_collect(PROGRAMMER * pgm, int keep)
+{
+  unsigned char *resp;
+  int status, rv = 0;
+
+  while (PDATA(pgm)->nqueued > keep) {
+    if ((status = jtag3_recv(pgm, &resp)) <= 0) {
+      fprintf(stderr,
+	      "%s: jtag3_queue_collect(): "
+	      "timeout/error communicating with programmer (status %d)\n",
+	      progname, status);
+      PDATA(pgm)->nqueued = 0;
+      PDATA(pgm)->queue_error = 1;
+      PDATA(pgm)->rd_mem = NULL;
+      return -1;
+    }
+    if (verbose >= 3) {
+      putc('\n', stderr);
+      jtag3_prmsg(pgm, resp, status);
+    } else if (verbose == 2)
+      fprintf(stderr, "0x%02x (%d bytes msg)\n", resp[1], status);
+
+    if (PDATA(pgm)->queue[0].cmd == CMD3_WRITE_MEMORY) {
+      if ((resp[1] & RSP3_STATUS_MASK) != RSP3_OK) {
+	fprintf(stderr,
+		"%s: bad response to write memory command: 0x%02x\n",
+		progname, resp[1]);
+	PDATA(pgm)->queue_error = 1;
+	rv = -1;
+      }
+    } else if (resp[1] != RSP3_DATA ||
+	       status < PDATA(pgm)->queue[0].len + 4) {
+      if (PDATA(pgm)->rd_mem != NULL) {
+	fprintf(stderr, "%s: wrong/short reply to read memory command\n",
+		progname);
+	/* Don't ask for more than a read unit at a time again. */
+	if (PDATA(pgm)->queue[0].len > PDATA(pgm)->rd_mem->readsize)
+	  PDATA(pgm)->rd_single = 1;
+	PDATA(pgm)->rd_mem = NULL;
+	rv = -1;
+      }
+    } else if (PDATA(pgm)->rd_mem != NULL) {
+      memcpy(PDATA(pgm)->rd_mem->buf + PDATA(pgm)->queue[0].addr, resp + 3,
+	     PDATA(pgm)->queue[0].len);
+      PDATA(pgm)->rd_hi = PDATA(pgm)->queue[0].addr + PDATA(pgm)->queue[0].len;
+    }
+    free(resp);
+
+    PDATA(pgm)->nqueued--;
+    memmove(PDATA(pgm)->queue, PDATA(pgm)->queue + 1,
+	    PDATA(pgm)->nqueued * sizeof(PDATA(pgm)->queue[0]));
+  }
+
+  return rv;
+}
+
+/*
+ * Send a paged access command for len bytes at addr of the memory
+ * buffer without waiting for its answer, then take in answers until
+ * there is room for the next command.
+ */
+static int jtag3_queue_send(PROGRAMMER * pgm, unsigned char * cmd,
+			    size_t cmdlen, unsigned long addr,
+			    unsigned int len)
+{
+  int n = PDATA(pgm)->nqueued;
+
+  if (verbose >= 2)
+    fprintf(stderr, "%s: Sending %s memory command: ",
+	    progname, cmd[1] == CMD3_WRITE_MEMORY? "write": "read");
+
+  PDATA(pgm)->queue[n].cmd = cmd[1];
+  PDATA(pgm)->queue[n].addr = addr;
+  PDATA(pgm)->queue[n].len = len;
+  if (jtag3_sendv(pgm, NULL, 0, cmd, cmdlen) < 0)
+    return -1;
+  PDATA(pgm)->nqueued++;
+
+  return jtag3_queue_collect(pgm, JTAG3_QUEUE_MAX - 1);
+}
+
+/*
+ * Called when avr_read() or avr_write() is done with m: wait for all
+ * outstanding answers, and report a write that failed meanwhile.
+ */
+static int jtag3_paged_flush(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m)
+{
+  int rv;
+
+  rv = jtag3_queue_collect(pgm, 0);
+  PDATA(pgm)->rd_mem = NULL;
+  if (PDATA(pgm)->queue_error) {
+    PDATA(pgm)->queue_error = 0;
+    rv = -1;
+  }
+
+  return rv;
+}
+
+/*
+ * Bytes to ask for in one read at addr: as many read units as fit
+ * into a single USB transfer (the answer adds 4 bytes, and must end
+ * in a short packet), unless the ICE refused that before, or the
+ * block would span both Xmega application and boot flash.
+ */
+static unsigned int jtag3_read_block(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
+				     unsigned long addr, int dynamic_memtype)
+{
+  unsigned int n = m->readsize;
+
+  if (!PDATA(pgm)->rd_single && n > 0 && pgm->fd.usb.max_xfer > n + 4)
+    n *= (pgm->fd.usb.max_xfer - 5) / n;
+  if ((m->size - addr) < n)
+    n = m->size - addr;
+  if (dynamic_memtype && n > m->readsize &&
+      jtag3_memtype(pgm, p, addr) != jtag3_memtype(pgm, p, addr + n - 1))
+    n = m->readsize;
+
+  return n;
+}
+
+/*
+ * The Xmega memory type that has the ICE erase each page before
+ * writing it, or 0 if there is none for memtype.
+ */
+static unsigned char jtag3_erase_memtype(unsigned char memtype)
+{
+  switch (memtype) {
+  case MTYPE_FLASH:
+    return MTYPE_FLASH_ATOMIC;
+  case MTYPE_BOOT_FLASH:
+    return MTYPE_BOOT_FLASH_ATOMIC;
+  case MTYPE_EEPROM:
+  case MTYPE_EEPROM_XMEGA:
+    /* the JTAGICE3 erases EEPROM pages written this way */
+    return MTYPE_EEPROM_XMEGA;
+  default:
+    return 0;
+  }
+}
+
+/*
+ * Write pages; if erase is set, each page is erased first, within the
+ * write command itself where the memory type allows it.
+ */
+static int jtag3_write_pages(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
+                             unsigned int page_size,
+                             unsigned int addr, unsigned int n_bytes,
+                             int erase)
 {
   unsigned int block_size;
   unsigned int maxaddr = addr + n_bytes;
-  unsigned char *cmd;
-  unsigned char *resp;
+  unsigned char *cmd, memtype;
   int status, dynamic_memtype = 0;
   long otimeout = serial_recv_timeout;
 
@@ -1247,7 +1457,7 @@ static int jtag3_paged_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
   cmd[2] = 0;
   if (strcmp(m->desc, "flash") == 0) {
     PDATA(pgm)->flash_pageaddr = (unsigned long)-1L;
-    cmd[3] = jtag3_memtype(pgm, p, addr);
+    memtype = jtag3_memtype(pgm, p, addr);
     if (p->flags & AVRPART_HAS_PDI)
       /* dynamically decide between flash/boot memtype */
       dynamic_memtype = 1;
@@ -1267,18 +1477,20 @@ static int jtag3_paged_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
       free(cmd);
       return n_bytes;
     }
-    cmd[3] = ( p->flags & AVRPART_HAS_PDI ) ? MTYPE_EEPROM_XMEGA : MTYPE_EEPROM_PAGE;
+    memtype = ( p->flags & AVRPART_HAS_PDI ) ? MTYPE_EEPROM_XMEGA : MTYPE_EEPROM_PAGE;
     PDATA(pgm)->eeprom_pageaddr = (unsigned long)-1L;
   } else if ( ( strcmp(m->desc, "usersig") == 0 ) ) {
-    cmd[3] = MTYPE_USERSIG;
+    memtype = MTYPE_USERSIG;
   } else if ( ( strcmp(m->desc, "boot") == 0 ) ) {
-    cmd[3] = MTYPE_BOOT_FLASH;
+    memtype = MTYPE_BOOT_FLASH;
   } else if ( p->flags & AVRPART_HAS_PDI ) {
-    cmd[3] = MTYPE_FLASH;
+    memtype = MTYPE_FLASH;
   } else {
-    cmd[3] = MTYPE_SPM;
+    memtype = MTYPE_SPM;
   }
   serial_recv_timeout = 100;
+  /* Pages queued ahead of this call are answered in the loop below. */
+  PDATA(pgm)->rd_mem = NULL;
   for (; addr < maxaddr; addr += page_size) {
     if ((maxaddr - addr) < page_size)
       block_size = maxaddr - addr;
@@ -1290,7 +1502,22 @@ static int jtag3_paged_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
 	      progname, addr, block_size);
 
     if (dynamic_memtype)
-      cmd[3] = jtag3_memtype(pgm, p, addr);
+      memtype = jtag3_memtype(pgm, p, addr);
+    cmd[3] = memtype;
+
+    /*
+     * Pages larger than a write command go out in pieces; only the
+     * first one may erase.
+     */
+    if (erase && (m->page_size == 0 || addr % m->page_size == 0)) {
+      if ((p->flags & AVRPART_HAS_PDI) &&
+          jtag3_erase_memtype(memtype) != 0)
+        cmd[3] = jtag3_erase_memtype(memtype);
+      else if (jtag3_page_erase(pgm, p, m, addr) < 0) {
+        PDATA(pgm)->queue_error = 1;
+        break;
+      }
+    }
 
     u32_to_b4(cmd + 8, page_size);
     u32_to_b4(cmd + 4, jtag3_memaddr(pgm, p, m, addr));
@@ -1306,22 +1533,37 @@ static int jtag3_paged_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
     memset(cmd + 13, 0xff, page_size);
     memcpy(cmd + 13, m->buf + addr, block_size);
 
-    if ((status = jtag3_command(pgm, cmd, page_size + 13,
-				&resp, "write memory")) < 0) {
-      free(cmd);
-      serial_recv_timeout = otimeout;
-      return -1;
+    if (jtag3_queue_send(pgm, cmd, page_size + 13, addr, block_size) < 0) {
+      PDATA(pgm)->queue_error = 1;
+      break;
     }
-
-    free(resp);
   }
 
   free(cmd);
   serial_recv_timeout = otimeout;
 
+  if (PDATA(pgm)->queue_error) {
+    PDATA(pgm)->queue_error = 0;
+    return -1;
+  }
+
   return n_bytes;
 }
 
+static int jtag3_paged_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
+                                unsigned int page_size,
+                                unsigned int addr, unsigned int n_bytes)
+{
+  return jtag3_write_pages(pgm, p, m, page_size, addr, n_bytes, 0);
+}
+
+static int jtag3_paged_erase_write(PROGRAMMER * pgm, AVRPART * p,
+                                   AVRMEM * m, unsigned int page_size,
+                                   unsigned int addr, unsigned int n_bytes)
+{
+  return jtag3_write_pages(pgm, p, m, page_size, addr, n_bytes, 1);
+}
+
 static int jtag3_paged_load(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
                                unsigned int page_size,
                                unsigned int addr, unsigned int n_bytes)
@@ -1329,8 +1571,7 @@ static int jtag3_paged_load(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
   unsigned int block_size;
   unsigned int maxaddr = addr + n_bytes;
   unsigned char cmd[12];
-  unsigned char *resp;
-  int status, dynamic_memtype = 0;
+  int single, dynamic_memtype = 0;
   long otimeout = serial_recv_timeout;
 
   if (verbose >= 2)
@@ -1367,35 +1608,58 @@ static int jtag3_paged_load(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
     cmd[3] = MTYPE_SPM;
   }
   serial_recv_timeout = 100;
-  for (; addr < maxaddr; addr += page_size) {
-    if ((maxaddr - addr) < page_size)
-      block_size = maxaddr - addr;
-    else
-      block_size = page_size;
-    if (verbose >= 3)
-      fprintf(stderr, "%s: jtag3_paged_load(): "
-	      "block_size at addr %d is %d\n",
-	      progname, addr, block_size);
 
-    if (dynamic_memtype)
-      cmd[3] = jtag3_memtype(pgm, p, addr);
+  /*
+   * Reads are queued ahead of what has been asked for, in the hope
+   * that the next call continues here.  Start over if it doesn't.
+   */
+  single = PDATA(pgm)->rd_single;
+ restart:
+  if (PDATA(pgm)->rd_mem != m ||
+      addr < PDATA(pgm)->rd_lo || addr > PDATA(pgm)->rd_next) {
+    PDATA(pgm)->rd_mem = NULL;
+    jtag3_queue_collect(pgm, 0);
+    PDATA(pgm)->rd_mem = m;
+    PDATA(pgm)->rd_lo = PDATA(pgm)->rd_hi = PDATA(pgm)->rd_next = addr;
+  }
 
-    u32_to_b4(cmd + 8, block_size);
-    u32_to_b4(cmd + 4, jtag3_memaddr(pgm, p, m, addr));
+  while (PDATA(pgm)->rd_mem == m && PDATA(pgm)->rd_hi < maxaddr) {
+    if (PDATA(pgm)->rd_next < m->size) {
+      block_size = jtag3_read_block(pgm, p, m, PDATA(pgm)->rd_next,
+				    dynamic_memtype);
+      if (verbose >= 3)
+	fprintf(stderr, "%s: jtag3_paged_load(): "
+		"block_size at addr %lu is %d\n",
+		progname, PDATA(pgm)->rd_next, block_size);
 
-    if ((status = jtag3_command(pgm, cmd, 12, &resp, "read memory")) < 0)
-      return -1;
+      if (dynamic_memtype)
+	cmd[3] = jtag3_memtype(pgm, p, PDATA(pgm)->rd_next);
 
-    if (resp[1] != RSP3_DATA ||
-	status < block_size + 4) {
-      fprintf(stderr, "%s: wrong/short reply to read memory command\n",
-	      progname);
-      serial_recv_timeout = otimeout;
-      free(resp);
-      return -1;
+      u32_to_b4(cmd + 8, block_size);
+      u32_to_b4(cmd + 4, jtag3_memaddr(pgm, p, m, PDATA(pgm)->rd_next));
+
+      PDATA(pgm)->rd_next += block_size;
+      if (jtag3_queue_send(pgm, cmd, 12, PDATA(pgm)->rd_next - block_size,
+			   block_size) < 0)
+	break;
+    } else if (PDATA(pgm)->nqueued == 0 ||
+	       jtag3_queue_collect(pgm, PDATA(pgm)->nqueued - 1) < 0) {
+      break;
     }
-    memcpy(m->buf + addr, resp + 3, status - 4);
-    free(resp);
+  }
+
+  if (PDATA(pgm)->rd_mem != m || PDATA(pgm)->rd_hi < maxaddr) {
+    PDATA(pgm)->rd_mem = NULL;
+    if (!single && PDATA(pgm)->rd_single) {
+      if (verbose)
+	fprintf(stderr, "%s: jtag3_paged_load(): "
+		"falling back to reads of %d bytes\n",
+		progname, m->readsize);
+      single = 1;
+      goto restart;
+    }
+    serial_recv_timeout = otimeout;
+    return -1;
   }
   serial_recv_timeout = otimeout;
 
@@ -1468,6 +1732,9 @@ static int jtag3_read_byte(PROGRAMMER * pgm, AVRPART * p, AVRMEM * mem,
     cmd[3] = MTYPE_USERSIG;
   } else if (strcmp(mem->desc, "prodsig") == 0) {
     cmd[3] = MTYPE_PRODSIG;
+  } else if (strcmp(mem->desc, "data") == 0) {
+    cmd[3] = MTYPE_SRAM;
+    addr += mem->offset;
   } else if (strcmp(mem->desc, "calibration") == 0) {
     cmd[3] = MTYPE_OSCCAL_BYTE;
     if (pgm->flag & PGM_FL_IS_DW)
@@ -1611,6 +1878,9 @@ static int jtag3_write_byte(PROGRAMMER * pgm, AVRPART * p, AVRMEM * mem,
     cmd[3] = MTYPE_USERSIG;
   } else if (strcmp(mem->desc, "prodsig") == 0) {
     cmd[3] = MTYPE_PRODSIG;
+  } else if (strcmp(mem->desc, "data") == 0) {
+    cmd[3] = MTYPE_SRAM;
+    addr += mem->offset;
   } else if (strcmp(mem->desc, "lock") == 0) {
     cmd[3] = MTYPE_LOCK_BITS;
     if (pgm->flag & PGM_FL_IS_DW)
@@ -1640,6 +1910,8 @@ static int jtag3_write_byte(PROGRAMMER * pgm, AVRPART * p, AVRMEM * mem,
      * cache to mem->buf */
     cache_ptr[addr & (pagesize - 1)] = data;
     addr &= ~(pagesize - 1);	/* page base address */
+    if (avr_mem_unshare(mem) < 0)
+      return -1;
     memcpy(mem->buf + addr, cache_ptr, pagesize);
     /* step #3: write back */
     i = jtag3_paged_write(pgm, p, mem, pagesize, addr, pagesize);
@@ -1919,7 +2191,10 @@ void jtag3_initpgm(PROGRAMMER * pgm)
    */
   pgm->paged_write    = jtag3_paged_write;
   pgm->paged_load     = jtag3_paged_load;
+  pgm->paged_flush    = jtag3_paged_flush;
   pgm->page_erase     = jtag3_page_erase;
+  pgm->mem_crc        = avr_xmega_nvm_crc;
+  pgm->paged_erase_write = jtag3_paged_erase_write;
   pgm->print_parms    = jtag3_print_parms;
   pgm->set_sck_period = jtag3_set_sck_period;
   pgm->parseextparams = jtag3_parseextparms;
@@ -1954,6 +2229,7 @@ void jtag3_dw_initpgm(PROGRAMMER * pgm)
    */
   pgm->paged_write    = jtag3_paged_write;
   pgm->paged_load     = jtag3_paged_load;
+  pgm->paged_flush    = jtag3_paged_flush;
   pgm->print_parms    = jtag3_print_parms;
   pgm->setup          = jtag3_setup;
   pgm->teardown       = jtag3_teardown;
@@ -1986,7 +2262,10 @@ void jtag3_pdi_initpgm(PROGRAMMER * pgm)
    */
   pgm->paged_write    = jtag3_paged_write;
   pgm->paged_load     = jtag3_paged_load;
+  pgm->paged_flush    = jtag3_paged_flush;
   pgm->page_erase     = jtag3_page_erase;
+  pgm->mem_crc        = avr_xmega_nvm_crc;
+  pgm->paged_erase_write = jtag3_paged_erase_write;
   pgm->print_parms    = jtag3_print_parms;
   pgm->set_sck_period = jtag3_set_sck_period;
   pgm->setup          = jtag3_setup;
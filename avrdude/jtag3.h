@@ -26,6 +26,8 @@ extern "C" {
 #endif
 
 int  jtag3_send(PROGRAMMER * pgm, unsigned char * data, size_t len);
+int  jtag3_sendv(PROGRAMMER * pgm, const unsigned char * prefix, size_t plen,
+		 const unsigned char * data, size_t len);
 int  jtag3_recv(PROGRAMMER * pgm, unsigned char **msg);
 void jtag3_close(PROGRAMMER * pgm);
 int  jtag3_getsync(PROGRAMMER * pgm, int mode);
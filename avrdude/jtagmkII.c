@@ -54,6 +54,13 @@
 /*
  * Private data for this programmer.
  */
+/*
+ * Paged reads and writes over USB keep up to this many commands
+ * outstanding.  The ICE takes the next command off the bulk pipe once
+ * it is done with the previous one, and answers in order.
+ */
+#define JTAGMKII_QUEUE_MAX 4
+
 struct pdata
 {
   unsigned short command_sequence; /* Next cmd seqno to issue. */
@@ -84,6 +91,28 @@ struct pdata
 
   /* Major firmware version (needed for Xmega programming) */
   unsigned int fwver;
+
+  /* Frame buffer for jtagmkII_sendv(), kept for the session */
+  unsigned char *txbuf;
+  size_t txbuf_size;
+  size_t txlen;			/* length of the last frame sent */
+
+  /*
+   * Paged accesses sent without waiting for their answers, oldest
+   * first; see jtagmkII_queue_send().
+   */
+  struct {
+    unsigned char cmd;		/* CMND_WRITE_MEMORY or CMND_READ_MEMORY */
+    unsigned long addr;		/* offset into the memory buffer */
+    unsigned int len;
+  } queue[JTAGMKII_QUEUE_MAX];
+  int nqueued;
+  int queue_error;		/* a queued write was answered badly */
+
+  /* Read-ahead of jtagmkII_paged_load() */
+  AVRMEM *rd_mem;		/* memory being read, NULL if none */
+  unsigned long rd_lo, rd_hi;	/* part of rd_mem->buf filled so far */
+  unsigned long rd_next;	/* next address to ask for */
 };
 
 #define PDATA(pgm) ((struct pdata *)(pgm->cookie))
@@ -174,6 +203,8 @@ static int jtagmkII_paged_load32(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
                                  unsigned int page_size,
                                  unsigned int addr, unsigned int n_bytes);
 
+static int jtagmkII_queue_collect(PROGRAMMER * pgm, int keep);
+
 void jtagmkII_setup(PROGRAMMER * pgm)
 {
   if ((pgm->cookie = malloc(sizeof(struct pdata))) == 0) {
@@ -187,6 +218,7 @@ void jtagmkII_setup(PROGRAMMER * pgm)
 
 void jtagmkII_teardown(PROGRAMMER * pgm)
 {
+  free(PDATA(pgm)->txbuf);
   free(pgm->cookie);
 }
 
@@ -422,42 +454,72 @@ static void jtagmkII_prmsg(PROGRAMMER * pgm, unsigned char * data, size_t len)
 }
 
 
-int jtagmkII_send(PROGRAMMER * pgm, unsigned char * data, size_t len)
+/*
+ * Send prefix followed by data as one message.  The frame is
+ * assembled in a buffer that lives as long as the session, so
+ * callers adding a header of their own don't need to copy either.
+ * Queued paged accesses are left alone; the message gets the
+ * sequence number after theirs.
+ */
+int jtagmkII_sendv(PROGRAMMER * pgm, const unsigned char * prefix, size_t plen,
+		   const unsigned char * data, size_t len)
 {
   unsigned char *buf;
+  size_t n = plen + len;
 
   if (verbose >= 3)
     fprintf(stderr, "\n%s: jtagmkII_send(): sending %lu bytes\n",
-	    progname, (unsigned long)len);
+	    progname, (unsigned long)n);
 
-  if ((buf = malloc(len + 10)) == NULL)
-    {
-      fprintf(stderr, "%s: jtagmkII_send(): out of memory",
-	      progname);
-      return -1;
-    }
+  if (n + 10 > PDATA(pgm)->txbuf_size) {
+    if ((buf = realloc(PDATA(pgm)->txbuf, n + 10)) == NULL)
+      {
+	fprintf(stderr, "%s: jtagmkII_send(): out of memory",
+		progname);
+	return -1;
+      }
+    PDATA(pgm)->txbuf = buf;
+    PDATA(pgm)->txbuf_size = n + 10;
+  }
+  buf = PDATA(pgm)->txbuf;
 
   buf[0] = MESSAGE_START;
-  u16_to_b2(buf + 1, PDATA(pgm)->command_sequence);
-  u32_to_b4(buf + 3, len);
+  u16_to_b2(buf + 1, (PDATA(pgm)->command_sequence + PDATA(pgm)->nqueued) %
+	    0xffff);
+  u32_to_b4(buf + 3, n);
   buf[7] = TOKEN;
-  memcpy(buf + 8, data, len);
+  if (plen > 0)
+    memcpy(buf + 8, prefix, plen);
+  memcpy(buf + 8 + plen, data, len);
 
-  crcappend(buf, len + 8);
+  crcappend(buf, n + 8);
+  PDATA(pgm)->txlen = n + 10;
 
-  if (serial_send(&pgm->fd, buf, len + 10) != 0) {
+  if (serial_send(&pgm->fd, buf, n + 10) != 0) {
     fprintf(stderr,
 	    "%s: jtagmkII_send(): failed to send command to serial port\n",
 	    progname);
     exit(1);
   }
 
-  free(buf);
-
   return 0;
 }
 
 
+int jtagmkII_send(PROGRAMMER * pgm, unsigned char * data, size_t len)
+{
+  /*
+   * Anything but the paged access pipeline itself wants its answer
+   * next, and may change what has been read ahead.  The memory read
+   * ahead may be gone by now, so outstanding reads are dropped.
+   */
+  PDATA(pgm)->rd_mem = NULL;
+  jtagmkII_queue_collect(pgm, 0);
+
+  return jtagmkII_sendv(pgm, NULL, 0, data, len);
+}
+
+
 static int jtagmkII_drain(PROGRAMMER * pgm, int display)
 {
   return serial_drain(&pgm->fd, display);
@@ -474,24 +536,8 @@ static int jtagmkII_drain(PROGRAMMER * pgm, int display)
  */
 static int jtagmkII_recv_frame(PROGRAMMER * pgm, unsigned char **msg,
 			       unsigned short * seqno) {
-  enum states { sSTART,
-		/* NB: do NOT change the sequence of the following: */
-		sSEQNUM1, sSEQNUM2,
-		sSIZE1, sSIZE2, sSIZE3, sSIZE4,
-		sTOKEN,
-		sDATA,
-		sCSUM1, sCSUM2,
-		/* end NB */
-		sDONE
-  }  state = sSTART;
-  unsigned long msglen = 0, l = 0;
-  int headeridx = 0;
-  int timeout = 0;
-  int ignorpkt = 0;
-  int rv;
-  unsigned char c, *buf = NULL, header[8];
-  unsigned short r_seqno = 0;
-  unsigned short checksum = 0;
+  unsigned long msglen;
+  unsigned char *buf, header[8];
 
   struct timeval tv;
   double timeoutval = 100;	/* seconds */
@@ -503,122 +549,67 @@ static int jtagmkII_recv_frame(PROGRAMMER * pgm, unsigned char **msg,
   gettimeofday(&tv, NULL);
   tstart = tv.tv_sec;
 
-  while ( (state != sDONE ) && (!timeout) ) {
-    if (state == sDATA) {
-      rv = 0;
-      if (ignorpkt) {
-	/* skip packet's contents */
-	for(l = 0; l < msglen; l++)
-	  rv += serial_recv(&pgm->fd, &c, 1);
-      } else {
-	rv += serial_recv(&pgm->fd, buf + 8, msglen);
-      }
-      if (rv != 0) {
-	timedout:
-	/* timeout in receive */
-	if (verbose > 1)
-	  fprintf(stderr,
-		  "%s: jtagmkII_recv(): Timeout receiving packet\n",
-		  progname);
-	free(buf);
-	return -1;
-      }
-    } else {
-      if (serial_recv(&pgm->fd, &c, 1) != 0)
+  /*
+   * Hunt for MESSAGE_START, then take the rest of the header, and
+   * later payload and CRC, in one read each.
+   */
+  for (;;) {
+    if (serial_recv(&pgm->fd, header, 1) != 0)
+      goto timedout;
+    if (header[0] == MESSAGE_START) {
+      if (serial_recv(&pgm->fd, header + 1, 7) != 0)
 	goto timedout;
+      msglen = b4_to_u32(header + 3);
+      if (header[7] == TOKEN) {
+	if (msglen <= MAX_MESSAGE)
+	  break;
+	fprintf(stderr,
+		"%s: jtagmkII_recv(): msglen %lu exceeds max message "
+		"size %u, ignoring message\n",
+		progname, msglen, MAX_MESSAGE);
+      }
     }
-    checksum ^= c;
 
-    if (state < sDATA)
-      header[headeridx++] = c;
+    gettimeofday(&tv, NULL);
+    tnow = tv.tv_sec;
+    if (tnow - tstart > timeoutval) {
+      fprintf(stderr, "%s: jtagmkII_recv_frame(): timeout\n",
+	      progname);
+      return -1;
+    }
+  }
 
-    switch (state) {
-      case sSTART:
-        if (c == MESSAGE_START) {
-          state = sSEQNUM1;
-        } else {
-	  headeridx = 0;
-	}
-        break;
-      case sSEQNUM1:
-      case sSEQNUM2:
-	r_seqno >>= 8;
-	r_seqno |= ((unsigned)c << 8);
-	state++;
-	break;
-      case sSIZE1:
-      case sSIZE2:
-      case sSIZE3:
-      case sSIZE4:
-	msglen >>= 8;
-	msglen |= ((unsigned)c << 24);
-        state++;
-        break;
-      case sTOKEN:
-        if (c == TOKEN) {
-	  state = sDATA;
-	  if (msglen > MAX_MESSAGE) {
-	    fprintf(stderr,
-		    "%s: jtagmkII_recv(): msglen %lu exceeds max message "
-		    "size %u, ignoring message\n",
-		    progname, msglen, MAX_MESSAGE);
-	    state = sSTART;
-	    headeridx = 0;
-	  } else if ((buf = malloc(msglen + 10)) == NULL) {
-	    fprintf(stderr, "%s: jtagmkII_recv(): out of memory\n",
-		    progname);
-	    ignorpkt++;
-	  } else {
-	    memcpy(buf, header, 8);
-	  }
-	} else {
-	  state = sSTART;
-	  headeridx = 0;
-	}
-        break;
-      case sDATA:
-	/* The entire payload has been read above. */
-	l = msglen + 8;
-        state = sCSUM1;
-        break;
-      case sCSUM1:
-      case sCSUM2:
-	buf[l++] = c;
-	if (state == sCSUM2) {
-	  if (crcverify(buf, msglen + 10)) {
-	    if (verbose >= 9)
-	      fprintf(stderr, "%s: jtagmkII_recv(): CRC OK",
-		      progname);
-	    state = sDONE;
-	  } else {
-	    fprintf(stderr, "%s: jtagmkII_recv(): checksum error\n",
-		    progname);
-	    free(buf);
-	    return -4;
-	  }
-	} else
-	  state++;
-        break;
-      default:
-        fprintf(stderr, "%s: jtagmkII_recv(): unknown state\n",
-                progname);
-	free(buf);
-        return -5;
-     }
+  if ((buf = malloc(msglen + 10)) == NULL) {
+    fprintf(stderr, "%s: jtagmkII_recv(): out of memory\n",
+	    progname);
+    return -1;
+  }
+  memcpy(buf, header, 8);
 
-     gettimeofday(&tv, NULL);
-     tnow = tv.tv_sec;
-     if (tnow - tstart > timeoutval) {
-       fprintf(stderr, "%s: jtagmkII_recv_frame(): timeout\n",
-               progname);
-       return -1;
-     }
+  if (serial_recv(&pgm->fd, buf + 8, msglen + 2) != 0) {
+    free(buf);
+  timedout:
+    /* timeout in receive */
+    if (verbose > 1)
+      fprintf(stderr,
+	      "%s: jtagmkII_recv(): Timeout receiving packet\n",
+	      progname);
+    return -1;
+  }
 
+  if (!crcverify(buf, msglen + 10)) {
+    fprintf(stderr, "%s: jtagmkII_recv(): checksum error\n",
+	    progname);
+    free(buf);
+    return -4;
   }
+  if (verbose >= 9)
+    fprintf(stderr, "%s: jtagmkII_recv(): CRC OK",
+	    progname);
   if (verbose >= 3)
     fprintf(stderr, "\n");
 
-  *seqno = r_seqno;
+  *seqno = b2_to_u16(header + 1);
   *msg = buf;
 
   return msglen;
@@ -2025,15 +2016,171 @@ static int jtagmkII_page_erase(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
   return 0;
 }
 
-static int jtagmkII_paged_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
+/*
+ * Number of paged access commands that may be outstanding at once.
+ * On a serial line, the ICE could miss a command arriving while it is
+ * still busy with the previous one.
+ */
+static int jtagmkII_queue_window(PROGRAMMER * pgm)
+{
+#if defined(HAVE_LIBUSB)
+  if (serdev == &usb_serdev)
+    return JTAGMKII_QUEUE_MAX;
+#endif
+  return 1;
+}
+
+/*
+ * Take in answers to queued commands until no more than keep are
+ * outstanding.  Read data goes straight into the buffer of the memory
+ * being read ahead, or is dropped if there is none.  A failed write is also remembered in queue_error
+ * for the next jtagmkII_paged_write() or jtagmkII_paged_flush().
+ */
+static int jtagmkII_queue_collect(PROGRAMMER * pgm, int keep)
+{
+  unsigned char *resp;
+  int status, tries, rv = 0;
+  long otimeout = serial_recv_timeout;
+
+  while (PDATA(pgm)->nqueued > keep) {
+    tries = 0;
+    while ((status = jtagmkII_recv(pgm, &resp)) <= 0) {
+      if (verbose >= 1)
+	fprintf(stderr,
+		"%s: jtagmkII_queue_collect(): "
+		"timeout/error communicating with programmer (status %d)\n",
+		progname, status);
+      if (tries++ >= 4) {
+	fprintf(stderr,
+		"%s: jtagmkII_queue_collect(): fatal timeout/"
+		"error communicating with programmer (status %d)\n",
+		progname, status);
+	PDATA(pgm)->nqueued = 0;
+	PDATA(pgm)->queue_error = 1;
+	PDATA(pgm)->rd_mem = NULL;
+	serial_recv_timeout = otimeout;
+	return -1;
+      }
+      /* The last frame sent is still in txbuf if it is the only one. */
+      if (PDATA(pgm)->nqueued == 1)
+	serial_send(&pgm->fd, PDATA(pgm)->txbuf, PDATA(pgm)->txlen);
+      serial_recv_timeout *= 2;
+    }
+    if (verbose >= 3) {
+      putc('\n', stderr);
+      jtagmkII_prmsg(pgm, resp, status);
+    } else if (verbose == 2)
+      fprintf(stderr, "0x%02x (%d bytes msg)\n", resp[0], status);
+
+    if (PDATA(pgm)->queue[0].cmd == CMND_WRITE_MEMORY) {
+      if (resp[0] != RSP_OK) {
+	fprintf(stderr,
+		"%s: jtagmkII_paged_write(): "
+		"bad response to write memory command: %s\n",
+		progname, jtagmkII_get_rc(resp[0]));
+	PDATA(pgm)->queue_error = 1;
+	rv = -1;
+      }
+    } else if (PDATA(pgm)->rd_mem == NULL) {
+      /* read ahead for a memory that is done with */
+    } else if (resp[0] != RSP_MEMORY ||
+	       status - 1 < PDATA(pgm)->queue[0].len) {
+      fprintf(stderr,
+	      "%s: jtagmkII_paged_load(): "
+	      "bad response to read memory command: %s\n",
+	      progname, jtagmkII_get_rc(resp[0]));
+      PDATA(pgm)->rd_mem = NULL;
+      rv = -1;
+    } else {
+      memcpy(PDATA(pgm)->rd_mem->buf + PDATA(pgm)->queue[0].addr, resp + 1,
+	     PDATA(pgm)->queue[0].len);
+      PDATA(pgm)->rd_hi = PDATA(pgm)->queue[0].addr + PDATA(pgm)->queue[0].len;
+    }
+    free(resp);
+
+    PDATA(pgm)->nqueued--;
+    memmove(PDATA(pgm)->queue, PDATA(pgm)->queue + 1,
+	    PDATA(pgm)->nqueued * sizeof(PDATA(pgm)->queue[0]));
+  }
+  serial_recv_timeout = otimeout;
+
+  return rv;
+}
+
+/*
+ * Send a paged access command for len bytes at addr of the memory
+ * buffer without waiting for its answer, then take in answers until
+ * there is room for the next command.
+ */
+static int jtagmkII_queue_send(PROGRAMMER * pgm, unsigned char * cmd,
+			       size_t cmdlen, unsigned long addr,
+			       unsigned int len)
+{
+  int n = PDATA(pgm)->nqueued;
+
+  if (verbose >= 2)
+    fprintf(stderr, "%s: jtagmkII_queue_send(): "
+	    "Sending %s memory command: ",
+	    progname, cmd[0] == CMND_WRITE_MEMORY? "write": "read");
+
+  PDATA(pgm)->queue[n].cmd = cmd[0];
+  PDATA(pgm)->queue[n].addr = addr;
+  PDATA(pgm)->queue[n].len = len;
+  if (jtagmkII_sendv(pgm, NULL, 0, cmd, cmdlen) < 0)
+    return -1;
+  PDATA(pgm)->nqueued++;
+
+  return jtagmkII_queue_collect(pgm, jtagmkII_queue_window(pgm) - 1);
+}
+
+/*
+ * Called when avr_read() or avr_write() is done with m: wait for all
+ * outstanding answers, and report a write that failed meanwhile.
+ */
+static int jtagmkII_paged_flush(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m)
+{
+  int rv;
+
+  rv = jtagmkII_queue_collect(pgm, 0);
+  PDATA(pgm)->rd_mem = NULL;
+  if (PDATA(pgm)->queue_error) {
+    PDATA(pgm)->queue_error = 0;
+    rv = -1;
+  }
+
+  return rv;
+}
+
+/*
+ * The Xmega memory type that has the ICE erase each page before
+ * writing it, or 0 if there is none for memtype.  EEPROM pages keep
+ * MTYPE_EEPROM and get a separate page erase.
+ */
+static unsigned char jtagmkII_erase_memtype(unsigned char memtype)
+{
+  switch (memtype) {
+  case MTYPE_FLASH:
+    return MTYPE_FLASH_ATOMIC;
+  case MTYPE_BOOT_FLASH:
+    return MTYPE_BOOT_FLASH_ATOMIC;
+  default:
+    return 0;
+  }
+}
+
+/*
+ * Write pages; if erase is set, each page is erased first, within the
+ * write command itself where the memory type allows it.
+ */
+static int jtagmkII_write_pages(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
                                 unsigned int page_size,
-                                unsigned int addr, unsigned int n_bytes)
+                                unsigned int addr, unsigned int n_bytes,
+                                int erase)
 {
   unsigned int block_size;
   unsigned int maxaddr = addr + n_bytes;
-  unsigned char *cmd;
-  unsigned char *resp;
-  int status, tries, dynamic_memtype = 0;
+  unsigned char *cmd, memtype;
+  int status, dynamic_memtype = 0;
   long otimeout = serial_recv_timeout;
 
   if (verbose >= 2)
@@ -2055,7 +2202,7 @@ static int jtagmkII_paged_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
   cmd[0] = CMND_WRITE_MEMORY;
   if (strcmp(m->desc, "flash") == 0) {
     PDATA(pgm)->flash_pageaddr = (unsigned long)-1L;
-    cmd[1] = jtagmkII_memtype(pgm, p, addr);
+    memtype = jtagmkII_memtype(pgm, p, addr);
     if (p->flags & AVRPART_HAS_PDI)
       /* dynamically decide between flash/boot memtype */
       dynamic_memtype = 1;
@@ -2075,18 +2222,20 @@ static int jtagmkII_paged_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
       free(cmd);
       return n_bytes;
     }
-    cmd[1] = ( p->flags & AVRPART_HAS_PDI ) ? MTYPE_EEPROM : MTYPE_EEPROM_PAGE;
+    memtype = ( p->flags & AVRPART_HAS_PDI ) ? MTYPE_EEPROM : MTYPE_EEPROM_PAGE;
     PDATA(pgm)->eeprom_pageaddr = (unsigned long)-1L;
   } else if ( ( strcmp(m->desc, "usersig") == 0 ) ) {
-    cmd[1] = MTYPE_USERSIG;
+    memtype = MTYPE_USERSIG;
   } else if ( ( strcmp(m->desc, "boot") == 0 ) ) {
-    cmd[1] = MTYPE_BOOT_FLASH;
+    memtype = MTYPE_BOOT_FLASH;
   } else if ( p->flags & AVRPART_HAS_PDI ) {
-    cmd[1] = MTYPE_FLASH;
+    memtype = MTYPE_FLASH;
   } else {
-    cmd[1] = MTYPE_SPM;
+    memtype = MTYPE_SPM;
   }
   serial_recv_timeout = 100;
+  /* Pages queued ahead of this call are answered in the loop below. */
+  PDATA(pgm)->rd_mem = NULL;
   for (; addr < maxaddr; addr += page_size) {
     if ((maxaddr - addr) < page_size)
       block_size = maxaddr - addr;
@@ -2098,7 +2247,22 @@ static int jtagmkII_paged_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
 	      progname, addr, block_size);
 
     if (dynamic_memtype)
-      cmd[1] = jtagmkII_memtype(pgm, p, addr);
+      memtype = jtagmkII_memtype(pgm, p, addr);
+    cmd[1] = memtype;
+
+    /*
+     * Pages larger than a write command go out in pieces; only the
+     * first one may erase.
+     */
+    if (erase && (m->page_size == 0 || addr % m->page_size == 0)) {
+      if ((p->flags & AVRPART_HAS_PDI) &&
+          jtagmkII_erase_memtype(memtype) != 0)
+        cmd[1] = jtagmkII_erase_memtype(memtype);
+      else if (jtagmkII_page_erase(pgm, p, m, addr) < 0) {
+        PDATA(pgm)->queue_error = 1;
+        break;
+      }
+    }
 
     u32_to_b4(cmd + 2, page_size);
     u32_to_b4(cmd + 6, jtagmkII_memaddr(pgm, p, m, addr));
@@ -2113,60 +2277,37 @@ static int jtagmkII_paged_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
     memset(cmd + 10, 0xff, page_size);
     memcpy(cmd + 10, m->buf + addr, block_size);
 
-    tries = 0;
-
-    retry:
-    if (verbose >= 2)
-      fprintf(stderr, "%s: jtagmkII_paged_write(): "
-	      "Sending write memory command: ",
-	      progname);
-    jtagmkII_send(pgm, cmd, page_size + 10);
-
-    status = jtagmkII_recv(pgm, &resp);
-    if (status <= 0) {
-      if (verbose >= 2)
-	putc('\n', stderr);
-      if (verbose >= 1)
-	fprintf(stderr,
-		"%s: jtagmkII_paged_write(): "
-		"timeout/error communicating with programmer (status %d)\n",
-		progname, status);
-      if (tries++ < 4) {
-	serial_recv_timeout *= 2;
-	goto retry;
-      }
-      fprintf(stderr,
-	      "%s: jtagmkII_paged_write(): fatal timeout/"
-	      "error communicating with programmer (status %d)\n",
-	      progname, status);
-      free(cmd);
-      serial_recv_timeout = otimeout;
-      return -1;
-    }
-    if (verbose >= 3) {
-      putc('\n', stderr);
-      jtagmkII_prmsg(pgm, resp, status);
-    } else if (verbose == 2)
-      fprintf(stderr, "0x%02x (%d bytes msg)\n", resp[0], status);
-    if (resp[0] != RSP_OK) {
-      fprintf(stderr,
-	      "%s: jtagmkII_paged_write(): "
-	      "bad response to write memory command: %s\n",
-	      progname, jtagmkII_get_rc(resp[0]));
-      free(resp);
-      free(cmd);
-      serial_recv_timeout = otimeout;
-      return -1;
+    if (jtagmkII_queue_send(pgm, cmd, page_size + 10, addr, block_size) < 0) {
+      PDATA(pgm)->queue_error = 1;
+      break;
     }
-    free(resp);
   }
 
   free(cmd);
   serial_recv_timeout = otimeout;
 
+  if (PDATA(pgm)->queue_error) {
+    PDATA(pgm)->queue_error = 0;
+    return -1;
+  }
+
   return n_bytes;
 }
 
+static int jtagmkII_paged_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
+                                unsigned int page_size,
+                                unsigned int addr, unsigned int n_bytes)
+{
+  return jtagmkII_write_pages(pgm, p, m, page_size, addr, n_bytes, 0);
+}
+
+static int jtagmkII_paged_erase_write(PROGRAMMER * pgm, AVRPART * p,
+                                      AVRMEM * m, unsigned int page_size,
+                                      unsigned int addr, unsigned int n_bytes)
+{
+  return jtagmkII_write_pages(pgm, p, m, page_size, addr, n_bytes, 1);
+}
+
 static int jtagmkII_paged_load(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
                                unsigned int page_size,
                                unsigned int addr, unsigned int n_bytes)
@@ -2174,8 +2315,7 @@ static int jtagmkII_paged_load(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
   unsigned int block_size;
   unsigned int maxaddr = addr + n_bytes;
   unsigned char cmd[10];
-  unsigned char *resp;
-  int status, tries, dynamic_memtype = 0;
+  int dynamic_memtype = 0;
   long otimeout = serial_recv_timeout;
 
   if (verbose >= 2)
@@ -2209,69 +2349,52 @@ static int jtagmkII_paged_load(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
     cmd[1] = MTYPE_SPM;
   }
   serial_recv_timeout = 100;
-  for (; addr < maxaddr; addr += page_size) {
-    if ((maxaddr - addr) < page_size)
-      block_size = maxaddr - addr;
-    else
-      block_size = page_size;
-    if (verbose >= 3)
-      fprintf(stderr, "%s: jtagmkII_paged_load(): "
-	      "block_size at addr %d is %d\n",
-	      progname, addr, block_size);
 
-    if (dynamic_memtype)
-      cmd[1] = jtagmkII_memtype(pgm, p, addr);
+  /*
+   * Reads are queued ahead of what has been asked for, in the hope
+   * that the next call continues here.  Start over if it doesn't.
+   */
+  if (PDATA(pgm)->rd_mem != m ||
+      addr < PDATA(pgm)->rd_lo || addr > PDATA(pgm)->rd_next) {
+    PDATA(pgm)->rd_mem = NULL;
+    jtagmkII_queue_collect(pgm, 0);
+    PDATA(pgm)->rd_mem = m;
+    PDATA(pgm)->rd_lo = PDATA(pgm)->rd_hi = PDATA(pgm)->rd_next = addr;
+  }
 
-    u32_to_b4(cmd + 2, block_size);
-    u32_to_b4(cmd + 6, jtagmkII_memaddr(pgm, p, m, addr));
+  while (PDATA(pgm)->rd_mem == m && PDATA(pgm)->rd_hi < maxaddr) {
+    if (PDATA(pgm)->rd_next < m->size) {
+      addr = PDATA(pgm)->rd_next;
+      if ((m->size - addr) < page_size)
+	block_size = m->size - addr;
+      else
+	block_size = page_size;
+      if (verbose >= 3)
+	fprintf(stderr, "%s: jtagmkII_paged_load(): "
+		"block_size at addr %d is %d\n",
+		progname, addr, block_size);
 
-    tries = 0;
+      if (dynamic_memtype)
+	cmd[1] = jtagmkII_memtype(pgm, p, addr);
 
-    retry:
-    if (verbose >= 2)
-      fprintf(stderr, "%s: jtagmkII_paged_load(): Sending read memory command: ",
-	      progname);
-    jtagmkII_send(pgm, cmd, 10);
+      u32_to_b4(cmd + 2, block_size);
+      u32_to_b4(cmd + 6, jtagmkII_memaddr(pgm, p, m, addr));
 
-    status = jtagmkII_recv(pgm, &resp);
-    if (status <= 0) {
-      if (verbose >= 2)
-	putc('\n', stderr);
-      if (verbose >= 1)
-	fprintf(stderr,
-		"%s: jtagmkII_paged_load(): "
-		"timeout/error communicating with programmer (status %d)\n",
-		progname, status);
-      if (tries++ < 4) {
-	serial_recv_timeout *= 2;
-	goto retry;
-      }
-      fprintf(stderr,
-	      "%s: jtagmkII_paged_load(): fatal timeout/"
-	      "error communicating with programmer (status %d)\n",
-	      progname, status);
-      serial_recv_timeout = otimeout;
-      return -1;
-    }
-    if (verbose >= 3) {
-      putc('\n', stderr);
-      jtagmkII_prmsg(pgm, resp, status);
-    } else if (verbose == 2)
-      fprintf(stderr, "0x%02x (%d bytes msg)\n", resp[0], status);
-    if (resp[0] != RSP_MEMORY) {
-      fprintf(stderr,
-	      "%s: jtagmkII_paged_load(): "
-	      "bad response to read memory command: %s\n",
-	      progname, jtagmkII_get_rc(resp[0]));
-      free(resp);
-      serial_recv_timeout = otimeout;
-      return -1;
+      PDATA(pgm)->rd_next = addr + block_size;
+      if (jtagmkII_queue_send(pgm, cmd, 10, addr, block_size) < 0)
+	break;
+    } else if (PDATA(pgm)->nqueued == 0 ||
+	       jtagmkII_queue_collect(pgm, PDATA(pgm)->nqueued - 1) < 0) {
+      break;
     }
-    memcpy(m->buf + addr, resp + 1, status-1);
-    free(resp);
   }
   serial_recv_timeout = otimeout;
 
+  if (PDATA(pgm)->rd_mem != m || PDATA(pgm)->rd_hi < maxaddr) {
+    PDATA(pgm)->rd_mem = NULL;
+    return -1;
+  }
+
   return n_bytes;
 }
 
@@ -2340,6 +2463,8 @@ static int jtagmkII_read_byte(PROGRAMMER * pgm, AVRPART * p, AVRMEM * mem,
     cmd[1] = MTYPE_USERSIG;
   } else if (strcmp(mem->desc, "prodsig") == 0) {
     cmd[1] = MTYPE_PRODSIG;
+  } else if (strcmp(mem->desc, "data") == 0) {
+    cmd[1] = MTYPE_SRAM;
   } else if (strcmp(mem->desc, "calibration") == 0) {
     cmd[1] = MTYPE_OSCCAL_BYTE;
     if (pgm->flag & PGM_FL_IS_DW)
@@ -2515,6 +2640,8 @@ static int jtagmkII_write_byte(PROGRAMMER * pgm, AVRPART * p, AVRMEM * mem,
     cmd[1] = MTYPE_USERSIG;
   } else if (strcmp(mem->desc, "prodsig") == 0) {
     cmd[1] = MTYPE_PRODSIG;
+  } else if (strcmp(mem->desc, "data") == 0) {
+    cmd[1] = MTYPE_SRAM;
   } else if (strcmp(mem->desc, "lock") == 0) {
     cmd[1] = MTYPE_LOCK_BITS;
     if (pgm->flag & PGM_FL_IS_DW)
@@ -3942,7 +4069,10 @@ void jtagmkII_initpgm(PROGRAMMER * pgm)
    */
   pgm->paged_write    = jtagmkII_paged_write;
   pgm->paged_load     = jtagmkII_paged_load;
+  pgm->paged_flush    = jtagmkII_paged_flush;
   pgm->page_erase     = jtagmkII_page_erase;
+  pgm->mem_crc        = avr_xmega_nvm_crc;
+  pgm->paged_erase_write = jtagmkII_paged_erase_write;
   pgm->print_parms    = jtagmkII_print_parms;
   pgm->set_sck_period = jtagmkII_set_sck_period;
   pgm->parseextparams = jtagmkII_parseextparms;
@@ -3977,6 +4107,7 @@ void jtagmkII_dw_initpgm(PROGRAMMER * pgm)
    */
   pgm->paged_write    = jtagmkII_paged_write;
   pgm->paged_load     = jtagmkII_paged_load;
+  pgm->paged_flush    = jtagmkII_paged_flush;
   pgm->print_parms    = jtagmkII_print_parms;
   pgm->setup          = jtagmkII_setup;
   pgm->teardown       = jtagmkII_teardown;
@@ -4009,7 +4140,10 @@ void jtagmkII_pdi_initpgm(PROGRAMMER * pgm)
    */
   pgm->paged_write    = jtagmkII_paged_write;
   pgm->paged_load     = jtagmkII_paged_load;
+  pgm->paged_flush    = jtagmkII_paged_flush;
   pgm->page_erase     = jtagmkII_page_erase;
+  pgm->mem_crc        = avr_xmega_nvm_crc;
+  pgm->paged_erase_write = jtagmkII_paged_erase_write;
   pgm->print_parms    = jtagmkII_print_parms;
   pgm->setup          = jtagmkII_setup;
   pgm->teardown       = jtagmkII_teardown;
@@ -4042,7 +4176,10 @@ void jtagmkII_dragon_initpgm(PROGRAMMER * pgm)
    */
   pgm->paged_write    = jtagmkII_paged_write;
   pgm->paged_load     = jtagmkII_paged_load;
+  pgm->paged_flush    = jtagmkII_paged_flush;
   pgm->page_erase     = jtagmkII_page_erase;
+  pgm->mem_crc        = avr_xmega_nvm_crc;
+  pgm->paged_erase_write = jtagmkII_paged_erase_write;
   pgm->print_parms    = jtagmkII_print_parms;
   pgm->set_sck_period = jtagmkII_set_sck_period;
   pgm->parseextparams = jtagmkII_parseextparms;
@@ -4077,6 +4214,7 @@ void jtagmkII_dragon_dw_initpgm(PROGRAMMER * pgm)
    */
   pgm->paged_write    = jtagmkII_paged_write;
   pgm->paged_load     = jtagmkII_paged_load;
+  pgm->paged_flush    = jtagmkII_paged_flush;
   pgm->print_parms    = jtagmkII_print_parms;
   pgm->setup          = jtagmkII_setup;
   pgm->teardown       = jtagmkII_teardown;
@@ -4143,7 +4281,10 @@ void jtagmkII_dragon_pdi_initpgm(PROGRAMMER * pgm)
    */
   pgm->paged_write    = jtagmkII_paged_write;
   pgm->paged_load     = jtagmkII_paged_load;
+  pgm->paged_flush    = jtagmkII_paged_flush;
   pgm->page_erase     = jtagmkII_page_erase;
+  pgm->mem_crc        = avr_xmega_nvm_crc;
+  pgm->paged_erase_write = jtagmkII_paged_erase_write;
   pgm->print_parms    = jtagmkII_print_parms;
   pgm->setup          = jtagmkII_setup;
   pgm->teardown       = jtagmkII_teardown;
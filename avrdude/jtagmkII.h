@@ -26,6 +26,8 @@ extern "C" {
 #endif
 
 int  jtagmkII_send(PROGRAMMER * pgm, unsigned char * data, size_t len);
+int  jtagmkII_sendv(PROGRAMMER * pgm, const unsigned char * prefix, size_t plen,
+		    const unsigned char * data, size_t len);
 int  jtagmkII_recv(PROGRAMMER * pgm, unsigned char **msg);
 void jtagmkII_close(PROGRAMMER * pgm);
 int  jtagmkII_getsync(PROGRAMMER * pgm, int mode);
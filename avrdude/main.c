@@ -73,6 +73,8 @@ struct list_walk_cookie
 
 static LISTID updates = NULL;
 
+static LISTID patches = NULL;
+
 static LISTID extended_params = NULL;
 
 static LISTID additional_config_files = NULL;
@@ -85,6 +87,7 @@ static PROGRAMMER * pgm;
 int    verbose;     /* verbose output */
 int    quell_progress; /* un-verebose output */
 int    ovsigck;     /* 1=override sig check, 0=don't */
+int    skipff;      /* 1=omit all-0xff records from hex files */
 
 
 /*
@@ -106,10 +109,13 @@ static void usage(void)
  "  -F                         Override invalid signature check.\n"
  "  -e                         Perform a chip erase.\n"
  "  -O                         Perform RC oscillator calibration (see AVR053). \n"
- "  -U <memtype>:r|w|v:<filename>[:format]\n"
+ "  -U <memtype>[@<start>,<len>|@<start>-<end>]:r|w|v:<filename>[:format]\n"
  "                             Memory operation specification.\n"
  "                             Multiple -U options are allowed, each request\n"
  "                             is performed in the order specified.\n"
+ "  -S <memtype>:<addr>:<len>:b|B|d|h:<value>|+<counterfile>|@<file>\n"
+ "                             Patch memory contents before writing, e.g.\n"
+ "                             a per-device serial number.\n"
  "  -n                         Do not write anything to the device.\n"
  "  -V                         Do not verify.\n"
  "  -u                         Disable safemode, default when running from a script.\n"
@@ -122,6 +128,7 @@ static void usage(void)
  "  -Y <number>                Initialize erase cycle # in EEPROM.\n"
  "  -v                         Verbose output. -v -v for more.\n"
  "  -q                         Quell progress output. -q -q for less.\n"
+ "  -z                         Omit all-0xff records when writing hex files.\n"
  "  -l logfile                 Use logfile rather than stderr for diagnostics.\n"
  "  -?                         Display this usage.\n"
  "\navrdude version %s, URL: <http://savannah.nongnu.org/projects/avrdude/>\n"
@@ -308,6 +315,7 @@ int main(int argc, char * argv [])
   AVRMEM         * sig;         /* signature data */
   struct stat      sb;
   UPDATE         * upd;
+  PATCH          * patch;
   LNODEID        * ln;
 
 
@@ -378,6 +386,12 @@ int main(int argc, char * argv [])
     exit(1);
   }
 
+  patches = lcreat(NULL, 0);
+  if (patches == NULL) {
+    fprintf(stderr, "%s: cannot initialize patch list\n", progname);
+    exit(1);
+  }
+
   extended_params = lcreat(NULL, 0);
   if (extended_params == NULL) {
     fprintf(stderr, "%s: cannot initialize extended parameter list\n", progname);
@@ -396,6 +410,7 @@ int main(int argc, char * argv [])
   calibrate     = 0;
   p             = NULL;
   ovsigck       = 0;
+  skipff        = 0;
   terminal      = 0;
   verify        = 1;        /* on by default */
   quell_progress = 0;
@@ -453,7 +468,7 @@ int main(int argc, char * argv [])
   /*
    * process command line arguments
    */
-  while ((ch = getopt(argc,argv,"?b:B:c:C:DeE:Fi:l:np:OP:qstU:uvVx:yY:")) != -1) {
+  while ((ch = getopt(argc,argv,"?b:B:c:C:DeE:Fi:l:np:OP:qsS:tU:uvVx:yY:z")) != -1) {
 
     switch (ch) {
       case 'b': /* override default programmer baud rate */
@@ -550,6 +565,13 @@ int main(int argc, char * argv [])
         safemode = 0;
         break;
 
+      case 'S':
+        patch = parse_patch(optarg);
+        if (patch == NULL)
+          exit(1);
+        ladd(patches, patch);
+        break;
+
       case 'U':
         upd = parse_op(optarg);
         if (upd == NULL) {
@@ -588,6 +610,10 @@ int main(int argc, char * argv [])
                 progname);
         break;
 
+      case 'z': /* omit erased records from hex output files */
+        skipff = 1;
+        break;
+
       case '?': /* help */
         usage();
         exit(0);
@@ -895,6 +921,24 @@ int main(int argc, char * argv [])
     }
   }
 
+  for (ln=lfirst(patches); ln; ln=lnext(ln)) {
+    patch = ldata(ln);
+    if (avr_locate_mem(p, patch->memtype) == NULL) {
+      fprintf(stderr, "%s: -S: memory type \"%s\" not defined for part \"%s\"\n",
+              progname, patch->memtype, p->desc);
+      exit(1);
+    }
+  }
+  update_set_patches(patches);
+
+  /*
+   * Parse all input files now, rather than after the (possibly
+   * lengthy) programmer setup.
+   */
+  if (update_expand_bundles(p, updates) < 0 ||
+      update_preload(p, updates) < 0)
+    exit(1);
+
   /*
    * open the programmer
    */
@@ -1145,6 +1189,17 @@ int main(int argc, char * argv [])
 
   if (uflags & UF_AUTO_ERASE) {
     if ((p->flags & AVRPART_HAS_PDI) && pgm->page_erase != NULL &&
+        lsize(updates) > 0 && update_plan_erase(p, updates)) {
+      uflags &= ~UF_AUTO_ERASE;
+      erase = 1;
+      if (quell_progress < 2) {
+        fprintf(stderr,
+                "%s: NOTE: All flash and EEPROM contents and the lock bits are being rewritten,\n"
+                "%sso a chip erase is faster than erasing each page before programming it.\n"
+                "%sTo disable this feature, specify the -D option.\n",
+                progname, progbuf, progbuf);
+      }
+    } else if ((p->flags & AVRPART_HAS_PDI) && pgm->page_erase != NULL &&
         lsize(updates) > 0) {
       if (quell_progress < 2) {
         fprintf(stderr,
@@ -1193,6 +1248,7 @@ int main(int argc, char * argv [])
       }
       exitrc = avr_chip_erase(pgm, p);
       if(exitrc) goto main_exit;
+      uflags |= UF_ERASED;
     }
   }
 
@@ -1201,6 +1257,8 @@ int main(int argc, char * argv [])
      * terminal mode
      */
     exitrc = terminal_mode(pgm, p);
+    /* the terminal may have written anything */
+    uflags &= ~UF_ERASED;
   }
 
   if (!init_ok) {
@@ -1221,6 +1279,10 @@ int main(int argc, char * argv [])
     }
   }
 
+  if (exitrc == 0 && !(uflags & UF_NOWRITE) &&
+      update_commit_patches() < 0)
+    exitrc = 1;
+
   /* Right before we exit programming mode, which will make the fuse
      bits active, check to make sure they are still correct */
   if (safemode == 1) {
@@ -379,6 +379,8 @@ void par_initpgm(PROGRAMMER * pgm)
   pgm->chip_erase     = bitbang_chip_erase;
   pgm->cmd            = bitbang_cmd;
   pgm->cmd_tpi        = bitbang_cmd_tpi;
+  pgm->tpi_block_read = bitbang_tpi_block_read;
+  pgm->tpi_block_write = bitbang_tpi_block_write;
   pgm->spi            = bitbang_spi;
   pgm->open           = par_open;
   pgm->close          = par_close;
@@ -124,8 +124,13 @@ PROGRAMMER * pgm_new(void)
   pgm->spi            = NULL;
   pgm->paged_write    = NULL;
   pgm->paged_load     = NULL;
+  pgm->paged_flush    = NULL;
+  pgm->paged_erase_write = NULL;
+  pgm->tpi_block_read = NULL;
+  pgm->tpi_block_write = NULL;
   pgm->write_setup    = NULL;
   pgm->read_sig_bytes = NULL;
+  pgm->mem_crc        = NULL;
   pgm->set_vtarget    = NULL;
   pgm->set_varef      = NULL;
   pgm->set_fosc       = NULL;
@@ -109,14 +109,24 @@ typedef struct programmer_t {
   int  (*paged_load)     (struct programmer_t * pgm, AVRPART * p, AVRMEM * m,
                           unsigned int page_size, unsigned int baseaddr,
                           unsigned int n_bytes);
+  int  (*paged_flush)    (struct programmer_t * pgm, AVRPART * p, AVRMEM * m);
   int  (*page_erase)     (struct programmer_t * pgm, AVRPART * p, AVRMEM * m,
                           unsigned int baseaddr);
+  int  (*paged_erase_write)(struct programmer_t * pgm, AVRPART * p, AVRMEM * m,
+                          unsigned int page_size, unsigned int baseaddr,
+                          unsigned int n_bytes);
+  int  (*tpi_block_read) (struct programmer_t * pgm, AVRPART * p, AVRMEM * m,
+                          unsigned int baseaddr, unsigned int n_bytes);
+  int  (*tpi_block_write)(struct programmer_t * pgm, AVRPART * p, AVRMEM * m,
+                          unsigned int baseaddr, unsigned int n_bytes);
   void (*write_setup)    (struct programmer_t * pgm, AVRPART * p, AVRMEM * m);
   int  (*write_byte)     (struct programmer_t * pgm, AVRPART * p, AVRMEM * m,
                           unsigned long addr, unsigned char value);
   int  (*read_byte)      (struct programmer_t * pgm, AVRPART * p, AVRMEM * m,
                           unsigned long addr, unsigned char * value);
   int  (*read_sig_bytes) (struct programmer_t * pgm, AVRPART * p, AVRMEM * m);
+  int  (*mem_crc)        (struct programmer_t * pgm, AVRPART * p, AVRMEM * m,
+                          unsigned long * crc);
   void (*print_parms)    (struct programmer_t * pgm);
   int  (*set_vtarget)    (struct programmer_t * pgm, double v);
   int  (*set_varef)      (struct programmer_t * pgm, unsigned int chan, double v);
@@ -46,6 +46,7 @@
 #include "serial.h"
 
 long serial_recv_timeout = 5000; /* ms */
+long serial_drain_timeout = 250; /* ms of silence that end a drain */
 
 struct baud_mapping {
   long baud;
@@ -69,6 +70,18 @@ static struct baud_mapping baud_lookup_table [] = {
 #endif
 #ifdef B230400
   { 230400, B230400 },
+#endif
+#ifdef B460800
+  { 460800, B460800 },
+#endif
+#ifdef B500000
+  { 500000, B500000 },
+#endif
+#ifdef B921600
+  { 921600, B921600 },
+#endif
+#ifdef B1000000
+  { 1000000, B1000000 },
 #endif
   { 0,      0 }                 /* Terminator. */
 };
@@ -441,8 +454,8 @@ static int ser_drain(union filedescriptor *fd, int display)
   int rc;
   unsigned char buf;
 
-  timeout.tv_sec = 0;
-  timeout.tv_usec = 250000;
+  timeout.tv_sec = serial_drain_timeout / 1000L;
+  timeout.tv_usec = (serial_drain_timeout % 1000L) * 1000;
 
   if (display) {
     fprintf(stderr, "drain>");
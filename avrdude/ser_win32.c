@@ -34,6 +34,7 @@
 #include "serial.h"
 
 long serial_recv_timeout = 5000; /* ms */
+long serial_drain_timeout = 250; /* ms of silence that end a drain */
 
 #define W32SERBUFSIZE 1024
 
@@ -362,7 +363,15 @@ static int ser_drain(union filedescriptor *fd, int display)
 		exit(1);
 	}
 
-	serial_w32SetTimeOut(hComPort,250);
+	if (serial_drain_timeout > 0)
+		serial_w32SetTimeOut(hComPort, serial_drain_timeout);
+	else {
+		/* only take what has already arrived */
+		COMMTIMEOUTS ctmo;
+		ZeroMemory (&ctmo, sizeof(COMMTIMEOUTS));
+		ctmo.ReadIntervalTimeout = MAXDWORD;
+		SetCommTimeouts(hComPort, &ctmo);
+	}
   
 	if (display) {
 		fprintf(stderr, "drain>");
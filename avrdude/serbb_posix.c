@@ -305,6 +305,8 @@ void serbb_initpgm(PROGRAMMER *pgm)
   pgm->chip_erase     = bitbang_chip_erase;
   pgm->cmd            = bitbang_cmd;
   pgm->cmd_tpi        = bitbang_cmd_tpi;
+  pgm->tpi_block_read = bitbang_tpi_block_read;
+  pgm->tpi_block_write = bitbang_tpi_block_write;
   pgm->open           = serbb_open;
   pgm->close          = serbb_close;
   pgm->setpin         = serbb_setpin;
@@ -30,6 +30,7 @@
 #define serial_h
 
 extern long serial_recv_timeout;
+extern long serial_drain_timeout;
 union filedescriptor
 {
   int ifd;
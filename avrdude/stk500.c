@@ -42,15 +42,81 @@
 #include "stk500.h"
 #include "stk500_private.h"
 #include "serial.h"
+#include "baudrate.h"
 
 #define STK500_XTAL 7372800U
 #define MAX_SYNC_ATTEMPTS 10
 
+/*
+ * Private data for this programmer.
+ */
+struct pdata
+{
+  /*
+   * Send LOAD_ADDRESS and the paged command in one buffer, and check
+   * both responses afterwards.  Cleared if the firmware loses sync
+   * over it; paged access goes lock-step from then on.
+   */
+  int pipeline;
+
+  struct baud_ladder baudrates;   /* -x baudrates=... */
+};
+
+#define PDATA(pgm) ((struct pdata *)(pgm->cookie))
+
 static int stk500_getparm(PROGRAMMER * pgm, unsigned parm, unsigned * value);
 static int stk500_setparm(PROGRAMMER * pgm, unsigned parm, unsigned value);
 static void stk500_print_parms1(PROGRAMMER * pgm, const char * p);
 
 
+void stk500_setup(PROGRAMMER * pgm)
+{
+  if ((pgm->cookie = malloc(sizeof(struct pdata))) == 0) {
+    fprintf(stderr,
+	    "%s: stk500_setup(): Out of memory allocating private data\n",
+	    progname);
+    exit(1);
+  }
+  memset(pgm->cookie, 0, sizeof(struct pdata));
+  PDATA(pgm)->pipeline = 1;
+}
+
+void stk500_teardown(PROGRAMMER * pgm)
+{
+  free(pgm->cookie);
+}
+
+
+static int stk500_parseextparms(PROGRAMMER * pgm, LISTID extparms)
+{
+  LNODEID ln;
+  const char *extended_param;
+  int rv = 0;
+
+  for (ln = lfirst(extparms); ln; ln = lnext(ln)) {
+    extended_param = ldata(ln);
+
+    if (strncmp(extended_param, "baudrates=", strlen("baudrates=")) == 0) {
+      if (baud_ladder_parse(&PDATA(pgm)->baudrates,
+                            extended_param + strlen("baudrates=")) < 0) {
+        fprintf(stderr,
+                "%s: stk500_parseextparms(): invalid baud rate list '%s'\n",
+                progname, extended_param);
+        rv = -1;
+      }
+      continue;
+    }
+
+    fprintf(stderr,
+            "%s: stk500_parseextparms(): invalid extended parameter '%s'\n",
+            progname, extended_param);
+    rv = -1;
+  }
+
+  return rv;
+}
+
+
 static int stk500_send(PROGRAMMER * pgm, unsigned char * buf, size_t len)
 {
   return serial_send(&pgm->fd, buf, len);
@@ -661,6 +727,48 @@ static void stk500_enable(PROGRAMMER * pgm)
 }
 
 
+/*
+ * Ask for the firmware version; the answer doubles as a check of the
+ * line at a new speed.
+ */
+static int stk500_baud_probe(PROGRAMMER * pgm, unsigned char * resp, size_t len)
+{
+  static const unsigned char parms[2] = { Parm_STK_SW_MAJOR, Parm_STK_SW_MINOR };
+  unsigned char buf[3];
+  size_t i;
+
+  /* each answer is INSYNC, the value and OK */
+  for (i = 0; i < sizeof(parms) && 3 * (i + 1) <= len; i++) {
+    buf[0] = Cmnd_STK_GET_PARAMETER;
+    buf[1] = parms[i];
+    buf[2] = Sync_CRC_EOP;
+    serial_send(&pgm->fd, buf, 3);
+    if (serial_recv(&pgm->fd, resp + 3 * i, 3) < 0)
+      return -1;
+  }
+
+  return 0;
+}
+
+
+/*
+ * After the initial sync, move to the fastest rate of -x baudrates
+ * the firmware follows.
+ */
+int stk500_negotiate_baud(PROGRAMMER * pgm)
+{
+  long rate;
+
+  rate = baud_negotiate(pgm, &PDATA(pgm)->baudrates,
+                        pgm->baudrate? pgm->baudrate: 115200,
+                        stk500_baud_probe, 6);
+  if (rate < 0)
+    return stk500_getsync(pgm);
+
+  return 0;
+}
+
+
 static int stk500_open(PROGRAMMER * pgm, char * port)
 {
   strcpy(pgm->port, port);
@@ -681,6 +789,9 @@ static int stk500_open(PROGRAMMER * pgm, char * port)
   if (stk500_getsync(pgm) < 0)
     return -1;
 
+  if (stk500_negotiate_baud(pgm) < 0)
+    return -1;
+
   return 0;
 }
 
@@ -696,33 +807,33 @@ static void stk500_close(PROGRAMMER * pgm)
 }
 
 
-static int stk500_loadaddr(PROGRAMMER * pgm, unsigned int addr)
+/*
+ * Put a LOAD_ADDRESS command into buf, returning its length.
+ */
+static int stk500_loadaddr_cmd(unsigned char * buf, unsigned int addr)
 {
-  unsigned char buf[16];
-  int tries;
-
-  tries = 0;
- retry:
-  tries++;
   buf[0] = Cmnd_STK_LOAD_ADDRESS;
   buf[1] = addr & 0xff;
   buf[2] = (addr >> 8) & 0xff;
   buf[3] = Sync_CRC_EOP;
 
-  stk500_send(pgm, buf, 4);
+  return 4;
+}
+
+
+/*
+ * Read the response to a LOAD_ADDRESS command.  Returns 0 if it was
+ * accepted, 1 if the firmware is out of sync, and -1 on a protocol
+ * error.
+ */
+static int stk500_loadaddr_recv(PROGRAMMER * pgm)
+{
+  unsigned char buf[1];
 
   if (stk500_recv(pgm, buf, 1) < 0)
     exit(1);
-  if (buf[0] == Resp_STK_NOSYNC) {
-    if (tries > 33) {
-      fprintf(stderr, "%s: stk500_loadaddr(): can't get into sync\n",
-              progname);
-      return -1;
-    }
-    if (stk500_getsync(pgm) < 0)
-      return -1;
-    goto retry;
-  }
+  if (buf[0] == Resp_STK_NOSYNC)
+    return 1;
   else if (buf[0] != Resp_STK_INSYNC) {
     fprintf(stderr,
             "%s: stk500_loadaddr(): (a) protocol error, "
@@ -746,6 +857,49 @@ static int stk500_loadaddr(PROGRAMMER * pgm, unsigned int addr)
 }
 
 
+static int stk500_loadaddr(PROGRAMMER * pgm, unsigned int addr)
+{
+  unsigned char buf[16];
+  int tries;
+  int rc;
+
+  tries = 0;
+ retry:
+  tries++;
+  stk500_send(pgm, buf, stk500_loadaddr_cmd(buf, addr));
+
+  rc = stk500_loadaddr_recv(pgm);
+  if (rc > 0) {
+    if (tries > 33) {
+      fprintf(stderr, "%s: stk500_loadaddr(): can't get into sync\n",
+              progname);
+      return -1;
+    }
+    if (stk500_getsync(pgm) < 0)
+      return -1;
+    goto retry;
+  }
+
+  return rc;
+}
+
+
+/*
+ * The firmware lost sync over a pipelined LOAD_ADDRESS; go lock-step
+ * for the rest of the session.
+ */
+static void stk500_stop_pipeline(PROGRAMMER * pgm, const char * caller)
+{
+  if (PDATA(pgm)->pipeline && verbose) {
+    fprintf(stderr,
+            "\n%s: %s(): programmer lost sync, "
+            "no longer pipelining LOAD_ADDRESS\n",
+            progname, caller);
+  }
+  PDATA(pgm)->pipeline = 0;
+}
+
+
 static int stk500_paged_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
                               unsigned int page_size,
                               unsigned int addr, unsigned int n_bytes)
@@ -755,8 +909,12 @@ static int stk500_paged_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
   int a_div;
   int block_size;
   int tries;
+  int pipeline;
+  int rc;
   unsigned int n;
   unsigned int i;
+  unsigned int prev_addr;
+  int have_prev;
 
   if (strcmp(m->desc, "flash") == 0) {
     memtype = 'F';
@@ -783,7 +941,10 @@ static int stk500_paged_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
           n_bytes, n, a_div, page_size);
 #endif     
 
+  have_prev = 0;
+  prev_addr = 0;
   for (; addr < n; addr += block_size) {
+  again:
     // MIB510 uses fixed blocks size of 256 bytes
     if (strcmp(ldata(lfirst(pgm->id)), "mib510") == 0) {
       block_size = 256;
@@ -796,11 +957,21 @@ static int stk500_paged_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
     tries = 0;
   retry:
     tries++;
-    stk500_loadaddr(pgm, addr/a_div);
+    /*
+     * If the firmware loses sync over a pipelined LOAD_ADDRESS, it may
+     * still run the PROG_PAGE behind it at the address loaded before.
+     * Only pipeline behind a page written here, which can be written
+     * again then.
+     */
+    pipeline = PDATA(pgm)->pipeline && have_prev;
 
     /* build command block and avoid multiple send commands as it leads to a crash
         of the silabs usb serial driver on mac os x */
     i = 0;
+    if (pipeline)
+      i += stk500_loadaddr_cmd(&buf[i], addr/a_div);
+    else
+      stk500_loadaddr(pgm, addr/a_div);
     buf[i++] = Cmnd_STK_PROG_PAGE;
     buf[i++] = (block_size >> 8) & 0xff;
     buf[i++] = block_size & 0xff;
@@ -810,6 +981,20 @@ static int stk500_paged_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
     buf[i++] = Sync_CRC_EOP;
     stk500_send( pgm, buf, i);
 
+    if (pipeline) {
+      rc = stk500_loadaddr_recv(pgm);
+      if (rc < 0)
+        return -4;
+      if (rc > 0) {
+        stk500_stop_pipeline(pgm, "stk500_paged_write");
+        if (stk500_getsync(pgm) < 0)
+          return -1;
+        /* rewrite the previous page, then this one, lock-step */
+        addr = prev_addr;
+        goto again;
+      }
+    }
+
     if (stk500_recv(pgm, buf, 1) < 0)
       exit(1);
     if (buf[0] == Resp_STK_NOSYNC) {
@@ -818,6 +1003,8 @@ static int stk500_paged_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
                 progname);
         return -3;
       }
+      if (pipeline)
+        stk500_stop_pipeline(pgm, "stk500_paged_write");
       if (stk500_getsync(pgm) < 0)
 	return -1;
       goto retry;
@@ -839,6 +1026,8 @@ static int stk500_paged_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
               progname, Resp_STK_INSYNC, buf[0]);
       return -5;
     }
+    prev_addr = addr;
+    have_prev = 1;
   }
 
   return n_bytes;
@@ -852,7 +1041,10 @@ static int stk500_paged_load(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
   int memtype;
   int a_div;
   int tries;
+  int pipeline;
+  int rc;
   unsigned int n;
+  unsigned int i;
   int block_size;
 
   if (strcmp(m->desc, "flash") == 0) {
@@ -885,22 +1077,45 @@ static int stk500_paged_load(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
     tries = 0;
   retry:
     tries++;
-    stk500_loadaddr(pgm, addr/a_div);
-    buf[0] = Cmnd_STK_READ_PAGE;
-    buf[1] = (block_size >> 8) & 0xff;
-    buf[2] = block_size & 0xff;
-    buf[3] = memtype;
-    buf[4] = Sync_CRC_EOP;
-    stk500_send(pgm, buf, 5);
+    pipeline = PDATA(pgm)->pipeline;
+    i = 0;
+    if (pipeline)
+      i += stk500_loadaddr_cmd(&buf[i], addr/a_div);
+    else
+      stk500_loadaddr(pgm, addr/a_div);
+    buf[i++] = Cmnd_STK_READ_PAGE;
+    buf[i++] = (block_size >> 8) & 0xff;
+    buf[i++] = block_size & 0xff;
+    buf[i++] = memtype;
+    buf[i++] = Sync_CRC_EOP;
+    stk500_send(pgm, buf, i);
+
+    if (pipeline) {
+      rc = stk500_loadaddr_recv(pgm);
+      if (rc < 0)
+        return -4;
+      if (rc > 0) {
+        /*
+         * A READ_PAGE run at the old address only sends data that
+         * stk500_getsync() drains.
+         */
+        stk500_stop_pipeline(pgm, "stk500_paged_load");
+        buf[0] = Resp_STK_NOSYNC;
+        goto nosync;
+      }
+    }
 
     if (stk500_recv(pgm, buf, 1) < 0)
       exit(1);
+  nosync:
     if (buf[0] == Resp_STK_NOSYNC) {
       if (tries > 33) {
         fprintf(stderr, "\n%s: stk500_paged_load(): can't get into sync\n",
                 progname);
         return -3;
       }
+      if (pipeline)
+        stk500_stop_pipeline(pgm, "stk500_paged_load");
       if (stk500_getsync(pgm) < 0)
 	return -1;
       goto retry;
@@ -1307,5 +1522,8 @@ void stk500_initpgm(PROGRAMMER * pgm)
   pgm->set_varef      = stk500_set_varef;
   pgm->set_fosc       = stk500_set_fosc;
   pgm->set_sck_period = stk500_set_sck_period;
+  pgm->parseextparams = stk500_parseextparms;
+  pgm->setup          = stk500_setup;
+  pgm->teardown       = stk500_teardown;
   pgm->page_size      = 256;
 }
@@ -31,6 +31,11 @@ void stk500_initpgm (PROGRAMMER * pgm);
 /* used by arduino.c to avoid duplicate code */
 int stk500_getsync(PROGRAMMER * pgm);
 int stk500_drain(PROGRAMMER * pgm, int display);
+int stk500_negotiate_baud(PROGRAMMER * pgm);
+
+/* used by stk500generic.c when it settles for STK500v1 */
+void stk500_setup(PROGRAMMER * pgm);
+void stk500_teardown(PROGRAMMER * pgm);
 
 #ifdef __cplusplus
 }
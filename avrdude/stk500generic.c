@@ -29,6 +29,7 @@
 #include "ac_cfg.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "avrdude.h"
@@ -37,18 +38,44 @@
 #include "stk500.h"
 #include "stk500v2.h"
 
+/* -x options, for the STK500v1 code if that protocol answers */
+static LISTID extparms;
+
+static int stk500generic_parseextparms(PROGRAMMER * pgm, LISTID parms)
+{
+  extparms = parms;
+  return 0;
+}
+
 static int stk500generic_open(PROGRAMMER * pgm, char * port)
 {
+  void *v2_pdata = pgm->cookie;
+
+  /*
+   * The STK500v1 code has private data of its own; swap it in while
+   * trying that protocol.
+   */
   stk500_initpgm(pgm);
+  pgm->setup(pgm);
+  if (extparms != NULL && lsize(extparms) > 0 &&
+      pgm->parseextparams(pgm, extparms) < 0) {
+    pgm->teardown(pgm);
+    pgm->cookie = v2_pdata;
+    stk500v2_initpgm(pgm);
+    return -1;
+  }
   if (pgm->open(pgm, port) >= 0)
     {
       fprintf(stderr,
 	      "%s: successfully opened stk500v1 device -- please use -c stk500v1\n",
 	      progname);
+      free(v2_pdata);
       return 0;
     }
 
   pgm->close(pgm);
+  pgm->teardown(pgm);
+  pgm->cookie = v2_pdata;
 
   stk500v2_initpgm(pgm);
   if (pgm->open(pgm, port) >= 0)
@@ -56,6 +83,11 @@ static int stk500generic_open(PROGRAMMER * pgm, char * port)
       fprintf(stderr,
 	      "%s: successfully opened stk500v2 device -- please use -c stk500v2\n",
 	      progname);
+      if (extparms != NULL && lsize(extparms) > 0)
+	fprintf(stderr,
+		"%s: WARNING: stk500v2 doesn't support extended parameters,"
+		" -x option(s) ignored\n",
+		progname);
       return 0;
     }
 
@@ -68,7 +100,8 @@ static int stk500generic_open(PROGRAMMER * pgm, char * port)
 static void stk500generic_setup(PROGRAMMER * pgm)
 {
   /*
-   * Only STK500v2 needs setup/teardown.
+   * Set up for STK500v2; stk500generic_open() replaces this with the
+   * STK500v1 private data if it finds that protocol.
    */
   stk500v2_initpgm(pgm);
   pgm->setup(pgm);
@@ -89,4 +122,5 @@ void stk500generic_initpgm(PROGRAMMER * pgm)
   pgm->open           = stk500generic_open;
   pgm->setup          = stk500generic_setup;
   pgm->teardown       = stk500generic_teardown;
+  pgm->parseextparams = stk500generic_parseextparms;
 }
@@ -289,6 +289,8 @@ static int stk600_set_sck_period(PROGRAMMER * pgm, double v);
 static void stk600_setup_xprog(PROGRAMMER * pgm);
 static void stk600_setup_isp(PROGRAMMER * pgm);
 static int stk600_xprog_program_enable(PROGRAMMER * pgm, AVRPART * p);
+static int stk600_xprog_page_erase(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
+                                   unsigned int addr);
 
 void stk500v2_setup(PROGRAMMER * pgm)
 {
@@ -418,7 +420,7 @@ static unsigned short get_jtagisp_return_size(unsigned char cmd)
  */
 static int stk500v2_jtagmkII_send(PROGRAMMER * pgm, unsigned char * data, size_t len)
 {
-  unsigned char *cmdbuf;
+  unsigned char hdr[3];
   int rv;
   unsigned short sz;
   void *mycookie;
@@ -444,19 +446,12 @@ static int stk500v2_jtagmkII_send(PROGRAMMER * pgm, unsigned char * data, size_t
     sz = 3 + data[2];
   }
 
-  if ((cmdbuf = malloc(len + 3)) == NULL) {
-    fprintf(stderr, "%s: out of memory for command packet\n",
-            progname);
-    exit(1);
-  }
   mycookie = pgm->cookie;
   pgm->cookie = PDATA(pgm)->chained_pdata;
-  cmdbuf[0] = CMND_ISP_PACKET;
-  cmdbuf[1] = sz & 0xff;
-  cmdbuf[2] = (sz >> 8) & 0xff;
-  memcpy(cmdbuf + 3, data, len);
-  rv = jtagmkII_send(pgm, cmdbuf, len + 3);
-  free(cmdbuf);
+  hdr[0] = CMND_ISP_PACKET;
+  hdr[1] = sz & 0xff;
+  hdr[2] = (sz >> 8) & 0xff;
+  rv = jtagmkII_sendv(pgm, hdr, 3, data, len);
   pgm->cookie = mycookie;
 
   return rv;
@@ -467,21 +462,14 @@ static int stk500v2_jtagmkII_send(PROGRAMMER * pgm, unsigned char * data, size_t
  */
 static int stk500v2_jtag3_send(PROGRAMMER * pgm, unsigned char * data, size_t len)
 {
-  unsigned char *cmdbuf;
+  unsigned char hdr[1];
   int rv;
   void *mycookie;
 
-  if ((cmdbuf = malloc(len + 1)) == NULL) {
-    fprintf(stderr, "%s: out of memory for command packet\n",
-            progname);
-    exit(1);
-  }
   mycookie = pgm->cookie;
   pgm->cookie = PDATA(pgm)->chained_pdata;
-  cmdbuf[0] = SCOPE_AVR_ISP;
-  memcpy(cmdbuf + 1, data, len);
-  rv = jtag3_send(pgm, cmdbuf, len + 1);
-  free(cmdbuf);
+  hdr[0] = SCOPE_AVR_ISP;
+  rv = jtag3_sendv(pgm, hdr, 1, data, len);
   pgm->cookie = mycookie;
 
   return rv;
@@ -572,17 +560,21 @@ static int stk500v2_jtagmkII_recv(PROGRAMMER * pgm, unsigned char *msg,
   case RSP_FAILED:
     fprintf(stderr, "%s: stk500v2_jtagmkII_recv(): failed\n",
 	    progname);
+    free(jtagmsg);
     return -1;
   case RSP_ILLEGAL_MCU_STATE:
     fprintf(stderr, "%s: stk500v2_jtagmkII_recv(): illegal MCU state\n",
 	    progname);
+    free(jtagmsg);
     return -1;
   default:
     fprintf(stderr, "%s: stk500v2_jtagmkII_recv(): unknown status %d\n",
 	    progname, jtagmsg[0]);
+    free(jtagmsg);
     return -1;
   }
   memcpy(msg, jtagmsg + 1, rv - 1);
+  free(jtagmsg);
   return rv;
 }
 
@@ -1914,6 +1906,9 @@ static int stk500isp_read_byte(PROGRAMMER * pgm, AVRPART * p, AVRMEM * mem,
       return 0;
     }
 
+    /* the page goes through mem->buf, which may not exist yet */
+    if (avr_mem_unshare(mem) < 0)
+      return -1;
     if (stk500v2_paged_load(pgm, p, mem, pagesize, paddr, pagesize) < 0)
       return -1;
 
@@ -2182,6 +2177,8 @@ static int stk500isp_write_byte(PROGRAMMER * pgm, AVRPART * p, AVRMEM * mem,
     memset(cache_ptr, 0xff, pagesize);
     cache_ptr[addr & (pagesize - 1)] = data;
 
+    if (avr_mem_unshare(mem) < 0)
+      return -1;
     memcpy(mem->buf + paddr, cache_ptr, pagesize);
     stk500v2_paged_write(pgm, p, mem, pagesize, addr, pagesize);
 
@@ -4117,17 +4114,22 @@ static int stk600_xprog_paged_load(PROGRAMMER * pgm, AVRPART * p, AVRMEM * mem,
     return n_bytes_orig;
 }
 
-static int stk600_xprog_paged_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * mem,
+/*
+ * Write pages; if erase is set, each page is erased first.  On Xmega
+ * flash and EEPROM this is done by the write command itself.
+ */
+static int stk600_xprog_write_pages(PROGRAMMER * pgm, AVRPART * p, AVRMEM * mem,
                                     unsigned int page_size,
-                                    unsigned int addr, unsigned int n_bytes)
+                                    unsigned int addr, unsigned int n_bytes,
+                                    int erase)
 {
     unsigned char *b;
     unsigned int offset;
     unsigned char memtype;
-    int n_bytes_orig = n_bytes, dynamic_memtype = 0;
+    int n_bytes_orig = n_bytes, dynamic_memtype = 0, combine_erase = 0;
     size_t writesize;
     unsigned long use_ext_addr = 0;
-    unsigned char writemode;
+    unsigned char writemode, erasemode;
 
     /*
      * The XPROG read command supports at most 256 bytes in one
@@ -4188,6 +4190,10 @@ static int stk600_xprog_paged_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * mem,
                 progname, mem->desc);
         return -1;
     }
+    if (erase && (p->flags & AVRPART_HAS_PDI) &&
+        (dynamic_memtype || memtype == XPRG_MEM_TYPE_APPL ||
+         memtype == XPRG_MEM_TYPE_BOOT || memtype == XPRG_MEM_TYPE_EEPROM))
+        combine_erase = 1;
     offset = addr;
     addr += mem->offset;
 
@@ -4208,6 +4214,16 @@ static int stk600_xprog_paged_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * mem,
 	if (dynamic_memtype)
 	    memtype = stk600_xprog_memtype(pgm, addr - mem->offset);
 
+	erasemode = 0;
+	if (erase && (mem->page_size == 0 || offset % mem->page_size == 0)) {
+	    if (combine_erase)
+		erasemode = (1 << XPRG_MEM_WRITE_ERASE);
+	    else if (stk600_xprog_page_erase(pgm, p, mem, offset) < 0) {
+		free(b);
+		return -1;
+	    }
+	}
+
 	if (page_size > 256) {
 	    /*
 	     * AVR079 is not quite clear.  While it suggests that
@@ -4235,7 +4251,7 @@ static int stk600_xprog_paged_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * mem,
                 }
 		b[0] = XPRG_CMD_WRITE_MEM;
 		b[1] = memtype;
-		b[2] = writemode;
+		b[2] = writemode | (chunk == 0? erasemode: 0);
 		b[3] = addr >> 24;
 		b[4] = addr >> 16;
 		b[5] = addr >> 8;
@@ -4270,7 +4286,7 @@ static int stk600_xprog_paged_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * mem,
             }
 	    b[0] = XPRG_CMD_WRITE_MEM;
 	    b[1] = memtype;
-	    b[2] = writemode;
+	    b[2] = writemode | erasemode;
 	    b[3] = addr >> 24;
 	    b[4] = addr >> 16;
 	    b[5] = addr >> 8;
@@ -4298,6 +4314,21 @@ static int stk600_xprog_paged_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * mem,
     return n_bytes_orig;
 }
 
+static int stk600_xprog_paged_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * mem,
+                                    unsigned int page_size,
+                                    unsigned int addr, unsigned int n_bytes)
+{
+    return stk600_xprog_write_pages(pgm, p, mem, page_size, addr, n_bytes, 0);
+}
+
+static int stk600_xprog_paged_erase_write(PROGRAMMER * pgm, AVRPART * p,
+                                          AVRMEM * mem, unsigned int page_size,
+                                          unsigned int addr,
+                                          unsigned int n_bytes)
+{
+    return stk600_xprog_write_pages(pgm, p, mem, page_size, addr, n_bytes, 1);
+}
+
 static int stk600_xprog_chip_erase(PROGRAMMER * pgm, AVRPART * p)
 {
     unsigned char b[6];
@@ -4367,6 +4398,35 @@ static int stk600_xprog_page_erase(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
     return 0;
 }
 
+/*
+ * Have the device checksum a flash section.
+ */
+static int stk600_xprog_mem_crc(PROGRAMMER * pgm, AVRPART * p, AVRMEM * mem,
+                                unsigned long * crc)
+{
+    unsigned char b[5];
+
+    if (strcmp(mem->desc, "application") == 0) {
+        b[1] = XPRG_CRC_APP;
+    } else if (strcmp(mem->desc, "boot") == 0) {
+        b[1] = XPRG_CRC_BOOT;
+    } else if (strcmp(mem->desc, "flash") == 0) {
+        b[1] = XPRG_CRC_FLASH;
+    } else {
+        return -1;
+    }
+
+    b[0] = XPRG_CMD_CRC;
+    if (stk600_xprog_command(pgm, b, 2, 5) < 0) {
+        fprintf(stderr,
+                "%s: stk600_xprog_mem_crc(): XPRG_CMD_CRC failed\n",
+                progname);
+        return -1;
+    }
+    *crc = ((unsigned long)b[2] << 16) | (b[3] << 8) | b[4];
+    return 0;
+}
+
 /*
  * Modify pgm's methods for XPROG operation.
  */
@@ -4379,7 +4439,9 @@ static void stk600_setup_xprog(PROGRAMMER * pgm)
     pgm->paged_load = stk600_xprog_paged_load;
     pgm->paged_write = stk600_xprog_paged_write;
     pgm->page_erase = stk600_xprog_page_erase;
+    pgm->paged_erase_write = stk600_xprog_paged_erase_write;
     pgm->chip_erase = stk600_xprog_chip_erase;
+    pgm->mem_crc = stk600_xprog_mem_crc;
 }
 
 
@@ -4395,7 +4457,9 @@ static void stk600_setup_isp(PROGRAMMER * pgm)
     pgm->paged_load = stk500v2_paged_load;
     pgm->paged_write = stk500v2_paged_write;
     pgm->page_erase = stk500v2_page_erase;
+    pgm->paged_erase_write = NULL;
     pgm->chip_erase = stk500v2_chip_erase;
+    pgm->mem_crc = NULL;
 }
 
 const char stk500v2_desc[] = "Atmel STK500 Version 2.x firmware";
@@ -303,6 +303,10 @@ static int cmd_dump(PROGRAMMER * pgm, struct avrpart * p,
   if ((addr + len) > maxsize)
     len = maxsize - addr;
 
+  /* some programmers read whole pages into mem->buf */
+  if (avr_mem_alloc(mem) < 0)
+    return -1;
+
   buf = malloc(len);
   if (buf == NULL) {
     fprintf(stderr, "%s (dump): out of memory\n", progname);
@@ -22,8 +22,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <limits.h>
 #include <string.h>
 #include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include "avrdude.h"
 #include "avr.h"
@@ -32,6 +35,45 @@
 #include "fileio.h"
 #include "update.h"
 
+/*
+ * Parse the address range of memtype@start,len or memtype@start-end
+ * and cut it off.
+ */
+static int parse_range(char * memtype, UPDATE * upd)
+{
+  char * cp, * e;
+  unsigned long start, n;
+
+  cp = strchr(memtype, '@');
+  if (cp == NULL)
+    return 0;
+  *cp++ = 0;
+
+  start = strtoul(cp, &e, 0);
+  if (e == cp || (*e != ',' && *e != '-'))
+    goto bad;
+  cp = e + 1;
+  n = strtoul(cp, &e, 0);
+  if (e == cp || *e != 0)
+    goto bad;
+  if (cp[-1] == '-') {
+    if (n < start)
+      goto bad;
+    n = n - start + 1;
+  }
+  if (n == 0 || start > INT_MAX || n > INT_MAX - start)
+    goto bad;
+
+  upd->start = start;
+  upd->len = n;
+  return 0;
+
+bad:
+  fprintf(stderr, "%s: invalid address range in update specification\n",
+          progname);
+  return -1;
+}
+
 UPDATE * parse_op(char * s)
 {
   char buf[1024];
@@ -45,6 +87,10 @@ UPDATE * parse_op(char * s)
     fprintf(stderr, "%s: out of memory\n", progname);
     exit(1);
   }
+  upd->start = 0;
+  upd->len = 0;
+  upd->image = NULL;
+  upd->size = 0;
 
   i = 0;
   p = s;
@@ -71,6 +117,11 @@ UPDATE * parse_op(char * s)
     exit(1);
   }
   strcpy(upd->memtype, buf);
+  if (parse_range(upd->memtype, upd) < 0) {
+    free(upd->memtype);
+    free(upd);
+    return NULL;
+  }
 
   p++;
   if (*p == 'r') {
@@ -139,6 +190,7 @@ UPDATE * parse_op(char * s)
       case 'd': upd->format = FMT_DEC; break;
       case 'h': upd->format = FMT_HEX; break;
       case 'o': upd->format = FMT_OCT; break;
+      case 'B': upd->format = FMT_BUNDLE; break;
       default:
         fprintf(stderr, "%s: invalid file format '%s' in update specifier\n",
                 progname, p);
@@ -157,6 +209,13 @@ UPDATE * parse_op(char * s)
   memcpy(upd->filename, cp, fnlen);
   upd->filename[fnlen] = 0;
 
+  if (upd->len != 0 && upd->format == FMT_BUNDLE) {
+    fprintf(stderr, "%s: address ranges can't be used with image bundles\n",
+            progname);
+    free_update(upd);
+    return NULL;
+  }
+
   return upd;
 }
 
@@ -177,6 +236,8 @@ UPDATE * dup_update(UPDATE * upd)
   else
     u->memtype = NULL;
   u->filename = strdup(upd->filename);
+  u->image = NULL;
+  u->size = 0;
 
   return u;
 }
@@ -195,6 +256,10 @@ UPDATE * new_update(int op, char * memtype, int filefmt, char * filename)
   u->filename = strdup(filename);
   u->op = op;
   u->format = filefmt;
+  u->start = 0;
+  u->len = 0;
+  u->image = NULL;
+  u->size = 0;
 
   return u;
 }
@@ -210,15 +275,651 @@ void free_update(UPDATE * u)
 	    free(u->filename);
 	    u->filename = NULL;
 	}
+	if(u->image != NULL) {
+	    avr_free_part(u->image);
+	    u->image = NULL;
+	}
 	free(u);
     }
 }
 
 
+static LISTID patches;
+
+/*
+ * Parse a patch specification
+ *
+ *   memtype:addr:len:encoding:value
+ *
+ * where value is a number, +file (a counter kept in file as a decimal
+ * number, advanced by update_commit_patches()), or @file (raw bytes
+ * taken from file).  A numeric value is encoded as
+ *
+ *   b  binary, little-endian
+ *   B  binary, big-endian
+ *   d  ASCII decimal, zero-padded
+ *   h  ASCII hexadecimal, zero-padded
+ *
+ * The encoded bytes are computed here, so the same bytes are used for
+ * writing and verifying.
+ */
+PATCH * parse_patch(char * s)
+{
+  PATCH * pt;
+  char * field[4], * src, * e, * dup, * cp;
+  char buf[32];
+  unsigned long v;
+  FILE * f;
+  int i, n;
+
+  dup = strdup(s);
+  pt = calloc(1, sizeof(PATCH));
+  if (dup == NULL || pt == NULL) {
+    fprintf(stderr, "%s: out of memory\n", progname);
+    exit(1);
+  }
+
+  cp = dup;
+  for (i = 0; i < 4; i++) {
+    field[i] = cp;
+    cp = strchr(cp, ':');
+    if (cp == NULL)
+      goto bad;
+    *cp++ = 0;
+  }
+  src = cp;
+
+  pt->memtype = strdup(field[0]);
+  pt->addr = strtoul(field[1], &e, 0);
+  if (*field[1] == 0 || *e != 0)
+    goto bad;
+  pt->len = strtol(field[2], &e, 0);
+  if (*field[2] == 0 || *e != 0 || pt->len <= 0 || pt->len > 256)
+    goto bad;
+  if (strlen(field[3]) != 1 || strchr("bBdh", field[3][0]) == NULL)
+    goto bad;
+
+  pt->data = malloc(pt->len);
+  if (pt->memtype == NULL || pt->data == NULL) {
+    fprintf(stderr, "%s: out of memory\n", progname);
+    exit(1);
+  }
+
+  if (*src == '@') {
+    /* raw bytes from a file */
+    f = fopen(src + 1, "rb");
+    if (f == NULL) {
+      fprintf(stderr, "%s: can't open patch data file %s: %s\n",
+              progname, src + 1, strerror(errno));
+      goto fail;
+    }
+    n = fread(pt->data, 1, pt->len, f);
+    fclose(f);
+    if (n != pt->len) {
+      fprintf(stderr, "%s: patch data file %s is shorter than %d bytes\n",
+              progname, src + 1, pt->len);
+      goto fail;
+    }
+    free(dup);
+    return pt;
+  }
+
+  if (*src == '+') {
+    /* counter file */
+    pt->counterfile = strdup(src + 1);
+    f = fopen(src + 1, "r");
+    if (f == NULL) {
+      fprintf(stderr, "%s: can't open counter file %s: %s\n",
+              progname, src + 1, strerror(errno));
+      goto fail;
+    }
+    n = fscanf(f, "%lu", &v);
+    fclose(f);
+    if (n != 1) {
+      fprintf(stderr, "%s: counter file %s does not contain a number\n",
+              progname, src + 1);
+      goto fail;
+    }
+  }
+  else {
+    v = strtoul(src, &e, 0);
+    if (*src == 0 || *e != 0)
+      goto bad;
+  }
+  pt->value = v;
+
+  switch (field[3][0]) {
+    case 'b':
+    case 'B':
+      for (i = 0; i < pt->len; i++) {
+        n = field[3][0] == 'b'? i: pt->len - 1 - i;
+        pt->data[n] = i < (int)sizeof(v)? (v >> (8 * i)) & 0xff: 0;
+      }
+      if (pt->len < (int)sizeof(v) && (v >> (8 * pt->len)) != 0)
+        goto toobig;
+      break;
+
+    case 'd':
+    case 'h':
+      if (pt->len > (int)sizeof(buf) - 1) {
+        fprintf(stderr, "%s: ASCII values can be at most %d bytes long "
+                "in patch '%s'\n", progname, (int)sizeof(buf) - 1, s);
+        goto fail;
+      }
+      n = snprintf(buf, sizeof(buf), field[3][0] == 'd'? "%0*lu": "%0*lX",
+                   pt->len, v);
+      if (n != pt->len)
+        goto toobig;
+      memcpy(pt->data, buf, pt->len);
+      break;
+  }
+
+  free(dup);
+  return pt;
+
+toobig:
+  fprintf(stderr, "%s: value %lu does not fit into %d bytes in patch '%s'\n",
+          progname, v, pt->len, s);
+  goto fail;
+
+bad:
+  fprintf(stderr, "%s: invalid patch specification '%s'\n", progname, s);
+fail:
+  free(dup);
+  free(pt->memtype);
+  free(pt->data);
+  free(pt->counterfile);
+  free(pt);
+  return NULL;
+}
+
+
+void update_set_patches(LISTID list)
+{
+  patches = list;
+}
+
+
+/*
+ * Apply all patches for upd's memory to its buffer.  Returns the
+ * number of bytes to process, which grows if a patch lies beyond size.
+ */
+static int update_apply_patches(AVRMEM * mem, UPDATE * upd, int size)
+{
+  LNODEID ln;
+  PATCH * pt;
+
+  if (patches == NULL)
+    return size;
+
+  for (ln=lfirst(patches); ln; ln=lnext(ln)) {
+    pt = ldata(ln);
+    if (strcmp(pt->memtype, upd->memtype) != 0)
+      continue;
+    if (pt->addr + pt->len > (unsigned long)mem->size) {
+      fprintf(stderr,
+              "%s: patch at 0x%lx does not fit into \"%s\" memory\n",
+              progname, pt->addr, mem->desc);
+      return -1;
+    }
+    if (verbose >= 2) {
+      fprintf(stderr, "%s: patching %d bytes of %s at 0x%lx\n",
+              progname, pt->len, mem->desc, pt->addr);
+    }
+    memcpy(mem->buf + pt->addr, pt->data, pt->len);
+    memset(mem->tags + pt->addr, TAG_ALLOCATED, pt->len);
+    if (upd->op == DEVICE_WRITE &&
+        (upd->len == 0 ||
+         ((int)pt->addr < upd->start + upd->len &&
+          (int)(pt->addr + pt->len) > upd->start)))
+      pt->written = 1;
+    if ((int)(pt->addr + pt->len) > size)
+      size = pt->addr + pt->len;
+  }
+
+  return size;
+}
+
+
+/*
+ * All operations succeeded: advance the counters used by patches that
+ * went into a write.
+ */
+int update_commit_patches(void)
+{
+  LNODEID ln;
+  PATCH * pt;
+  FILE * f;
+  int rc;
+
+  if (patches == NULL)
+    return 0;
+
+  rc = 0;
+  for (ln=lfirst(patches); ln; ln=lnext(ln)) {
+    pt = ldata(ln);
+    if (pt->counterfile == NULL || !pt->written)
+      continue;
+    f = fopen(pt->counterfile, "w");
+    if (f == NULL || fprintf(f, "%lu\n", pt->value + 1) < 0 ||
+        fclose(f) != 0) {
+      fprintf(stderr, "%s: can't update counter file %s: %s\n",
+              progname, pt->counterfile, strerror(errno));
+      rc = -1;
+    }
+  }
+
+  return rc;
+}
+
+
+/*
+ * Memories that -U all:r:file:B puts into an image bundle.
+ */
+static int bundle_memory(AVRMEM * m)
+{
+  return strcmp(m->desc, "flash") == 0 ||
+         strcmp(m->desc, "eeprom") == 0 ||
+         strstr(m->desc, "fuse") != NULL ||
+         strncmp(m->desc, "lock", 4) == 0;
+}
+
+
+/*
+ * Whether the file names a and b refer to the same file.
+ */
+static int update_same_file(char * a, char * b)
+{
+  struct stat sta, stb;
+
+  if (strcmp(a, b) == 0)
+    return 1;
+  return stat(a, &sta) == 0 && stat(b, &stb) == 0 && sta.st_ino != 0 &&
+    sta.st_dev == stb.st_dev && sta.st_ino == stb.st_ino;
+}
+
+
+/*
+ * Whether the file of the operation at ln is written by a read
+ * operation before it, so it cannot be loaded ahead of time.
+ */
+static int update_produced(LISTID updates, LNODEID ln)
+{
+  UPDATE * upd, * prev;
+  LNODEID ln2;
+
+  upd = ldata(ln);
+  if (strcmp(upd->filename, "-") == 0)
+    return 0;
+
+  for (ln2=lfirst(updates); ln2 != ln; ln2=lnext(ln2)) {
+    prev = ldata(ln2);
+    if (prev->op == DEVICE_READ && strcmp(prev->filename, "-") != 0 &&
+        update_same_file(prev->filename, upd->filename))
+      return 1;
+  }
+
+  return 0;
+}
+
+
+/*
+ * Add name to the list names unless it is there already.
+ */
+static int update_add_name(LISTID names, char * name)
+{
+  LNODEID ln;
+
+  for (ln=lfirst(names); ln; ln=lnext(ln))
+    if (strcmp(ldata(ln), name) == 0)
+      return 0;
+  if ((name = strdup(name)) == NULL) {
+    fprintf(stderr, "%s: out of memory\n", progname);
+    return -1;
+  }
+  ladd(names, name);
+  return 0;
+}
+
+
+/*
+ * The memories bundle filename will hold after the read operations
+ * before ln: those already in it, and those the reads add.
+ */
+static int update_produced_bundle(LISTID updates, LNODEID ln, LISTID names)
+{
+  UPDATE * upd, * prev;
+  LNODEID ln2;
+  FILE * f;
+
+  upd = ldata(ln);
+  if ((f = fopen(upd->filename, "rb")) != NULL) {
+    fclose(f);
+    if (fileio_bundle_list(upd->filename, names) < 0)
+      return -1;
+  }
+  for (ln2=lfirst(updates); ln2 != ln; ln2=lnext(ln2)) {
+    prev = ldata(ln2);
+    if (prev->op == DEVICE_READ && prev->format == FMT_BUNDLE &&
+        update_same_file(prev->filename, upd->filename) &&
+        update_add_name(names, prev->memtype) < 0)
+      return -1;
+  }
+
+  return 0;
+}
+
+
+/*
+ * Insert a new operation for memtype before ln.
+ */
+static void update_insert(LISTID updates, LNODEID ln, UPDATE * upd, int op,
+                          char * memtype)
+{
+  lins_ln(updates, ln, new_update(op, memtype, upd->format, upd->filename));
+}
+
+
+/*
+ * Replace each "all" memory operation on an image bundle by one
+ * operation per memory: for reads, every flash, EEPROM, fuse and lock
+ * memory of the part; for writes and verifies, every memory in the
+ * bundle, including those that earlier reads put there.  Lock bits go
+ * last, and a verify that -U all:w implies is done memory by memory
+ * right after each write, so setting the lock bits does not prevent
+ * verifying the other memories.
+ */
+int update_expand_bundles(struct avrpart * p, LISTID updates)
+{
+  LNODEID ln, next, ln2;
+  UPDATE * upd, * vfy;
+  LISTID names;
+  AVRMEM * m;
+  char * name;
+  int lock;
+
+  for (ln=lfirst(updates); ln; ln=next) {
+    next = lnext(ln);
+    upd = ldata(ln);
+    if (upd->format != FMT_BUNDLE || strcmp(upd->memtype, "all") != 0)
+      continue;
+
+    names = lcreat(NULL, 0);
+    if (upd->op == DEVICE_READ) {
+      for (ln2=lfirst(p->mem); ln2; ln2=lnext(ln2)) {
+        m = ldata(ln2);
+        if (bundle_memory(m))
+          ladd(names, strdup(m->desc));
+      }
+    }
+    else if (update_produced(updates, ln)) {
+      /* written by an earlier read; can't be looked into yet */
+      if (update_produced_bundle(updates, ln, names) < 0) {
+        ldestroy_cb(names, free);
+        return -1;
+      }
+    }
+    else if (fileio_bundle_list(upd->filename, names) < 0) {
+      ldestroy_cb(names, free);
+      return -1;
+    }
+
+    /* fold in the verify that -U all:w implies */
+    vfy = NULL;
+    if (upd->op == DEVICE_WRITE && next != NULL) {
+      vfy = ldata(next);
+      if (vfy->op != DEVICE_VERIFY || vfy->format != FMT_BUNDLE ||
+          strcmp(vfy->memtype, "all") != 0 ||
+          strcmp(vfy->filename, upd->filename) != 0)
+        vfy = NULL;
+    }
+
+    for (lock = 0; lock < 2; lock++) {
+      for (ln2=lfirst(names); ln2; ln2=lnext(ln2)) {
+        name = ldata(ln2);
+        if ((strncmp(name, "lock", 4) == 0) != lock)
+          continue;
+        update_insert(updates, ln, upd, upd->op, name);
+        if (vfy != NULL)
+          update_insert(updates, ln, upd, DEVICE_VERIFY, name);
+      }
+    }
+
+    lrmv_ln(updates, ln);
+    free_update(upd);
+    if (vfy != NULL) {
+      ln = next;
+      next = lnext(ln);
+      lrmv_ln(updates, ln);
+      free_update(vfy);
+    }
+    ldestroy_cb(names, free);
+  }
+
+  return 0;
+}
+
+
+/*
+ * Parse the input files of all write and verify operations before the
+ * programmer is set up, so a bad file is reported right away.  Files
+ * that an earlier read operation writes are left to do_op().  Each
+ * file is parsed into a private copy of the part that do_op() takes
+ * the memory contents from later; operations that name the same file
+ * and memory as an earlier one share its contents.
+ */
+int update_preload(struct avrpart * p, LISTID updates)
+{
+  LNODEID ln, ln2;
+  UPDATE * upd, * prev;
+  int rc;
+
+  for (ln=lfirst(updates); ln; ln=lnext(ln)) {
+    upd = ldata(ln);
+    if (upd->op != DEVICE_WRITE && upd->op != DEVICE_VERIFY)
+      continue;
+    if (avr_locate_mem(p, upd->memtype) == NULL)
+      continue; /* reported by do_op() */
+    if (update_produced(updates, ln))
+      continue; /* loaded by do_op() once the read has happened */
+
+    if (strcmp(upd->filename, "-") != 0) {
+      for (ln2=lfirst(updates); ln2 != ln; ln2=lnext(ln2)) {
+        prev = ldata(ln2);
+        if (prev->image != NULL &&
+            prev->format == upd->format &&
+            strcmp(prev->filename, upd->filename) == 0 &&
+            strcmp(prev->memtype, upd->memtype) == 0)
+          break;
+      }
+      if (ln2 != ln) {
+        upd->image = avr_dup_part(prev->image);
+        upd->size = prev->size;
+        continue;
+      }
+    }
+
+    if (quell_progress < 2) {
+      fprintf(stderr,
+            "%s: reading input file \"%s\"\n",
+            progname,
+            strcmp(upd->filename, "-")==0 ? "<stdin>" : upd->filename);
+    }
+    upd->image = avr_dup_part(p);
+    rc = fileio(FIO_READ, upd->filename, upd->format, upd->image,
+                upd->memtype, -1);
+    if (rc < 0) {
+      fprintf(stderr, "%s: read from file '%s' failed\n",
+              progname, upd->filename);
+      return -1;
+    }
+    upd->size = rc;
+  }
+
+  return 0;
+}
+
+
+/*
+ * Whether the loaded image m supplies every byte of the memory.
+ */
+static int update_covers(AVRMEM * m)
+{
+  int i;
+
+  for (i = 0; i < m->size; i++)
+    if ((m->tags[i] & TAG_ALLOCATED) == 0)
+      return 0;
+
+  return 1;
+}
+
+/*
+ * Decide between erasing each page before writing it and a single
+ * chip erase for the flash writes in updates, from the preloaded
+ * input files.  A chip erase is only considered if it does not lose
+ * anything the page erases would keep: the input files must supply
+ * every byte of the flash and the EEPROM, and the lock bits, which a
+ * chip erase clears, must be written too.  The costs are the part's
+ * chip_erase_delay and the flash max_write_delay per page; without
+ * them the page erases are kept.  The programmer's round trip per
+ * page erase is not counted, so this errs towards page erases.
+ *
+ * Returns 1 if a chip erase is cheaper, 0 otherwise.
+ */
+int update_plan_erase(struct avrpart * p, LISTID updates)
+{
+  LNODEID ln;
+  UPDATE * upd;
+  AVRMEM * m;
+  int flash = 0, app = 0, boot = 0, eeprom = 0, lock = 0;
+  int i, pages = 0;
+  long pagecost, chipcost;
+
+  for (ln=lfirst(updates); ln; ln=lnext(ln)) {
+    upd = ldata(ln);
+    if (upd->op != DEVICE_WRITE)
+      continue;
+    if (upd->image == NULL || upd->len != 0)
+      return 0;
+    if (strncmp(upd->memtype, "lock", 4) == 0) {
+      lock = 1;
+      continue;
+    }
+    m = avr_locate_mem(upd->image, upd->memtype);
+    if (m == NULL)
+      return 0;
+    if (strcmp(upd->memtype, "eeprom") == 0) {
+      eeprom |= update_covers(m);
+      continue;
+    }
+    if (strcmp(upd->memtype, "flash") == 0)
+      flash |= update_covers(m);
+    else if (strcmp(upd->memtype, "application") == 0)
+      app |= update_covers(m);
+    else if (strcmp(upd->memtype, "boot") == 0)
+      boot |= update_covers(m);
+    else if (strcmp(upd->memtype, "apptable") != 0)
+      continue;
+
+    if (m->page_size <= 0)
+      return 0;
+    for (i = 0; i < upd->size && i < m->size; i++) {
+      if (m->tags[i] & TAG_ALLOCATED) {
+        pages++;
+        i += m->page_size - 1 - i % m->page_size;
+      }
+    }
+  }
+
+  if (!flash && !(app && boot))
+    return 0;
+  if (!eeprom && avr_locate_mem(p, "eeprom") != NULL)
+    return 0;
+  if (!lock && avr_locate_mem(p, "lock") != NULL)
+    return 0;
+
+  m = avr_locate_mem(p, "flash");
+  if (m == NULL || m->max_write_delay <= 0 || p->chip_erase_delay <= 0) {
+    if (verbose >= 2) {
+      fprintf(stderr, "%s: no erase timing for %s, erasing pages\n",
+              progname, p->desc);
+    }
+    return 0;
+  }
+
+  pagecost = (long)pages * m->max_write_delay;
+  chipcost = p->chip_erase_delay;
+  if (verbose >= 2) {
+    fprintf(stderr,
+            "%s: erasing %d pages takes about %ld ms, a chip erase %ld ms\n",
+            progname, pages, pagecost / 1000, chipcost / 1000);
+  }
+
+  return chipcost < pagecost;
+}
+
+
+/*
+ * Get the input file contents of a write or verify operation into
+ * the part's memory, from the preloaded image if there is one.
+ */
+static int update_load(struct avrpart * p, AVRMEM * mem, UPDATE * upd)
+{
+  int rc;
+
+  if (upd->image == NULL) {
+    if (upd->op == DEVICE_WRITE && quell_progress < 2) {
+      fprintf(stderr,
+            "%s: reading input file \"%s\"\n",
+            progname,
+            strcmp(upd->filename, "-")==0 ? "<stdin>" : upd->filename);
+    }
+    rc = fileio(FIO_READ, upd->filename, upd->format, p, upd->memtype, -1);
+    if (rc < 0) {
+      fprintf(stderr, "%s: read from file '%s' failed\n",
+              progname, upd->filename);
+      return -1;
+    }
+    return update_apply_patches(mem, upd, rc);
+  }
+
+  avr_mem_share(mem, avr_locate_mem(upd->image, upd->memtype));
+  avr_free_part(upd->image);
+  upd->image = NULL;
+
+  /* programmers may modify the buffer while writing */
+  if (avr_mem_unshare(mem) < 0)
+    return -1;
+
+  return update_apply_patches(mem, upd, upd->size);
+}
+
+
+/*
+ * Restrict the data loaded for a write or verify to upd's address
+ * range.  Returns the number of bytes to process.
+ */
+static int update_clip(AVRMEM * mem, UPDATE * upd, int size)
+{
+  if (upd->len == 0)
+    return size;
+
+  memset(mem->tags, 0, upd->start);
+  memset(mem->tags + upd->start + upd->len, 0,
+         mem->size - upd->start - upd->len);
+
+  if (size > upd->start + upd->len)
+    size = upd->start + upd->len;
+  return size;
+}
+
+
 int do_op(PROGRAMMER * pgm, struct avrpart * p, UPDATE * upd, enum updateflags flags)
 {
   struct avrpart * v;
-  AVRMEM * mem;
+  AVRMEM * mem, * vmem;
+  struct fiostream * stream;
   int size, vsize;
   int rc;
 
@@ -229,6 +930,14 @@ int do_op(PROGRAMMER * pgm, struct avrpart * p, UPDATE * upd, enum updateflags f
     return -1;
   }
 
+  if (upd->len != 0 && upd->start + upd->len > mem->size) {
+    fprintf(stderr,
+            "%s: address range 0x%x..0x%x exceeds %s memory size %d\n",
+            progname, upd->start, upd->start + upd->len - 1,
+            mem->desc, mem->size);
+    return -1;
+  }
+
   if (upd->op == DEVICE_READ) {
     /*
      * read out the specified device memory and write it to a file
@@ -237,11 +946,40 @@ int do_op(PROGRAMMER * pgm, struct avrpart * p, UPDATE * upd, enum updateflags f
       fprintf(stderr, "%s: reading %s memory:\n",
             progname, mem->desc);
 	  }
+    /*
+     * if an address range is given, only read the pages it covers;
+     * otherwise, if the file format permits, write the file while
+     * reading
+     */
+    stream = NULL;
+    v = NULL;
+    if (upd->len != 0) {
+      v = avr_dup_part(p);
+      vmem = avr_locate_mem(v, upd->memtype);
+      if (avr_mem_unshare(vmem) < 0) {
+        avr_free_part(v);
+        return -1;
+      }
+      memset(vmem->tags, 0, vmem->size);
+      memset(vmem->tags + upd->start, TAG_ALLOCATED, upd->len);
+    }
+    else if (fileio_streamable(upd->format)) {
+      stream = fileio_stream_open(upd->filename, upd->format,
+                                  p, upd->memtype);
+      if (stream == NULL)
+        return -1;
+      avr_set_read_sink(fileio_stream_put, stream);
+    }
     report_progress(0,1,"Reading");
-    rc = avr_read(pgm, p, upd->memtype, 0);
+    rc = avr_read(pgm, p, upd->memtype, v);
+    avr_set_read_sink(NULL, NULL);
+    if (v != NULL)
+      avr_free_part(v);
     if (rc < 0) {
       fprintf(stderr, "%s: failed to read all of %s memory, rc=%d\n",
               progname, mem->desc, rc);
+      if (stream != NULL)
+        fileio_stream_close(stream, -1);
       return -1;
     }
     report_progress(1,1,NULL);
@@ -253,7 +991,13 @@ int do_op(PROGRAMMER * pgm, struct avrpart * p, UPDATE * upd, enum updateflags f
             progname,
             strcmp(upd->filename, "-")==0 ? "<stdout>" : upd->filename);
     }
-    rc = fileio(FIO_WRITE, upd->filename, upd->format, p, upd->memtype, size);
+    if (stream != NULL)
+      rc = fileio_stream_close(stream, size);
+    else if (upd->len != 0)
+      rc = fileio_range(FIO_WRITE, upd->filename, upd->format, p,
+                        upd->memtype, upd->start, upd->len);
+    else
+      rc = fileio(FIO_WRITE, upd->filename, upd->format, p, upd->memtype, size);
     if (rc < 0) {
       fprintf(stderr, "%s: write to file '%s' failed\n",
               progname, upd->filename);
@@ -265,19 +1009,10 @@ int do_op(PROGRAMMER * pgm, struct avrpart * p, UPDATE * upd, enum updateflags f
      * write the selected device memory using data from a file; first
      * read the data from the specified file
      */
-    if (quell_progress < 2) {
-      fprintf(stderr,
-            "%s: reading input file \"%s\"\n",
-            progname,
-            strcmp(upd->filename, "-")==0 ? "<stdin>" : upd->filename);
-    }
-    rc = fileio(FIO_READ, upd->filename, upd->format, p, upd->memtype, -1);
-    if (rc < 0) {
-      fprintf(stderr, "%s: read from file '%s' failed\n",
-              progname, upd->filename);
+    rc = update_load(p, mem, upd);
+    if (rc < 0)
       return -1;
-    }
-    size = rc;
+    size = update_clip(mem, upd, rc);
 
     /*
      * write the buffer contents to the selected memory type
@@ -289,7 +1024,9 @@ int do_op(PROGRAMMER * pgm, struct avrpart * p, UPDATE * upd, enum updateflags f
 
     if (!(flags & UF_NOWRITE)) {
       report_progress(0,1,"Writing");
-      rc = avr_write(pgm, p, upd->memtype, size, (flags & UF_AUTO_ERASE) != 0);
+      rc = avr_write(pgm, p, upd->memtype, size,
+                     ((flags & UF_AUTO_ERASE)? AVR_WRITE_AUTO_ERASE: 0) |
+                     ((flags & UF_ERASED)? AVR_WRITE_ERASED: 0));
       report_progress(1,1,NULL);
     }
     else {
@@ -329,17 +1066,37 @@ int do_op(PROGRAMMER * pgm, struct avrpart * p, UPDATE * upd, enum updateflags f
             progname, mem->desc, upd->filename);
     }
 
-    rc = fileio(FIO_READ, upd->filename, upd->format, p, upd->memtype, -1);
-    if (rc < 0) {
-      fprintf(stderr, "%s: read from file '%s' failed\n",
-              progname, upd->filename);
+    rc = update_load(p, mem, upd);
+    if (rc < 0)
       return -1;
-    }
-    v = avr_dup_part(p);
     size = rc;
     if (quell_progress < 2) {
       fprintf(stderr, "%s: input file %s contains %d bytes\n",
             progname, upd->filename, size);
+    }
+    size = update_clip(mem, upd, size);
+
+    /*
+     * Let the device checksum the memory if it can; read it back only
+     * when the checksums differ.  The checksum always covers the
+     * whole memory, so not for a range.
+     */
+    rc = upd->len != 0? -1: avr_verify_crc(pgm, p, upd->memtype);
+    if (rc == 0) {
+      if (quell_progress < 2) {
+        fprintf(stderr, "%s: %d bytes of %s verified by device CRC\n",
+                progname, size, mem->desc);
+      }
+      pgm->vfy_led(pgm, OFF);
+      return 0;
+    }
+    if (rc > 0 && quell_progress < 2) {
+      fprintf(stderr, "%s: device CRC differs, verifying by reading back\n",
+              progname);
+    }
+
+    v = avr_dup_part(p);
+    if (quell_progress < 2) {
       fprintf(stderr, "%s: reading on-chip %s data:\n",
             progname, mem->desc);
     }
@@ -350,6 +1107,7 @@ int do_op(PROGRAMMER * pgm, struct avrpart * p, UPDATE * upd, enum updateflags f
       fprintf(stderr, "%s: failed to read all of %s memory, rc=%d\n",
               progname, mem->desc, rc);
       pgm->err_led(pgm, ON);
+      avr_free_part(v);
       return -1;
     }
     report_progress (1,1,NULL);
@@ -360,6 +1118,7 @@ int do_op(PROGRAMMER * pgm, struct avrpart * p, UPDATE * upd, enum updateflags f
       fprintf(stderr, "%s: verifying ...\n", progname);
     }
     rc = avr_verify(p, v, upd->memtype, size);
+    avr_free_part(v);
     if (rc < 0) {
       fprintf(stderr, "%s: verification error; content mismatch\n",
               progname);
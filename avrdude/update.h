@@ -32,6 +32,7 @@ enum updateflags {
   UF_NONE = 0,
   UF_NOWRITE = 1,
   UF_AUTO_ERASE = 2,
+  UF_ERASED = 4,                /* chip has just been erased */
 };
 
 
@@ -40,8 +41,26 @@ typedef struct update_t {
   int    op;
   char * filename;
   int    format;
+  int    start;            /* address range to operate on, */
+  int    len;              /* len 0 means the whole memory */
+  struct avrpart * image;  /* input file contents, see update_preload() */
+  int    size;             /* number of bytes in image */
 } UPDATE;
 
+/*
+ * Per-device patch applied to the memory contents before writing,
+ * see parse_patch().
+ */
+typedef struct patch_t {
+  char * memtype;
+  unsigned long addr;
+  int    len;
+  unsigned char * data;   /* the bytes to put there */
+  char * counterfile;     /* counter to advance after success, or NULL */
+  unsigned long value;    /* counter value used */
+  int    written;         /* applied to data written to the device */
+} PATCH;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -51,6 +70,12 @@ extern UPDATE * dup_update(UPDATE * upd);
 extern UPDATE * new_update(int op, char * memtype, int filefmt,
 			   char * filename);
 extern void free_update(UPDATE * upd);
+extern int update_preload(struct avrpart * p, LISTID updates);
+extern int update_expand_bundles(struct avrpart * p, LISTID updates);
+extern int update_plan_erase(struct avrpart * p, LISTID updates);
+extern PATCH * parse_patch(char * s);
+extern void update_set_patches(LISTID patches);
+extern int update_commit_patches(void);
 extern int do_op(PROGRAMMER * pgm, struct avrpart * p, UPDATE * upd,
 		 enum updateflags flags);
 
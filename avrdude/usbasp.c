@@ -119,6 +119,11 @@ struct pdata
   int sckfreq_hz;
   unsigned int capabilities;
   int use_tpi;
+
+  /* where the programmer's address points to after paged accesses */
+  int addr_valid;
+  int addr_function;
+  unsigned int nextaddr;
 };
 
 #define PDATA(pgm) ((struct pdata *)(pgm->cookie))
@@ -170,6 +175,10 @@ static int usbasp_tpi_paged_load(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
 static int usbasp_tpi_paged_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
                                   unsigned int page_size,
                                   unsigned int addr, unsigned int n_bytes);
+static int usbasp_tpi_block_read(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
+                                 unsigned int addr, unsigned int n_bytes);
+static int usbasp_tpi_block_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
+                                  unsigned int addr, unsigned int n_bytes);
 static int usbasp_tpi_set_sck_period(PROGRAMMER *pgm, double sckperiod);
 static int usbasp_tpi_read_byte(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m, unsigned long addr, unsigned char * value);
 static int usbasp_tpi_write_byte(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m, unsigned long addr, unsigned char data);
@@ -228,6 +237,15 @@ static int usbasp_transmit(PROGRAMMER * pgm,
 {
   int nbytes;
 
+  /* (re)connecting resets the firmware's address */
+  if (functionid != USBASP_FUNC_SETLONGADDRESS &&
+      functionid != USBASP_FUNC_TRANSMIT &&
+      functionid != USBASP_FUNC_READFLASH &&
+      functionid != USBASP_FUNC_WRITEFLASH &&
+      functionid != USBASP_FUNC_READEEPROM &&
+      functionid != USBASP_FUNC_WRITEEEPROM)
+    PDATA(pgm)->addr_valid = 0;
+
   if (verbose > 3) {
     fprintf(stderr,
 	    "%s: usbasp_transmit(\"%s\", 0x%02x, 0x%02x, 0x%02x, 0x%02x)\n",
@@ -605,6 +623,8 @@ static int usbasp_initialize(PROGRAMMER * pgm, AVRPART * p)
     pgm->write_byte     = usbasp_tpi_write_byte;
     pgm->paged_write    = usbasp_tpi_paged_write;
     pgm->paged_load     = usbasp_tpi_paged_load;
+    pgm->tpi_block_read = usbasp_tpi_block_read;
+    pgm->tpi_block_write = usbasp_tpi_block_write;
     pgm->set_sck_period	= usbasp_tpi_set_sck_period;
   }
   else
@@ -712,15 +732,266 @@ static int usbasp_spi_chip_erase(PROGRAMMER * pgm, AVRPART * p)
   return 0;
 }
 
+/*
+ * Tell the programmer the address of the next block, unless it
+ * already is there: the firmware advances its address over each
+ * block read or written.
+ */
+static int usbasp_spi_set_address(PROGRAMMER * pgm, int function,
+                                  unsigned int address)
+{
+  unsigned char cmd[4];
+  unsigned char temp[4];
+
+  if (PDATA(pgm)->addr_valid && PDATA(pgm)->addr_function == function &&
+      PDATA(pgm)->nextaddr == address)
+    return 0;
+
+  /* set address (new mode) - if firmware on usbasp support newmode, then they use address from this command */
+  memset(temp, 0, sizeof(temp));
+  cmd[0] = address & 0xFF;
+  cmd[1] = address >> 8;
+  cmd[2] = address >> 16;
+  cmd[3] = address >> 24;
+  if (usbasp_transmit(pgm, 1, USBASP_FUNC_SETLONGADDRESS, cmd, temp, sizeof(temp)) < 0)
+    return -1;
+
+  PDATA(pgm)->addr_valid = 1;
+  PDATA(pgm)->addr_function = function;
+  PDATA(pgm)->nextaddr = address;
+  return 0;
+}
+
+/*
+ * Fill in the request of a READFLASH/WRITEFLASH (or EEPROM) block.
+ */
+static void usbasp_spi_block_cmd(unsigned char * cmd, unsigned char receive,
+                                 unsigned int address, unsigned int page_size,
+                                 unsigned char blockflags)
+{
+  /* the address is also sent for firmware without newmode, which
+     ignores SETLONGADDRESS */
+  cmd[0] = address & 0xFF;
+  cmd[1] = address >> 8;
+  if (receive) {
+    // for compatibility - previous version of usbasp.c doesn't initialize this fields (firmware ignore it)
+    cmd[2] = 0;
+    cmd[3] = 0;
+  } else {
+    cmd[2] = page_size & 0xFF;
+    cmd[3] = (blockflags & 0x0F) + ((page_size & 0xF00) >> 4); //TP: Mega128 fix
+  }
+}
+
+#ifdef USE_LIBUSB_1_0
+
+/*
+ * Number of block transfers usbasp_spi_blocks() keeps queued.
+ */
+#define USBASP_XFERS 4
+
+static void LIBUSB_CALL usbasp_xfer_done(struct libusb_transfer * t)
+{
+  *(int *)t->user_data = 1;
+}
+
+/*
+ * Cancel the transfers of usbasp_spi_blocks() that are still queued,
+ * wait for libusb to give them back, and free them.  A transfer that
+ * does not come back while event handling keeps failing is left to
+ * libusb, with its completion flag moved off the caller's stack.
+ */
+static void usbasp_spi_reap(struct libusb_transfer ** xfer, int * done)
+{
+  static int lost;
+  int i, tries;
+
+  for (i = 0; i < USBASP_XFERS; i++)
+    if (!done[i])
+      libusb_cancel_transfer(xfer[i]);
+
+  for (i = 0; i < USBASP_XFERS; i++) {
+    tries = 0;
+    while (!done[i] &&
+           (libusb_handle_events_completed(ctx, &done[i]) >= 0 || ++tries < 10))
+      ;
+    if (done[i])
+      libusb_free_transfer(xfer[i]);
+    else
+      xfer[i]->user_data = &lost;
+  }
+}
+
+/*
+ * Transfer n_bytes at buffer in blocks of blocksize, as asynchronous
+ * control transfers, so the next blocks are already queued while the
+ * programmer is busy with the current one.
+ */
+static int usbasp_spi_blocks(PROGRAMMER * pgm, unsigned char receive,
+                             int function, unsigned char * buffer,
+                             unsigned int address, int n_bytes,
+                             int blocksize, unsigned int page_size)
+{
+  struct libusb_transfer * xfer[USBASP_XFERS];
+  int done[USBASP_XFERS];
+  unsigned char cmd[4];
+  unsigned char blockflags;
+  int nblocks, sent, recvd, slot, n, i, r;
+  int rc = 0;
+
+  nblocks = (n_bytes + blocksize - 1) / blocksize;
+
+  for (i = 0; i < USBASP_XFERS; i++) {
+    xfer[i] = libusb_alloc_transfer(0);
+    if (xfer[i] == NULL ||
+        (xfer[i]->buffer = malloc(LIBUSB_CONTROL_SETUP_SIZE + blocksize)) == NULL) {
+      fprintf(stderr, "%s: usbasp_spi_blocks(): out of memory\n", progname);
+      for (; i >= 0; i--)
+        if (xfer[i] != NULL)
+          libusb_free_transfer(xfer[i]);
+      return -1;
+    }
+    xfer[i]->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+    done[i] = 1;
+  }
+
+  for (sent = recvd = 0; recvd < nblocks; recvd++) {
+    /* keep the queue filled */
+    while (rc == 0 && sent < nblocks && sent - recvd < USBASP_XFERS) {
+      slot = sent % USBASP_XFERS;
+      n = n_bytes - sent * blocksize;
+      if (n > blocksize)
+        n = blocksize;
+
+      blockflags = 0;
+      if (sent == 0)
+        blockflags |= USBASP_BLOCKFLAG_FIRST;
+      if (sent == nblocks - 1)
+        blockflags |= USBASP_BLOCKFLAG_LAST;
+      usbasp_spi_block_cmd(cmd, receive, address + sent * blocksize,
+                           page_size, blockflags);
+
+      if (verbose > 3)
+        fprintf(stderr,
+                "%s: usbasp_spi_blocks(\"%s\", 0x%02x, 0x%02x, 0x%02x, 0x%02x)\n",
+                progname, usbasp_get_funcname(function),
+                cmd[0], cmd[1], cmd[2], cmd[3]);
+
+      libusb_fill_control_setup(xfer[slot]->buffer,
+                                (LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | (receive << 7)) & 0xff,
+                                function,
+                                (cmd[1] << 8) | cmd[0],
+                                (cmd[3] << 8) | cmd[2],
+                                n);
+      if (!receive)
+        memcpy(xfer[slot]->buffer + LIBUSB_CONTROL_SETUP_SIZE,
+               buffer + sent * blocksize, n);
+      libusb_fill_control_transfer(xfer[slot], PDATA(pgm)->usbhandle,
+                                   xfer[slot]->buffer, usbasp_xfer_done,
+                                   &done[slot], 5000);
+      xfer[slot]->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+      done[slot] = 0;
+      r = libusb_submit_transfer(xfer[slot]);
+      if (r < 0) {
+        fprintf(stderr, "%s: error: usbasp_spi_blocks: %s\n",
+                progname, strerror(libusb_to_errno(r)));
+        done[slot] = 1;      /* never queued */
+        rc = -1;
+        break;
+      }
+      sent++;
+    }
+    if (recvd == sent)
+      break;
+
+    /* wait for the oldest block */
+    slot = recvd % USBASP_XFERS;
+    while (!done[slot]) {
+      r = libusb_handle_events_completed(ctx, &done[slot]);
+      if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED) {
+        fprintf(stderr, "%s: error: usbasp_spi_blocks: %s\n",
+                progname, strerror(libusb_to_errno(r)));
+        usbasp_spi_reap(xfer, done);
+        return -1;
+      }
+    }
+
+    n = n_bytes - recvd * blocksize;
+    if (n > blocksize)
+      n = blocksize;
+    if (xfer[slot]->status == LIBUSB_TRANSFER_CANCELLED)
+      continue;
+    if (xfer[slot]->status != LIBUSB_TRANSFER_COMPLETED ||
+        xfer[slot]->actual_length != n) {
+      if (rc == 0)
+        fprintf(stderr, "%s: error: wrong count at %s %x\n",
+                progname, receive? "reading": "writing",
+                xfer[slot]->actual_length);
+      rc = -3;
+    } else if (receive) {
+      memcpy(buffer + recvd * blocksize,
+             libusb_control_transfer_get_data(xfer[slot]), n);
+    }
+
+    if (rc < 0) {
+      /* drop the rest of the queue */
+      for (i = recvd + 1; i < sent; i++)
+        libusb_cancel_transfer(xfer[i % USBASP_XFERS]);
+    }
+  }
+
+  for (i = 0; i < USBASP_XFERS; i++)
+    libusb_free_transfer(xfer[i]);
+
+  return rc;
+}
+
+#else
+
+/*
+ * Transfer n_bytes at buffer in blocks of blocksize.
+ */
+static int usbasp_spi_blocks(PROGRAMMER * pgm, unsigned char receive,
+                             int function, unsigned char * buffer,
+                             unsigned int address, int n_bytes,
+                             int blocksize, unsigned int page_size)
+{
+  int n;
+  unsigned char cmd[4];
+  unsigned char blockflags = USBASP_BLOCKFLAG_FIRST;
+
+  while (n_bytes) {
+    if (n_bytes <= blocksize) {
+      blocksize = n_bytes;
+      blockflags |= USBASP_BLOCKFLAG_LAST;
+    }
+    n_bytes -= blocksize;
+
+    usbasp_spi_block_cmd(cmd, receive, address, page_size, blockflags);
+    blockflags = 0;
+
+    n = usbasp_transmit(pgm, receive, function, cmd, buffer, blocksize);
+
+    if (n != blocksize) {
+      fprintf(stderr, "%s: error: wrong count at %s %x\n",
+	      progname, receive? "reading": "writing", n);
+      return -3;
+    }
+
+    buffer += blocksize;
+    address += blocksize;
+  }
+
+  return 0;
+}
+
+#endif
+
 static int usbasp_spi_paged_load(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
                                  unsigned int page_size,
                                  unsigned int address, unsigned int n_bytes)
 {
-  int n;
-  unsigned char cmd[4];
-  int wbytes = n_bytes;
   int blocksize;
-  unsigned char *buffer = m->buf + address;
   int function;
 
   if (verbose > 2)
@@ -743,40 +1014,13 @@ static int usbasp_spi_paged_load(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
      blocksize = USBASP_READBLOCKSIZE;
   }
 
-  while (wbytes) {
-    if (wbytes <= blocksize) {
-      blocksize = wbytes;
-    }
-    wbytes -= blocksize;
-
-    /* set address (new mode) - if firmware on usbasp support newmode, then they use address from this command */
-    unsigned char temp[4];
-    memset(temp, 0, sizeof(temp));
-    cmd[0] = address & 0xFF;
-    cmd[1] = address >> 8;
-    cmd[2] = address >> 16;
-    cmd[3] = address >> 24;
-    usbasp_transmit(pgm, 1, USBASP_FUNC_SETLONGADDRESS, cmd, temp, sizeof(temp));
-
-    /* send command with address (compatibility mode) - if firmware on
-	  usbasp doesn't support newmode, then they use address from this */
-    cmd[0] = address & 0xFF;
-    cmd[1] = address >> 8;
-    // for compatibility - previous version of usbasp.c doesn't initialize this fields (firmware ignore it)
-    cmd[2] = 0;
-    cmd[3] = 0;
-
-    n = usbasp_transmit(pgm, 1, function, cmd, buffer, blocksize);
-
-    if (n != blocksize) {
-      fprintf(stderr, "%s: error: wrong reading bytes %x\n",
-	      progname, n);
-      return -3;
-    }
-
-    buffer += blocksize;
-    address += blocksize;
+  if (usbasp_spi_set_address(pgm, function, address) < 0 ||
+      usbasp_spi_blocks(pgm, 1, function, m->buf + address, address,
+                        n_bytes, blocksize, page_size) < 0) {
+    PDATA(pgm)->addr_valid = 0;
+    return -3;
   }
+  PDATA(pgm)->nextaddr = address + n_bytes;
 
   return n_bytes;
 }
@@ -785,12 +1029,7 @@ static int usbasp_spi_paged_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
                                   unsigned int page_size,
                                   unsigned int address, unsigned int n_bytes)
 {
-  int n;
-  unsigned char cmd[4];
-  int wbytes = n_bytes;
   int blocksize;
-  unsigned char *buffer = m->buf + address;
-  unsigned char blockflags = USBASP_BLOCKFLAG_FIRST;
   int function;
 
   if (verbose > 2)
@@ -813,46 +1052,13 @@ static int usbasp_spi_paged_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
      blocksize = USBASP_WRITEBLOCKSIZE;
   }
 
-  while (wbytes) {
-
-    if (wbytes <= blocksize) {
-      blocksize = wbytes;
-      blockflags |= USBASP_BLOCKFLAG_LAST;
-    }
-    wbytes -= blocksize;
-
-
-    /* set address (new mode) - if firmware on usbasp support newmode, then
-      they use address from this command */
-    unsigned char temp[4];
-    memset(temp, 0, sizeof(temp));
-    cmd[0] = address & 0xFF;
-    cmd[1] = address >> 8;
-    cmd[2] = address >> 16;
-    cmd[3] = address >> 24;
-    usbasp_transmit(pgm, 1, USBASP_FUNC_SETLONGADDRESS, cmd, temp, sizeof(temp));
-
-    /* normal command - firmware what support newmode - use address from previous command,
-      firmware what doesn't support newmode - ignore previous command and use address from this command */
-
-    cmd[0] = address & 0xFF;
-    cmd[1] = address >> 8;
-    cmd[2] = page_size & 0xFF;
-    cmd[3] = (blockflags & 0x0F) + ((page_size & 0xF00) >> 4); //TP: Mega128 fix
-    blockflags = 0;
-
-    n = usbasp_transmit(pgm, 0, function, cmd, buffer, blocksize);
-
-    if (n != blocksize) {
-      fprintf(stderr, "%s: error: wrong count at writing %x\n",
-	      progname, n);
-      return -3;        
-    }
-
-
-    buffer += blocksize;
-    address += blocksize;
+  if (usbasp_spi_set_address(pgm, function, address) < 0 ||
+      usbasp_spi_blocks(pgm, 0, function, m->buf + address, address,
+                        n_bytes, blocksize, page_size) < 0) {
+    PDATA(pgm)->addr_valid = 0;
+    return -3;
   }
+  PDATA(pgm)->nextaddr = address + n_bytes;
 
   return n_bytes;
 }
@@ -1068,8 +1274,12 @@ static int usbasp_tpi_chip_erase(PROGRAMMER * pgm, AVRPART * p)
   return 0;
 }
 
-static int usbasp_tpi_paged_load(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
-                                 unsigned int page_size,
+/*
+ * Block read/write: stream a whole range through the programmer's
+ * TPI_READBLOCK/TPI_WRITEBLOCK commands, the firmware takes care of
+ * NVM busy polling.
+ */
+static int usbasp_tpi_block_read(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
                                  unsigned int addr, unsigned int n_bytes)
 {
   unsigned char cmd[4];
@@ -1079,7 +1289,7 @@ static int usbasp_tpi_paged_load(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
 
 
   if (verbose > 2)
-    fprintf(stderr, "%s: usbasp_tpi_paged_load(\"%s\", 0x%0x, %d)\n",
+    fprintf(stderr, "%s: usbasp_tpi_block_read(\"%s\", 0x%0x, %d)\n",
 	    progname, m->desc, addr, n_bytes);
 
   dptr = addr + m->buf;
@@ -1112,8 +1322,7 @@ static int usbasp_tpi_paged_load(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
   return n_bytes;
 }
 
-static int usbasp_tpi_paged_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
-                                  unsigned int page_size,
+static int usbasp_tpi_block_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
                                   unsigned int addr, unsigned int n_bytes)
 {
   unsigned char cmd[4];
@@ -1123,7 +1332,7 @@ static int usbasp_tpi_paged_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
 
 
   if (verbose > 2)
-    fprintf(stderr, "%s: usbasp_tpi_paged_write(\"%s\", 0x%0x, %d)\n",
+    fprintf(stderr, "%s: usbasp_tpi_block_write(\"%s\", 0x%0x, %d)\n",
 	    progname, m->desc, addr, n_bytes);
 
   sptr = addr + m->buf;
@@ -1162,6 +1371,20 @@ static int usbasp_tpi_paged_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
   return n_bytes;
 }
 
+static int usbasp_tpi_paged_load(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
+                                 unsigned int page_size,
+                                 unsigned int addr, unsigned int n_bytes)
+{
+  return usbasp_tpi_block_read(pgm, p, m, addr, n_bytes);
+}
+
+static int usbasp_tpi_paged_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
+                                  unsigned int page_size,
+                                  unsigned int addr, unsigned int n_bytes)
+{
+  return usbasp_tpi_block_write(pgm, p, m, addr, n_bytes);
+}
+
 static int usbasp_tpi_set_sck_period(PROGRAMMER *pgm, double sckperiod)
 {
   return 0;
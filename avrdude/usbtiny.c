@@ -38,13 +38,26 @@
 #include "config.h"
 #include "usbtiny.h"
 
-#if defined(HAVE_LIBUSB)      // we use LIBUSB to talk to the board
-#if defined(HAVE_USB_H)
+#if defined(HAVE_LIBUSB) || defined(HAVE_LIBUSB_1_0)  // we use LIBUSB to talk to the board
+
+#ifdef HAVE_LIBUSB_1_0
+# define USE_LIBUSB_1_0
+#endif
+
+#if defined(USE_LIBUSB_1_0)
+# if defined(HAVE_LIBUSB_1_0_LIBUSB_H)
+#  include <libusb-1.0/libusb.h>
+# else
+#  include <libusb.h>
+# endif
+#else
+# if defined(HAVE_USB_H)
 #  include <usb.h>
-#elif defined(HAVE_LUSB0_USB_H)
+# elif defined(HAVE_LUSB0_USB_H)
 #  include <lusb0_usb.h>
-#else
+# else
 #  error "libusb needs either <usb.h> or <lusb0_usb.h>"
+# endif
 #endif
 
 #ifndef HAVE_UINT_T
@@ -57,19 +70,64 @@ typedef	unsigned long	ulong_t;
 extern int avr_write_byte_default ( PROGRAMMER* pgm, AVRPART* p,
 				    AVRMEM* mem, ulong_t addr,
 				    unsigned char data );
+#ifdef USE_LIBUSB_1_0
+// Number of chunk reads kept in flight ahead of usbtiny_paged_load()
+#define READAHEAD 4
+
+// Chunk reads queued ahead of the one usbtiny_paged_load() needs next
+struct readahead
+{
+  struct libusb_transfer *xfer[READAHEAD];
+  int done[READAHEAD];
+  unsigned int addr[READAHEAD];
+  int len[READAHEAD];
+  int head, count;        // oldest queued read, number of reads queued
+  int function;           // flash or EEPROM
+  unsigned int nextaddr;  // address of the next chunk to queue
+  unsigned int endaddr;   // end of the memory
+  int chunk;
+};
+#endif
+
 /*
  * Private data for this programmer.
  */
 struct pdata
 {
+#ifdef USE_LIBUSB_1_0
+  libusb_context *ctx;
+  libusb_device_handle *usb_handle;
+  struct readahead ra;
+#else
   usb_dev_handle *usb_handle;
+#endif
   int sck_period;
   int chunk_size;
   int retries;
+  struct timeval busy_until;  // the target is writing a page until then
 };
 
 #define PDATA(pgm) ((struct pdata *)(pgm->cookie))
 
+// One control transfer, for usbtiny_run()
+struct xfer
+{
+  int in;
+  unsigned int requestid;
+  unsigned int val, index;
+  unsigned char *buffer;
+  int buflen;
+  int timeout;
+};
+
+// Most transfers usbtiny_paged_write() collects before running them
+#define MAX_XFERS 16
+
+#ifdef USE_LIBUSB_1_0
+static void usbtiny_readahead_drop (PROGRAMMER * pgm);
+#endif
+static void usbtiny_close (PROGRAMMER * pgm);
+
 // ----------------------------------------------------------------------
 
 static void usbtiny_setup(PROGRAMMER * pgm)
@@ -88,19 +146,82 @@ static void usbtiny_teardown(PROGRAMMER * pgm)
   free(pgm->cookie);
 }
 
+// Remember that the target needs usec to finish writing a page
+static void usbtiny_set_busy (PROGRAMMER * pgm, int usec)
+{
+  struct timeval *t = &PDATA(pgm)->busy_until;
+
+  gettimeofday(t, NULL);
+  t->tv_usec += usec;
+  t->tv_sec += t->tv_usec / 1000000;
+  t->tv_usec %= 1000000;
+}
+
+// Wait for the page write started last to finish.  Rather than
+// sleeping right after starting it, this happens before the next
+// access to the target, so the time in between is not lost.
+static void usbtiny_wait_ready (PROGRAMMER * pgm)
+{
+  struct timeval *t = &PDATA(pgm)->busy_until;
+  struct timeval now;
+  long usec;
+
+  if (t->tv_sec == 0)
+    return;
+  gettimeofday(&now, NULL);
+  usec = (t->tv_sec - now.tv_sec) * 1000000L + (t->tv_usec - now.tv_usec);
+  if (usec > 0)
+    usleep(usec);
+  t->tv_sec = 0;
+}
+
+// Issue one control transfer, returning the number of bytes transferred
+static int usbtiny_transfer (PROGRAMMER * pgm, int in,
+			     unsigned int requestid, unsigned int val, unsigned int index,
+			     unsigned char* buffer, int buflen, int timeout )
+{
+  usbtiny_wait_ready(pgm);
+#ifdef USE_LIBUSB_1_0
+  usbtiny_readahead_drop(pgm);
+  return libusb_control_transfer( PDATA(pgm)->usb_handle,
+				  (in? LIBUSB_ENDPOINT_IN: LIBUSB_ENDPOINT_OUT) |
+				  LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
+				  requestid,
+				  val, index,
+				  buffer, buflen,
+				  timeout);
+#else
+  return usb_control_msg( PDATA(pgm)->usb_handle,
+			  (in? USB_ENDPOINT_IN: USB_ENDPOINT_OUT) |
+			  USB_TYPE_VENDOR | USB_RECIP_DEVICE,
+			  requestid,
+			  val, index,
+			  (char *)buffer, buflen,
+			  timeout);
+#endif
+}
+
+static const char *usbtiny_strerror (int rc)
+{
+#ifdef USE_LIBUSB_1_0
+  return rc < 0? libusb_error_name(rc): "short transfer";
+#else
+  return usb_strerror();
+#endif
+}
+
 // Wrapper for simple usb_control_msg messages
 static int usb_control (PROGRAMMER * pgm,
 			unsigned int requestid, unsigned int val, unsigned int index )
 {
   int nbytes;
-  nbytes = usb_control_msg( PDATA(pgm)->usb_handle,
-			    USB_ENDPOINT_IN | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
-			    requestid,
-			    val, index,           // 2 bytes each of data
-			    NULL, 0,              // no data buffer in control messge
-			    USB_TIMEOUT );        // default timeout
+  nbytes = usbtiny_transfer( pgm, 1,
+			     requestid,
+			     val, index,           // 2 bytes each of data
+			     NULL, 0,              // no data buffer in control messge
+			     USB_TIMEOUT );        // default timeout
   if(nbytes < 0){
-    fprintf(stderr, "\n%s: error: usbtiny_transmit: %s\n", progname, usb_strerror());
+    fprintf(stderr, "\n%s: error: usbtiny_transmit: %s\n", progname, usbtiny_strerror(nbytes));
     return -1;
   }
 
@@ -121,19 +242,18 @@ static int usb_in (PROGRAMMER * pgm,
   timeout = USB_TIMEOUT + (buflen * bitclk) / 1000;
 
   for (i = 0; i < 10; i++) {
-    nbytes = usb_control_msg( PDATA(pgm)->usb_handle,
-			      USB_ENDPOINT_IN | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
-			      requestid,
-			      val, index,
-			      (char *)buffer, buflen,
-			      timeout);
+    nbytes = usbtiny_transfer( pgm, 1,
+			       requestid,
+			       val, index,
+			       buffer, buflen,
+			       timeout);
     if (nbytes == buflen) {
       return nbytes;
     }
     PDATA(pgm)->retries++;
   }
   fprintf(stderr, "\n%s: error: usbtiny_receive: %s (expected %d, got %d)\n",
-          progname, usb_strerror(), buflen, nbytes);
+          progname, usbtiny_strerror(nbytes), buflen, nbytes);
   return -1;
 }
 
@@ -159,21 +279,218 @@ static int usb_out (PROGRAMMER * pgm,
   // figuring the bit-clock time and buffer size and adding to the standard USB timeout.
   timeout = USB_TIMEOUT + (buflen * bitclk) / 1000;
 
-  nbytes = usb_control_msg( PDATA(pgm)->usb_handle,
-			    USB_ENDPOINT_OUT | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
-			    requestid,
-			    val, index,
-			    (char *)buffer, buflen,
-			    timeout);
+  nbytes = usbtiny_transfer( pgm, 0,
+			     requestid,
+			     val, index,
+			     buffer, buflen,
+			     timeout);
   if (nbytes != buflen) {
     fprintf(stderr, "\n%s: error: usbtiny_send: %s (expected %d, got %d)\n",
-	    progname, usb_strerror(), buflen, nbytes);
+	    progname, usbtiny_strerror(nbytes), buflen, nbytes);
     return -1;
   }
 
   return nbytes;
 }
 
+#ifdef USE_LIBUSB_1_0
+
+static void LIBUSB_CALL usbtiny_xfer_done (struct libusb_transfer *t)
+{
+  *(int *)t->user_data = 1;
+}
+
+// Set up an asynchronous version of a control transfer
+static int usbtiny_xfer_fill (PROGRAMMER * pgm, struct libusb_transfer *t,
+			      int in, unsigned int requestid,
+			      unsigned int val, unsigned int index,
+			      const unsigned char *buffer, int buflen, int timeout,
+			      int *done)
+{
+  unsigned char *b;
+
+  free(t->buffer);   // left over from the last time t was used
+  t->buffer = NULL;
+  b = malloc(LIBUSB_CONTROL_SETUP_SIZE + buflen);
+  if (b == NULL) {
+    fprintf(stderr, "%s: usbtiny: out of memory\n", progname);
+    return -1;
+  }
+  libusb_fill_control_setup(b,
+			    (in? LIBUSB_ENDPOINT_IN: LIBUSB_ENDPOINT_OUT) |
+			    LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
+			    requestid, val, index, buflen);
+  if (!in && buflen > 0)
+    memcpy(b + LIBUSB_CONTROL_SETUP_SIZE, buffer, buflen);
+  libusb_fill_control_transfer(t, PDATA(pgm)->usb_handle, b,
+			       usbtiny_xfer_done, done, timeout);
+  t->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+  *done = 0;
+  return 0;
+}
+
+// Wait for an asynchronous transfer to complete.  Returns -1 if
+// libusb event handling fails; the transfer is still pending then.
+static int usbtiny_xfer_wait (PROGRAMMER * pgm, int *done)
+{
+  int rc;
+
+  while (!*done) {
+    rc = libusb_handle_events_completed(PDATA(pgm)->ctx, done);
+    if (rc < 0 && rc != LIBUSB_ERROR_INTERRUPTED) {
+      fprintf(stderr, "%s: usbtiny: %s\n", progname, libusb_error_name(rc));
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Wait for a cancelled transfer to come back.  Returns -1 if event
+// handling keeps failing; libusb still owns the transfer then, so it
+// must not be freed or reused, and its completion flag is moved to
+// where the caller's one may vanish without harm.
+static int usbtiny_xfer_reap (PROGRAMMER * pgm, struct libusb_transfer *t,
+			      int *done)
+{
+  static int lost;
+  int tries = 0;
+
+  while (!*done) {
+    if (libusb_handle_events_completed(PDATA(pgm)->ctx, done) < 0 &&
+	++tries == 10) {
+      t->user_data = &lost;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Queue chunk reads until the read-ahead window is full
+static void usbtiny_readahead_fill (PROGRAMMER * pgm)
+{
+  struct readahead *ra = &PDATA(pgm)->ra;
+  int slot, len;
+
+  while (ra->count < READAHEAD && ra->nextaddr < ra->endaddr) {
+    slot = (ra->head + ra->count) % READAHEAD;
+    if (ra->xfer[slot] == NULL)
+      return;          // lost to a failed cancel
+    len = ra->endaddr - ra->nextaddr;
+    if (len > ra->chunk)
+      len = ra->chunk;
+    if (usbtiny_xfer_fill(pgm, ra->xfer[slot], 1, ra->function,
+			  0, ra->nextaddr, NULL, len,
+			  USB_TIMEOUT + (len * 32 * PDATA(pgm)->sck_period) / 1000,
+			  &ra->done[slot]) < 0)
+      return;
+    if (libusb_submit_transfer(ra->xfer[slot]) < 0)
+      return;
+    ra->addr[slot] = ra->nextaddr;
+    ra->len[slot] = len;
+    ra->nextaddr += len;
+    ra->count++;
+  }
+}
+
+// Throw away all reads queued ahead
+static void usbtiny_readahead_drop (PROGRAMMER * pgm)
+{
+  struct readahead *ra = &PDATA(pgm)->ra;
+  int i, slot;
+
+  for (i = 0; i < ra->count; i++)
+    libusb_cancel_transfer(ra->xfer[(ra->head + i) % READAHEAD]);
+  for (i = 0; i < ra->count; i++) {
+    slot = (ra->head + i) % READAHEAD;
+    if (usbtiny_xfer_reap(pgm, ra->xfer[slot], &ra->done[slot]) < 0)
+      ra->xfer[slot] = NULL;   // still libusb's; leave it alone
+  }
+  ra->count = 0;
+}
+
+// Run transfers in order, all queued at once.  The transfers behind
+// the first one that fails are cancelled.
+static int usbtiny_run (PROGRAMMER * pgm, struct xfer *x, int n)
+{
+  struct libusb_transfer *t[MAX_XFERS];
+  int done[MAX_XFERS];
+  int i, j, nsub, rc = 0;
+
+  usbtiny_wait_ready(pgm);
+  usbtiny_readahead_drop(pgm);
+
+  for (nsub = 0; nsub < n; nsub++) {
+    t[nsub] = libusb_alloc_transfer(0);
+    if (t[nsub] == NULL ||
+	usbtiny_xfer_fill(pgm, t[nsub], x[nsub].in, x[nsub].requestid,
+			  x[nsub].val, x[nsub].index,
+			  x[nsub].buffer, x[nsub].buflen, x[nsub].timeout,
+			  &done[nsub]) < 0 ||
+	libusb_submit_transfer(t[nsub]) < 0) {
+      if (t[nsub] != NULL)
+	libusb_free_transfer(t[nsub]);
+      rc = -1;
+      break;
+    }
+  }
+
+  for (i = 0; i < nsub; i++) {
+    if (usbtiny_xfer_wait(pgm, &done[i]) < 0) {
+      // cancel what is left, and free what libusb gives back
+      for (j = i; j < nsub; j++)
+	libusb_cancel_transfer(t[j]);
+      for (j = i; j < nsub; j++)
+	if (usbtiny_xfer_reap(pgm, t[j], &done[j]) == 0)
+	  libusb_free_transfer(t[j]);
+      return -1;
+    }
+    if (rc < 0 && t[i]->status == LIBUSB_TRANSFER_CANCELLED) {
+      // cancelled after an earlier transfer failed
+    } else if (t[i]->status != LIBUSB_TRANSFER_COMPLETED ||
+	       t[i]->actual_length != x[i].buflen) {
+      if (rc == 0)
+	fprintf(stderr, "\n%s: error: usbtiny_send: transfer failed "
+		"(expected %d, got %d)\n",
+		progname, x[i].buflen, t[i]->actual_length);
+      // don't let a page commit follow a chunk that didn't arrive
+      for (j = i + 1; j < nsub; j++)
+	libusb_cancel_transfer(t[j]);
+      rc = -1;
+    } else if (x[i].in && x[i].buflen > 0) {
+      memcpy(x[i].buffer, libusb_control_transfer_get_data(t[i]), x[i].buflen);
+    }
+    libusb_free_transfer(t[i]);
+  }
+  if (rc < 0 && nsub < n)
+    fprintf(stderr, "\n%s: error: usbtiny_send: cannot submit transfer\n",
+	    progname);
+
+  return rc;
+}
+
+#else
+
+// Run transfers in order
+static int usbtiny_run (PROGRAMMER * pgm, struct xfer *x, int n)
+{
+  int i, nbytes;
+
+  for (i = 0; i < n; i++) {
+    nbytes = usbtiny_transfer(pgm, x[i].in, x[i].requestid,
+			      x[i].val, x[i].index,
+			      x[i].buffer, x[i].buflen, x[i].timeout);
+    if (nbytes != x[i].buflen) {
+      fprintf(stderr, "\n%s: error: usbtiny_send: %s (expected %d, got %d)\n",
+	      progname, usbtiny_strerror(nbytes), x[i].buflen, nbytes);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+#endif
+
 // Sometimes we just need to know the SPI command for the part to perform
 // a function. Here we wrap this request for an operation so that we
 // can just specify the part and operation and it'll do the right stuff
@@ -200,8 +517,16 @@ static int usbtiny_avr_op (PROGRAMMER * pgm, AVRPART * p,
 
 static	int	usbtiny_open(PROGRAMMER* pgm, char* name)
 {
+#ifdef USE_LIBUSB_1_0
+  libusb_device **devs;
+  libusb_device *dev;
+  struct libusb_device_descriptor desc;
+  ssize_t ndevs, i;
+  int rc;
+#else
   struct usb_bus      *bus;
   struct usb_device   *dev = 0;
+#endif
   char *bus_name = NULL;
   char *dev_name = NULL;
   int vid, pid;
@@ -220,10 +545,6 @@ static	int	usbtiny_open(PROGRAMMER* pgm, char* name)
     }
   }
 
-  usb_init();                    // initialize the libusb system
-  usb_find_busses();             // have libusb scan all the usb busses available
-  usb_find_devices();            // have libusb scan all the usb devices available
-
   PDATA(pgm)->usb_handle = NULL;
 
   if (pgm->usbvid)
@@ -237,6 +558,56 @@ static	int	usbtiny_open(PROGRAMMER* pgm, char* name)
     pid = USBTINY_PRODUCT_DEFAULT;
   
 
+#ifdef USE_LIBUSB_1_0
+  if ((rc = libusb_init(&PDATA(pgm)->ctx)) < 0) {
+    fprintf(stderr, "%s: Error: cannot initialize libusb: %s\n",
+	    progname, libusb_error_name(rc));
+    return -1;
+  }
+
+  ndevs = libusb_get_device_list(PDATA(pgm)->ctx, &devs);
+  for (i = 0; i < ndevs && !PDATA(pgm)->usb_handle; i++) {
+    dev = devs[i];
+    if (libusb_get_device_descriptor(dev, &desc) < 0 ||
+	desc.idVendor != vid || desc.idProduct != pid)
+      continue;
+    if(verbose)
+      fprintf(stderr,
+	      "%s: usbdev_open(): Found USBtinyISP, bus:device: %03d:%03d\n",
+	      progname, libusb_get_bus_number(dev),
+	      libusb_get_device_address(dev));
+    // if -P was given, match device by bus and device number
+    if(name != NULL &&
+      (NULL == dev_name ||
+       atoi(bus_name) != libusb_get_bus_number(dev) ||
+       atoi(dev_name) != libusb_get_device_address(dev)))
+      continue;
+    if ((rc = libusb_open(dev, &PDATA(pgm)->usb_handle)) < 0) {
+      fprintf(stderr, "%s: Warning: cannot open USB device: %s\n",
+	      progname, libusb_error_name(rc));
+      PDATA(pgm)->usb_handle = NULL;
+    }
+  }
+  if (ndevs >= 0)
+    libusb_free_device_list(devs, 1);
+
+  if (PDATA(pgm)->usb_handle) {
+    for (i = 0; i < READAHEAD; i++) {
+      if ((PDATA(pgm)->ra.xfer[i] = libusb_alloc_transfer(0)) == NULL) {
+	fprintf(stderr, "%s: usbtiny_open(): Out of memory\n", progname);
+	usbtiny_close(pgm);
+	return -1;
+      }
+    }
+  } else {
+    libusb_exit(PDATA(pgm)->ctx);
+    PDATA(pgm)->ctx = NULL;
+  }
+#else
+  usb_init();                    // initialize the libusb system
+  usb_find_busses();             // have libusb scan all the usb busses available
+  usb_find_devices();            // have libusb scan all the usb devices available
+
   // now we iterate through all the busses and devices
   for ( bus = usb_busses; bus; bus = bus->next ) {
     for	( dev = bus->devices; dev; dev = dev->next ) {
@@ -263,6 +634,7 @@ static	int	usbtiny_open(PROGRAMMER* pgm, char* name)
       }
     }
   }
+#endif
 
   if(NULL != name && NULL == dev_name) {
     fprintf(stderr, "%s: Error: Invalid -P value: '%s'\n", progname, name);
@@ -281,10 +653,26 @@ static	int	usbtiny_open(PROGRAMMER* pgm, char* name)
 /* Clean up the handle for the usbtiny */
 static	void usbtiny_close ( PROGRAMMER* pgm )
 {
+#ifdef USE_LIBUSB_1_0
+  int i;
+#endif
+
   if (! PDATA(pgm)->usb_handle) {
     return;                // not a valid handle, bail!
   }
+#ifdef USE_LIBUSB_1_0
+  usbtiny_readahead_drop(pgm);
+  for (i = 0; i < READAHEAD; i++) {
+    if (PDATA(pgm)->ra.xfer[i] != NULL)
+      libusb_free_transfer(PDATA(pgm)->ra.xfer[i]);
+    PDATA(pgm)->ra.xfer[i] = NULL;
+  }
+  libusb_close(PDATA(pgm)->usb_handle);
+  libusb_exit(PDATA(pgm)->ctx);
+  PDATA(pgm)->ctx = NULL;
+#else
   usb_close(PDATA(pgm)->usb_handle);   // ask libusb to clean up
+#endif
   PDATA(pgm)->usb_handle = NULL;
 }
 
@@ -436,6 +824,62 @@ static	void	usbtiny_enable ( PROGRAMMER* pgm ) {}
 static void usbtiny_disable ( PROGRAMMER* pgm ) {}
 
 
+#ifdef USE_LIBUSB_1_0
+/* Take the chunk at addr from the reads queued ahead, restarting the
+ * queue there if it holds something else.  Returns 0 with *chunk set
+ * to the number of bytes stored in m->buf, or -1 if the chunk has to
+ * be read synchronously.
+ */
+static int usbtiny_readahead_get (PROGRAMMER * pgm, int function, AVRMEM * m,
+				  unsigned int page_size, unsigned int addr,
+				  int *chunk)
+{
+  struct readahead *ra = &PDATA(pgm)->ra;
+  struct libusb_transfer *t;
+  int slot, len;
+
+  usbtiny_wait_ready(pgm);
+  if (ra->count == 0 || ra->function != function ||
+      ra->addr[ra->head] != addr || ra->endaddr != m->size) {
+    usbtiny_readahead_drop(pgm);
+    ra->head = 0;
+    ra->function = function;
+    ra->nextaddr = addr;
+    ra->endaddr = m->size;
+    ra->chunk = PDATA(pgm)->chunk_size;
+    if (page_size > 0 && ra->chunk > page_size)
+      ra->chunk = page_size;
+  }
+  usbtiny_readahead_fill(pgm);
+  if (ra->count == 0)
+    return -1;
+
+  slot = ra->head;
+  t = ra->xfer[slot];
+  if (usbtiny_xfer_wait(pgm, &ra->done[slot]) < 0) {
+    usbtiny_readahead_drop(pgm);
+    return -1;
+  }
+  ra->head = (ra->head + 1) % READAHEAD;
+  ra->count--;
+
+  len = ra->len[slot];
+  if (t->status != LIBUSB_TRANSFER_COMPLETED || t->actual_length != len) {
+    PDATA(pgm)->retries++;
+    usbtiny_readahead_drop(pgm);
+    return -1;
+  }
+  if (len > *chunk)
+    len = *chunk;     // queued read runs past the end of this request
+  memcpy(m->buf + addr, libusb_control_transfer_get_data(t), len);
+  *chunk = len;
+
+  // keep the queue going while the caller works on this chunk
+  usbtiny_readahead_fill(pgm);
+  return 0;
+}
+#endif
+
 /* To speed up programming and reading, we do a 'chunked' read.
  *  We request just the data itself and the USBtiny uses the SPI function
  *  given to read in the data. Much faster than sending a 4-byte SPI request
@@ -459,6 +903,13 @@ static int usbtiny_paged_load (PROGRAMMER * pgm, AVRPART * p, AVRMEM* m,
 
   for (; addr < maxaddr; addr += chunk) {
     chunk = PDATA(pgm)->chunk_size;         // start with the maximum chunk size possible
+    if (chunk > maxaddr - addr)
+      chunk = maxaddr - addr;
+
+#ifdef USE_LIBUSB_1_0
+    if (usbtiny_readahead_get(pgm, function, m, page_size, addr, &chunk) == 0)
+      continue;
+#endif
 
     // Send the chunk of data to the USBtiny with the function we want
     // to perform
@@ -479,6 +930,68 @@ static int usbtiny_paged_load (PROGRAMMER * pgm, AVRPART * p, AVRMEM* m,
   return n_bytes;
 }
 
+// Fill in a control transfer for usbtiny_run()
+static void usbtiny_xfer_set (PROGRAMMER * pgm, struct xfer *x, int in,
+			      unsigned int requestid,
+			      unsigned int val, unsigned int index,
+			      unsigned char *buffer, int buflen, int bitclk)
+{
+  x->in = in;
+  x->requestid = requestid;
+  x->val = val;
+  x->index = index;
+  x->buffer = buffer;
+  x->buflen = buflen;
+  x->timeout = USB_TIMEOUT + (buflen * bitclk) / 1000;
+}
+
+/* Append the SPI commands that commit the page at addr to x, the
+ * responses going to res.  Returns the number of transfers added,
+ * or -1 if the memory can't be written by pages.  This is what
+ * avr_write_page() sends, minus the wait for the write to finish.
+ */
+static int usbtiny_page_commit (PROGRAMMER * pgm, AVRMEM * m,
+				unsigned long addr, struct xfer *x,
+				unsigned char res[][4])
+{
+  OPCODE *wp, *lext;
+  unsigned char cmd[4];
+  int n = 0;
+
+  wp = m->op[AVR_OP_WRITEPAGE];
+  if (wp == NULL) {
+    fprintf(stderr,
+	    "%s: usbtiny_paged_write(): memory \"%s\" not configured for page writes\n",
+	    progname, m->desc);
+    return -1;
+  }
+
+  // word-addressed memories take the page address in words
+  if (m->op[AVR_OP_LOADPAGE_LO] || m->op[AVR_OP_READ_LO])
+    addr /= 2;
+
+  lext = m->op[AVR_OP_LOAD_EXT_ADDR];
+  if (lext != NULL) {
+    memset(cmd, 0, sizeof(cmd));
+    avr_set_bits(lext, cmd);
+    avr_set_addr(lext, cmd, addr);
+    usbtiny_xfer_set(pgm, &x[n], 1, USBTINY_SPI,
+		     (cmd[1] << 8) | cmd[0], (cmd[3] << 8) | cmd[2],
+		     res[n], 4, 8 * PDATA(pgm)->sck_period);
+    n++;
+  }
+
+  memset(cmd, 0, sizeof(cmd));
+  avr_set_bits(wp, cmd);
+  avr_set_addr(wp, cmd, addr);
+  usbtiny_xfer_set(pgm, &x[n], 1, USBTINY_SPI,
+		   (cmd[1] << 8) | cmd[0], (cmd[3] << 8) | cmd[2],
+		   res[n], 4, 8 * PDATA(pgm)->sck_period);
+  n++;
+
+  return n;
+}
+
 /* To speed up programming and reading, we do a 'chunked' write.
  *  We send just the data itself and the USBtiny uses the SPI function
  *  given to write the data. Much faster than sending a 4-byte SPI request
@@ -493,6 +1006,9 @@ static int usbtiny_paged_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
   int next;
   int function;     // which SPI command to use
   int delay;        // delay required between SPI commands
+  struct xfer x[MAX_XFERS];
+  unsigned char res[2][4];
+  int n = 0, rc;
 
   // First determine what we're doing
   if (strcmp( m->desc, "flash" ) == 0) {
@@ -518,27 +1034,42 @@ static int usbtiny_paged_write(PROGRAMMER * pgm, AVRPART * p, AVRMEM * m,
     // we can only write a page at a time anyways
     if (m->paged && chunk > page_size)
       chunk = page_size;
-
-    if (usb_out(pgm,
-		function,       // Flash or EEPROM
-		delay,          // How much to wait between each byte
-		addr,           // Address in memory
-		m->buf + addr,  // Pointer to data
-		chunk,          // Number of bytes to write
-		32 * PDATA(pgm)->sck_period + delay  // each byte gets turned into a
-	                             // 4-byte SPI cmd  usb_out() multiplies
-	                             // this per byte. Then add the cmd-delay
-		) < 0) {
-      return -1;
-    }
+    if (chunk > maxaddr - addr)
+      chunk = maxaddr - addr;
+
+    usbtiny_xfer_set(pgm, &x[n++],
+		     0,
+		     function,       // Flash or EEPROM
+		     delay,          // How much to wait between each byte
+		     addr,           // Address in memory
+		     m->buf + addr,  // Pointer to data
+		     chunk,          // Number of bytes to write
+		     32 * PDATA(pgm)->sck_period + delay  // each byte gets turned into a
+		                  // 4-byte SPI cmd  usbtiny_xfer_set() multiplies
+		                  // this per byte. Then add the cmd-delay
+		     );
 
     next = addr + chunk;       // Calculate what address we're at now
     if (m->paged
 	&& ((next % page_size) == 0 || next == maxaddr) ) {
-      // If we're at a page boundary, send the SPI command to flush it.
-      avr_write_page(pgm, p, m, (unsigned long) addr);
+      // If we're at a page boundary, send the SPI command to flush it,
+      // together with the page data so they are all queued at once.
+      if ((rc = usbtiny_page_commit(pgm, m, addr, &x[n], res)) < 0)
+	return -1;
+      if (usbtiny_run(pgm, x, n + rc) < 0)
+	return -1;
+      n = 0;
+      // Since we don't know what voltage the target AVR is powered by,
+      // be conservative and wait the max amount the spec says.  The
+      // next transfer to the USBtiny waits for it.
+      usbtiny_set_busy(pgm, m->max_write_delay);
+    } else if (n == MAX_XFERS - 2 || next == maxaddr) {
+      if (usbtiny_run(pgm, x, n) < 0)
+	return -1;
+      n = 0;
     }
   }
+
   return n_bytes;
 }
 